@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "inflate.h"
+#include "util.h"
+
+/*
+ * Lists the members of tar archives by walking their headers only.
+ * Member data of a plain tar is seeked over, a gzipped one is inflated as
+ * a stream and thrown away, and listing stops as soon as the caller has
+ * seen enough members.
+ */
+
+#define BLOCK 512
+#define LONGNAME_MAX 4096 /* longer GNU or pax names are cut */
+
+/* ustar header fields */
+#define T_NAME 0
+#define T_SIZE 124
+#define T_CHKSUM 148
+#define T_TYPE 156
+#define T_MAGIC 257
+#define T_PREFIX 345
+
+typedef struct {
+	unsigned char block[BLOCK]; /* header being filled */
+	size_t have;
+	off_t data; /* member data left */
+	off_t pad; /* padding left after it */
+	int collect; /* member data is a long name or pax header, not skipped */
+	char *longname; /* name of the next member */
+	size_t longlen;
+	off_t pax_size; /* size of the next member from a pax header, or -1 */
+	int members;
+	int status; /* 0 while listing, 1 stopped, -1 corrupt, 2 end */
+	archive_cb cb;
+	void *arg;
+} tar_state;
+
+enum { COLLECT_NONE, COLLECT_NAME, COLLECT_PAX };
+
+int archive_type(const char *path)
+{
+	size_t len = strlen(path);
+	const struct { const char *ext; int type; } exts[] = {
+		{ ".tar", ARCHIVE_TAR },
+		{ ".tar.gz", ARCHIVE_TGZ },
+		{ ".tgz", ARCHIVE_TGZ },
+	};
+	for (size_t i = 0; i < LEN(exts); i++) {
+		size_t n = strlen(exts[i].ext);
+		if (len > n && !strcasecmp(path + len - n, exts[i].ext))
+			return exts[i].type;
+	}
+	return ARCHIVE_NONE;
+}
+
+/*
+ * Parse a numeric field, octal or GNU base-256 for big files
+ */
+static off_t tar_number(const unsigned char *field, int len)
+{
+	off_t v = 0;
+	if (field[0] & 0x80) {
+		v = field[0] & 0x3f;
+		for (int i = 1; i < len; i++)
+			v = (v << 8) | field[i];
+		return v;
+	}
+	while (len && (*field == ' ' || *field == '\0'))
+		field++, len--;
+	for (int i = 0; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		v = (v << 3) | (field[i] - '0');
+	return v;
+}
+
+static int checksum_ok(const unsigned char *b)
+{
+	long sum = 0;
+	for (int i = 0; i < BLOCK; i++)
+		sum += i >= T_CHKSUM && i < T_CHKSUM + 8 ? ' ' : b[i];
+	return sum == tar_number(b + T_CHKSUM, 8);
+}
+
+/*
+ * Pick path and size out of pax "length key=value\n" records
+ */
+static void parse_pax(tar_state *t)
+{
+	char *s = t->longname, *end = s + t->longlen;
+	char *name = NULL;
+	while (s < end) {
+		char *rec = s;
+		long reclen = strtol(s, &s, 10);
+		if (reclen <= 0 || rec + reclen > end || *s != ' ')
+			break;
+		char *key = s + 1, *rec_end = rec + reclen - 1; /* at the newline */
+		char *eq = memchr(key, '=', rec_end - key);
+		if (eq) {
+			*rec_end = '\0';
+			if (eq - key == 4 && !strncmp(key, "path", 4))
+				name = eq + 1;
+			else if (eq - key == 4 && !strncmp(key, "size", 4))
+				t->pax_size = strtoll(eq + 1, NULL, 10);
+		}
+		s = rec + reclen;
+	}
+	if (name)
+		memmove(t->longname, name, strlen(name) + 1);
+	else
+		t->longname[0] = '\0';
+}
+
+static void collect_done(tar_state *t)
+{
+	t->longname[t->longlen] = '\0';
+	if (t->collect == COLLECT_PAX)
+		parse_pax(t);
+	t->collect = COLLECT_NONE;
+}
+
+static void tar_header(tar_state *t)
+{
+	const unsigned char *b = t->block;
+	if (b[0] == '\0') {
+		/* end of archive, or something else entirely */
+		t->status = t->members ? 2 : -1;
+		return;
+	}
+	if (!checksum_ok(b)) {
+		t->status = -1;
+		return;
+	}
+
+	off_t size = tar_number(b + T_SIZE, 12);
+	char type = b[T_TYPE];
+	t->data = size;
+	t->pad = (BLOCK - size % BLOCK) % BLOCK;
+
+	if (type == 'L' || type == 'x') {
+		t->collect = type == 'L' ? COLLECT_NAME : COLLECT_PAX;
+		t->longname = rememalloc(t->longname, LONGNAME_MAX + 1);
+		t->longlen = 0;
+		if (!size)
+			collect_done(t);
+		return;
+	}
+	if (type == 'g' || type == 'K')
+		return;
+
+	char name[256 + 2];
+	const char *shown = name;
+	if (t->longname && t->longname[0]) {
+		shown = t->longname;
+	} else if (!memcmp(b + T_MAGIC, "ustar", 5) && b[T_PREFIX]) {
+		snprintf(name, sizeof(name), "%.155s/%.100s", b + T_PREFIX, b + T_NAME);
+	} else {
+		snprintf(name, sizeof(name), "%.100s", b + T_NAME);
+	}
+	if (t->pax_size >= 0) {
+		size = t->pax_size;
+		t->data = size;
+		t->pad = (BLOCK - size % BLOCK) % BLOCK;
+	}
+	t->members++;
+	if (t->cb(t->arg, shown, size, type ? type : '0'))
+		t->status = 1;
+
+	if (t->longname)
+		t->longname[0] = '\0';
+	t->pax_size = -1;
+}
+
+/*
+ * Feed len bytes of the tar stream
+ */
+static void tar_feed(tar_state *t, const unsigned char *buf, size_t len)
+{
+	while (len && !t->status) {
+		size_t take;
+		if (t->data) {
+			take = t->data < (off_t) len ? (size_t) t->data : len;
+			if (t->collect) {
+				size_t room = LONGNAME_MAX - t->longlen;
+				size_t n = take < room ? take : room;
+				memcpy(t->longname + t->longlen, buf, n);
+				t->longlen += n;
+			}
+			t->data -= take;
+			if (!t->data && t->collect)
+				collect_done(t);
+		} else if (t->pad) {
+			take = t->pad < (off_t) len ? (size_t) t->pad : len;
+			t->pad -= take;
+		} else {
+			take = BLOCK - t->have < len ? BLOCK - t->have : len;
+			memcpy(t->block + t->have, buf, take);
+			t->have += take;
+			if (t->have == BLOCK) {
+				t->have = 0;
+				tar_header(t);
+			}
+		}
+		buf += take;
+		len -= take;
+	}
+}
+
+static int gzip_sink(void *arg, const unsigned char *data, size_t len)
+{
+	tar_state *t = arg;
+	tar_feed(t, data, len);
+	if (!t->status && t->cb(t->arg, NULL, 0, 0))
+		t->status = 1;
+	return t->status;
+}
+
+/*
+ * Read headers of a plain tar, seeking over member data
+ */
+static void list_tar(int fd, tar_state *t)
+{
+	unsigned char buf[BLOCK];
+	while (!t->status) {
+		if (!t->collect && (t->data || t->pad)) {
+			if (lseek(fd, t->data + t->pad, SEEK_CUR) == -1) {
+				t->status = -1;
+				break;
+			}
+			t->data = t->pad = 0;
+			continue;
+		}
+		ssize_t n = read(fd, buf, BLOCK);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		tar_feed(t, buf, n);
+	}
+}
+
+/*
+ * List the members of archive fd of the given type through cb
+ * Returns the number of members seen, or -1 if it isn't a valid archive
+ */
+int archive_list(int fd, int type, archive_cb cb, void *arg)
+{
+	tar_state t = {
+		.pax_size = -1,
+		.cb = cb,
+		.arg = arg,
+	};
+	if (type == ARCHIVE_TGZ) {
+		if (inflate_gzip(fd, gzip_sink, &t) == -1 && !t.members)
+			t.status = -1;
+	} else {
+		list_tar(fd, &t);
+	}
+	free(t.longname);
+	return t.status == -1 && !t.members ? -1 : t.members;
+}
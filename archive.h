@@ -0,0 +1,22 @@
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include <sys/types.h>
+
+enum archives {
+	ARCHIVE_NONE,
+	ARCHIVE_TAR,
+	ARCHIVE_TGZ
+};
+
+/*
+ * Gets every member of an archive, returns nonzero to stop listing.
+ * While inflating data between members it is also called with a NULL name
+ * so listing can be stopped midway.
+ */
+typedef int (*archive_cb)(void *arg, const char *name, off_t size, char type);
+
+int archive_type(const char *path);
+int archive_list(int fd, int type, archive_cb cb, void *arg);
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "util.h"
+
+/*
+ * LRU of rendered previews, keyed by path, mtime, size and pane.
+ * Only touched from the UI thread, so it needs no locking.
+ */
+typedef struct entry {
+	char *path;
+	struct timespec mtime;
+	off_t size;
+	pane pn; /* rows are those asked for when rendered */
+	preview *p;
+	size_t bytes; /* memory charged to the budget */
+	struct entry *next; /* hash chain */
+	struct entry *newer, *older; /* LRU list */
+} entry;
+
+static entry **buckets = NULL;
+static size_t nbuckets = 0;
+static size_t nentries = 0;
+static entry *newest = NULL, *oldest = NULL;
+static size_t used = 0, budget = 0;
+
+static size_t key_hash(const char *path, int width)
+{
+	/* FNV-1a */
+	size_t h = 2166136261u;
+	for (; *path; path++) {
+		h ^= (unsigned char) *path;
+		h *= 16777619u;
+	}
+	return h ^ width;
+}
+
+static void lru_unlink(entry *e)
+{
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		newest = e->older;
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		oldest = e->newer;
+}
+
+static void lru_push(entry *e)
+{
+	e->newer = NULL;
+	e->older = newest;
+	if (newest)
+		newest->newer = e;
+	newest = e;
+	if (!oldest)
+		oldest = e;
+}
+
+static void entry_remove(entry *e)
+{
+	entry **pp = &buckets[key_hash(e->path, e->pn.width) % nbuckets];
+	while (*pp != e)
+		pp = &(*pp)->next;
+	*pp = e->next;
+	lru_unlink(e);
+	used -= e->bytes;
+	nentries--;
+	preview_free(e->p);
+	free(e->path);
+	free(e);
+}
+
+static void rehash(size_t n)
+{
+	entry **new_buckets = memalloc(n * sizeof(entry *));
+	memset(new_buckets, 0, n * sizeof(entry *));
+	for (size_t i = 0; i < nbuckets; i++) {
+		entry *e = buckets[i];
+		while (e) {
+			entry *next = e->next;
+			size_t b = key_hash(e->path, e->pn.width) % n;
+			e->next = new_buckets[b];
+			new_buckets[b] = e;
+			e = next;
+		}
+	}
+	free(buckets);
+	buckets = new_buckets;
+	nbuckets = n;
+}
+
+static entry *lookup(const char *path, const pane *pn)
+{
+	entry *e = buckets[key_hash(path, pn->width) % nbuckets];
+	for (; e; e = e->next) {
+		if (e->pn.width == pn->width && e->pn.flags == pn->flags && e->pn.page == pn->page
+				&& !strcmp(e->path, path))
+			return e;
+	}
+	return NULL;
+}
+
+static int same_file(const entry *e, const struct stat *st)
+{
+	return e->size == st->st_size && e->mtime.tv_sec == st->st_mtim.tv_sec
+		&& e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+void cache_init(size_t size)
+{
+	budget = size;
+	rehash(64);
+}
+
+/*
+ * Get the cached preview of path if the file hasn't changed since
+ * and it has enough rows for the window
+ */
+preview *cache_get(const char *path, const struct stat *st, const pane *pn)
+{
+	entry *e = lookup(path, pn);
+	if (!e)
+		return NULL;
+	if (!same_file(e, st)) {
+		entry_remove(e);
+		return NULL;
+	}
+	/* a preview shorter than asked for already has the whole file */
+	if (e->pn.rows < pn->rows && e->p->length >= e->pn.rows)
+		return NULL;
+
+	lru_unlink(e);
+	lru_push(e);
+	return e->p;
+}
+
+/*
+ * Store a rendered preview, the cache takes ownership of p.
+ * Least recently used previews are dropped to stay in budget but
+ * the newest one is always kept, it is the one on screen.
+ */
+void cache_put(const char *path, const struct stat *st, const pane *pn, preview *p)
+{
+	entry *e = lookup(path, pn);
+	if (e)
+		entry_remove(e);
+
+	e = memalloc(sizeof(entry));
+	e->path = estrdup((char *) path);
+	e->mtime = st->st_mtim;
+	e->size = st->st_size;
+	e->pn = *pn;
+	e->p = p;
+	e->bytes = sizeof(entry) + strlen(path) + 1 + sizeof(preview)
+		+ p->capacity * sizeof(char *);
+	for (int i = 0; i < p->length; i++)
+		e->bytes += strlen(p->lines[i]) + 1;
+
+	if (nentries + 1 > nbuckets)
+		rehash(nbuckets * 2);
+	size_t b = key_hash(path, pn->width) % nbuckets;
+	e->next = buckets[b];
+	buckets[b] = e;
+	lru_push(e);
+	used += e->bytes;
+	nentries++;
+
+	while (used > budget && oldest != newest)
+		entry_remove(oldest);
+}
+
+void cache_free(void)
+{
+	while (oldest)
+		entry_remove(oldest);
+	free(buckets);
+	buckets = NULL;
+	nbuckets = 0;
+}
@@ -0,0 +1,13 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <sys/stat.h>
+
+#include "preview.h"
+
+void cache_init(size_t budget);
+preview *cache_get(const char *path, const struct stat *st, const pane *pn);
+void cache_put(const char *path, const struct stat *st, const pane *pn, preview *p);
+void cache_free(void);
+
+#endif
@@ -2,7 +2,8 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -14,11 +15,20 @@
 #include <termios.h>
 #include <time.h>
 
+#include "copy.h"
+#include "du.h"
 #include "icons.h"
 #include "file.h"
+#include "frecency.h"
+#include "job.h"
+#include "largest.h"
+#include "lscolors.h"
+#include "trash.h"
+#include "preview.h"
+#include "rename.h"
+#include "session.h"
 #include "util.h"
 
-#define LEN(x) (sizeof(x) / sizeof(*(x)))
 #define PATH_MAX 4096 /* Max length of path */
 
 /* Keybindings */
@@ -52,13 +62,27 @@ typedef struct {
 } Key;
 
 void keybinding(void);
+void wait_for_input(void);
 void handle_sigwinch(int ignore);
 void cleanup(void);
+void replace_home(char *str);
 char *check_trash_dir(void);
 void change_dir(const char *buf, int selection, int ftype);
 void populate_files(const char *path, int ftype, ArrayList **list);
+int restore_session(void);
+void save_session(void);
 void add_file_stat(char *filename, char *path, int ftype);
+int size_width(void);
+void format_size(double bytes, char *size);
+void request_dir_sizes(void);
+void set_dir_size(const char *path, off_t size);
+void refresh_files(void);
+void update_largest(void);
 void list_files(void);
+void draw_status(void);
+void draw_preview(preview *p);
+pane preview_pane(void);
+void prefetch_previews(void);
 char *get_panel_string(char *prompt);
 void quit(const Arg *arg);
 void reload(const Arg *arg);
@@ -70,6 +94,9 @@ void nav_up(const Arg *arg);
 void nav_down(const Arg *arg);
 void nav_bottom(const Arg *arg);
 void nav_top(const Arg *arg);
+void preview_page_down(const Arg *arg);
+void preview_page_up(const Arg *arg);
+void toggle_follow(const Arg *arg);
 void goto_home_dir(const Arg *arg);
 void goto_trash_dir(const Arg *arg);
 void sort_files(const Arg *arg);
@@ -90,12 +117,19 @@ void open_with(const Arg *arg);
 void open_detached(const Arg *arg);
 void view_file_attr(const Arg *arg);
 void show_history(const Arg *arg);
+void jump_dir(const Arg *arg);
 void open_fav(const Arg *arg);
 void mark_file(const Arg *arg);
 void mark_all(const Arg *arg);
+char **marked_paths(void);
+void clear_marked(void);
 void delete_files(const Arg *arg);
+void hard_delete_files(const Arg *arg);
 void move_files(const Arg *arg);
 void copy_files(const Arg *arg);
+void show_jobs(const Arg *arg);
+void show_trash(const Arg *arg);
+void show_largest(const Arg *arg);
 void symbolic_link(const Arg *arg);
 void bulk_rename(const Arg *arg);
 void wpprintw(const char *fmt, ...);
@@ -117,7 +151,21 @@ ArrayList *tmp1; /* temp store of dirs */
 ArrayList *tmp2; /* tmp store of files */
 int rows, cols;
 struct termios oldt, newt;
-unsigned long total_dir_size = 0;
+long preview_page = 0; /* page of hex dump shown in preview */
+int preview_hex = 0; /* the preview drawn is a hex dump */
+int follow_mode = 0; /* preview shows the live tail of the selected file */
+long dir_sizes_top = -1; /* first row shown when sizes were last asked for */
+long prefetch_sel = 0; /* selection previews were last prefetched around */
+int largest_mode = 0; /* listing the largest files under cwd */
+long largest_scanned = 0; /* files looked at for it */
+int largest_going = 0; /* still looking */
+struct stat listed; /* cwd when files was read */
+volatile sig_atomic_t resized = 0;
+
+/* Where the size is in a file's stats, after its mode and time */
+#define STATS_SIZE_OFFSET (11 + 17)
+/* Size of a directory still being added up */
+#define SIZE_PENDING "…"
 
 #include "config.h"
 
@@ -184,11 +232,36 @@ int main(int argc, char **argv)
 
 	/* init files and marked arrays */
 	marked = arraylist_init(100);
-	hashtable_init();
+	static const int type_colors[] = {
+		[REG] = REG_COLOR, [DRY] = DIR_COLOR, [LNK] = LNK_COLOR, [CHR] = CHR_COLOR,
+		[SOC] = SOC_COLOR, [BLK] = BLK_COLOR, [FIF] = FIF_COLOR,
+	};
+	lscolors_init(getenv("LS_COLORS"), getenv("CCC_ICONS"));
+	preview_init(preview_cache_size, prefetch_workers, previewer, type_colors);
+	job_init(copy_workers, delete_workers);
+	char index[PATH_MAX];
+	strcpy(index, du_index);
+	if (index[0] == '~')
+		replace_home(index);
+	du_init(du_workers, index);
+	strcpy(index, frecency_file);
+	if (index[0] == '~')
+		replace_home(index);
+	frecency_init(index, frecency_max);
+	largest_init();
+	if (strcmp(trash_dir, "")) {
+		char *path = check_trash_dir();
+		/* throw out what is past the limits in the background */
+		if (!trash_init(path, trash_max_age, trash_max_size) && (trash_max_age || trash_max_size))
+			job_add(JOB_PURGE, NULL, 0, NULL);
+		free(path);
+	}
 
-	getcwd(cwd, PATH_MAX);
-	populate_files(cwd, 0, &files);
 	get_window_size(&rows, &cols);
+	getcwd(cwd, PATH_MAX);
+	/* a path given says where to start */
+	if (argc != 1 || restore_session())
+		populate_files(cwd, 0, &files);
 
 	if (to_open_file) {
 		sel_file = arraylist_search(files, argv_cp, 1);
@@ -203,6 +276,7 @@ int main(int argc, char **argv)
 
 void keybinding(void)
 {
+	wait_for_input();
 	int c = readch();
 	for (int i = 0; i < LEN(keybindings); i++) {
 		if (c == keybindings[i].key) {
@@ -212,20 +286,93 @@ void keybinding(void)
 	}
 }
 
+/*
+ * Block until a key is pressed, drawing previews as they finish
+ * and redrawing the window when it is resized
+ */
+void wait_for_input(void)
+{
+	struct pollfd fds[] = {
+		{ STDIN_FILENO, POLLIN, 0 },
+		{ preview_fd(), POLLIN, 0 },
+		{ preview_follow_fd(), POLLIN, 0 },
+		{ job_fd(), POLLIN, 0 },
+		{ du_fd(), POLLIN, 0 },
+		{ largest_fd(), POLLIN, 0 },
+	};
+	while (1) {
+		if (resized) {
+			resized = 0;
+			get_window_size(&rows, &cols);
+			list_files();
+		}
+		/* following starts and stops as previews are drawn */
+		fds[2].fd = preview_follow_fd();
+		fflush(stdout);
+		if (poll(fds, LEN(fds), -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if (fds[1].revents & POLLIN) {
+			preview *p = preview_collect();
+			if (p)
+				draw_preview(p);
+		}
+		if (fds[2].revents & POLLIN) {
+			preview *p = preview_follow_update();
+			if (p)
+				draw_preview(p);
+		}
+		if (fds[3].revents & POLLIN) {
+			if (job_collect()) {
+				/* files were copied, moved or trashed */
+				refresh_files();
+				list_files();
+			} else {
+				draw_status();
+			}
+		}
+		if (fds[4].revents & POLLIN) {
+			char path[PATH_MAX];
+			off_t size;
+			int got = 0;
+			while (du_collect(path, &size)) {
+				set_dir_size(path, size);
+				got = 1;
+			}
+			if (got)
+				list_files();
+		}
+		if (fds[5].revents & POLLIN) {
+			update_largest();
+			if (largest_mode)
+				list_files();
+		}
+		if (fds[0].revents)
+			return;
+	}
+}
+
 void handle_sigwinch(int ignore)
 {
-	get_window_size(&rows, &cols);
-	list_files();
+	resized = 1;
 }
 
 void cleanup(void)
 {
-	hashtable_free();
+	job_cleanup();
+	trash_cleanup();
+	du_cleanup();
+	largest_cleanup();
+	frecency_cleanup();
+	preview_unfollow();
+	preview_cleanup();
+	lscolors_cleanup();
 	if (files->length != 0) {
 		arraylist_free(files);
 	}
-	free(marked->items);
-	free(marked);
+	arraylist_free(marked);
 	/* Restore old terminal settings */
 	tcsetattr(STDIN_FILENO, TCSAFLUSH, &oldt);
 	printf("\033[2J\033[?1049l\033[?25h");
@@ -335,6 +482,7 @@ void populate_files(const char *path, int ftype, ArrayList **list)
 		if (ftype == 0) {
 			tmp1 = arraylist_init(10);
 			tmp2 = arraylist_init(10);
+			fstat(dirfd(dp), &listed);
 		}
 
 		while ((ep = readdir(dp))) {
@@ -370,6 +518,67 @@ void populate_files(const char *path, int ftype, ArrayList **list)
 	}
 }
 
+/*
+ * Pick up where the session saved last left off, using its listing if
+ * the directory hasn't changed since.
+ * Returns nonzero if there is none
+ */
+int restore_session(void)
+{
+	if (!strcmp(session_file, ""))
+		return -1;
+	char path[PATH_MAX];
+	strcpy(path, session_file);
+	if (path[0] == '~')
+		replace_home(path);
+	session s;
+	if (session_load(path, &s))
+		return -1;
+	if (chdir(s.cwd)) {
+		free(s.cwd);
+		free(s.p_cwd);
+		if (s.files)
+			arraylist_free(s.files);
+		arraylist_free(s.marked);
+		return -1;
+	}
+	strcpy(cwd, s.cwd);
+	strcpy(p_cwd, s.p_cwd);
+	free(s.cwd);
+	free(s.p_cwd);
+	show_hidden = !!(s.flags & SESSION_HIDDEN);
+	show_details = !!(s.flags & SESSION_DETAILS);
+	show_icons = !!(s.flags & SESSION_ICONS);
+	dirs_size = !!(s.flags & SESSION_SIZES);
+	arraylist_free(marked);
+	marked = s.marked;
+	if (s.files) {
+		files = s.files;
+		stat(cwd, &listed);
+	} else {
+		populate_files(cwd, 0, &files);
+	}
+	sel_file = s.sel < (long) files->length ? s.sel : 0;
+	if (dirs_size)
+		request_dir_sizes();
+	return 0;
+}
+
+void save_session(void)
+{
+	if (!strcmp(session_file, ""))
+		return;
+	char path[PATH_MAX];
+	strcpy(path, session_file);
+	if (path[0] == '~')
+		replace_home(path);
+	session s = { cwd, p_cwd, sel_file, 0, files, marked };
+	s.flags = (show_hidden ? SESSION_HIDDEN : 0) | (show_details ? SESSION_DETAILS : 0)
+		| (show_icons ? SESSION_ICONS : 0) | (dirs_size ? SESSION_SIZES : 0);
+	/* the largest files are not a listing of cwd */
+	session_save(path, &s, largest_mode ? NULL : &listed);
+}
+
 /*
  * Change directory in window with selection
  */
@@ -380,24 +589,28 @@ void change_dir(const char *buf, int selection, int ftype)
 		strcpy(tmp, buf);
 		strcpy(p_cwd, cwd);
 		strcpy(cwd, tmp);
-		char history_path[PATH_MAX];
-		strcpy(history_path, "~/.cache/ccc/history");
-		replace_home(history_path);
-		FILE *history_file = fopen(history_path, "a");
-		fprintf(history_file, "%s\n", cwd);
-		fclose(history_file);
-	}
-	if (ftype == 0)
+		frecency_visit(cwd);
+	}
+	if (ftype == 0) {
 		arraylist_free(files);
+		preview_prefetch_cancel();
+		prefetch_sel = selection;
+		if (largest_mode) {
+			largest_mode = 0;
+			largest_stop();
+		}
+	}
 	chdir(cwd);
 	sel_file = selection;
 	populate_files(cwd, ftype, &files);
-}
-
-int get_directory_size(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
-{
-	total_dir_size += sb->st_size;
-	return 0;
+	if (ftype == 0) {
+		/* sizes of what was here before are not wanted anymore */
+		dir_sizes_top = -1;
+		if (dirs_size)
+			request_dir_sizes();
+		else
+			du_cancel();
+	}
 }
 
 /*
@@ -410,6 +623,8 @@ void add_file_stat(char *filename, char *path, int ftype)
 	struct stat file_stat;
 	if (stat(path, &file_stat) == -1) {
 		perror("stat()");
+		free(filename);
+		free(path);
 		return;
 	}
 
@@ -417,15 +632,8 @@ void add_file_stat(char *filename, char *path, int ftype)
 	char icon_str[8] = {0};
 
 	filename[strlen(filename)] = '\0';
-	/* handle file without extension
-	 * ext is the extension if . exist in filename
-	 * otherwise is nothing and handled through tenery operator */
-	char *ext = strrchr(filename, '.');
-	if (ext) {
-		ext += 1;
-	}
 	/* add file extension */
-	icon *ext_icon = hashtable_search(ext ? ext : filename);
+	const icon *ext_icon = icon_search(filename);
 	if (!ext_icon) {
 		char ch[] = "";
 		memcpy(icon_str, ch, sizeof(ch));
@@ -459,6 +667,11 @@ void add_file_stat(char *filename, char *path, int ftype)
 		type = FIF; /* FIFO */
 		color = FIF_COLOR;
 	}
+	/* LS_COLORS and CCC_ICONS go before the defaults */
+	const char *rule_icon;
+	int rule_color = lscolors_match(filename, file_stat.st_mode, &rule_icon);
+	if (rule_icon)
+		strcpy(icon_str, rule_icon);
 
 	/* If file is to be marked */
 	if (ftype == 1 || ftype == 2) {
@@ -476,34 +689,14 @@ void add_file_stat(char *filename, char *path, int ftype)
 	/* Format last modified time to a string */
 	strftime(time, time_size, "%Y-%m-%d %H:%M", localtime(&file_stat.st_mtime));
 
-	/* get file size */
-	double bytes = file_stat.st_size;
-
-	if (dirs_size) {
-		/* dirs_size is 1, so calculate disk usage */
-		if (S_ISDIR(file_stat.st_mode)) {
-			/* at most 15 fd opened */
-			total_dir_size = 0;
-			nftw(path, &get_directory_size, 15, FTW_PHYS);
-			bytes = total_dir_size;
-		}
-	}
-	/* 4 before decimal + 1 dot + decimal_place (after decimal) +
-	 * unit length (1 for K, 3 for KiB, taking units[1] as B never changes) + 1 space + 1 null */
-	static const char* units[] = {"B", "K", "M", "G", "T", "P"};
-	int size_size = 4 + 1 + decimal_place + strlen(units[1]) + 1 + 1;
+	/* get file size, that of directories is filled in when it is known */
+	int size_size = size_width();
 	char size[size_size];
-	int unit = 0;
-	while (bytes > 1024) {
-		bytes /= 1024;
-		unit++;
-	}
-	/* display sizes and check if there are decimal places */
-	if (bytes == (unsigned int) bytes) {
-		sprintf(size, "%d%s", (unsigned int) bytes, units[unit]);
-	} else {
-		sprintf(size, "%.*f%s", decimal_place, bytes, units[unit]);
-	}
+	int pending = dirs_size && S_ISDIR(file_stat.st_mode);
+	if (pending)
+		strcpy(size, SIZE_PENDING);
+	else
+		format_size(file_stat.st_size, size);
 	/* get file mode string */
 	char mode_str[11];
 	mode_str[0] = S_ISDIR(file_stat.st_mode) ? 'd' : '-';
@@ -521,154 +714,236 @@ void add_file_stat(char *filename, char *path, int ftype)
 	if (mode_str[0] == '-' && (mode_str[3] == 'x' || mode_str[6] == 'x' || mode_str[9] == 'x')) {
 		color = EXE_COLOR;
 	}
+	if (rule_color != -1)
+		color = rule_color;
 
 	/*				   mode_str + time(17) + size_size + 2 spaces + 1 null */
 	size_t stat_size = 11 + 17 + size_size + 3;
 	char *total_stat = memalloc(stat_size);
-	sprintf(total_stat, "%s %s %-*s", mode_str, time, size_size, size);
+	/* SIZE_PENDING is wider in bytes than on screen */
+	sprintf(total_stat, "%s %s %-*s", mode_str, time,
+			pending ? size_size + (int) strlen(SIZE_PENDING) - 1 : size_size, size);
 
-	/* DIR if color is blue */
-	if (color == 34)
+	if (type == DRY)
 		arraylist_add(tmp1, filename, path, total_stat, type, icon_str, color, 0, 0);
 	else
 		arraylist_add(tmp2, filename, path, total_stat, type, icon_str, color, 0, 0);
 }
 
 /*
- * Get file content into buffer and show it to preview window
+ * Bytes format_size() needs: 4 before decimal + 1 dot + decimal_place (after
+ * decimal) + unit length (1 for K, 3 for KiB, taking units[1] as B never
+ * changes) + 1 space + 1 null
  */
-void show_file_content(void)
+int size_width(void)
 {
-	if (sel_file >= files->length) {
-		return;
+	return 4 + 1 + decimal_place + 1 + 1 + 1;
+}
+
+void format_size(double bytes, char *size)
+{
+	static const char* units[] = {"B", "K", "M", "G", "T", "P"};
+	int unit = 0;
+	while (bytes > 1024) {
+		bytes /= 1024;
+		unit++;
 	}
-	file current_file = files->items[sel_file];
+	/* display sizes and check if there are decimal places */
+	if (bytes == (unsigned int) bytes) {
+		sprintf(size, "%d%s", (unsigned int) bytes, units[unit]);
+	} else {
+		sprintf(size, "%.*f%s", decimal_place, bytes, units[unit]);
+	}
+}
 
-	move_cursor(1, half_width);
-	if (current_file.type == DRY) {
-		ArrayList *files_visit = NULL;
-		populate_files(current_file.name, 0, &files_visit);
-		if (!files_visit)
-			return;
+/*
+ * Ask for the sizes of directories still showing SIZE_PENDING, those
+ * on screen first
+ */
+void request_dir_sizes(void)
+{
+	long top = sel_file > rows - 2 ? sel_file - (rows - 2) : 0;
+	char **paths = memalloc((files->length + 1) * sizeof(char *));
+	int n = 0;
+	for (long k = 0; k < (long) files->length; k++) {
+		/* from the first row shown round to the ones above it */
+		long i = (top + k) % files->length;
+		file *f = &files->items[i];
+		if (f->stats && !strncmp(f->stats + STATS_SIZE_OFFSET, SIZE_PENDING, strlen(SIZE_PENDING)))
+			paths[n++] = f->path;
+	}
+	if (n)
+		du_request(paths, n);
+	else
+		du_cancel();
+	free(paths);
+	dir_sizes_top = n ? top : -1;
+}
 
-		for (long i = 0; i < files_visit->length && i < rows - 1; i++) {
-			char *line = get_line(files_visit, i, 0, show_icons);
-			int color = files_visit->items[i].color;
-			move_cursor(i + 1, half_width);
-			printf("\033[K\033[%dm%s\033[m\n", color, line);
-			free(line);
-		}
-		arraylist_free(files_visit);
+/*
+ * Fill in the size of directory path once it is known
+ */
+void set_dir_size(const char *path, off_t size)
+{
+	/* they come in the order they were worked out, which is mostly
+	 * that of the listing they were asked for in */
+	static long hint = 0;
+	for (long k = 0; k < (long) files->length; k++) {
+		long i = (hint + k) % files->length;
+		file *f = &files->items[i];
+		if (strcmp(f->path, path) || !f->stats)
+			continue;
+		char formatted[size_width()];
+		if (size == -1)
+			strcpy(formatted, "?");
+		else
+			format_size(size, formatted);
+		sprintf(f->stats + STATS_SIZE_OFFSET, "%-*s", size_width(), formatted);
+		hint = i + 1;
 		return;
 	}
-	FILE *file = fopen(current_file.path, "r");
-	if (!file) {
-		/* 		printf("Unable to read %s", current_file.name ? current_file.name : "unknown"); */
-		printf("Unable to read unknown");
+}
+
+/*
+ * Reload the listing after files changed under it
+ */
+void refresh_files(void)
+{
+	if (largest_mode)
+		update_largest();
+	else
+		change_dir(cwd, sel_file, 0);
+	if (sel_file >= files->length)
+		sel_file = files->length ? files->length - 1 : 0;
+}
+
+/*
+ * List the largest files found so far, named relative to cwd
+ */
+void update_largest(void)
+{
+	largest_file *list;
+	int n = largest_collect(&list, &largest_scanned, &largest_going);
+	/* a search that was left may still wake us */
+	if (!largest_mode) {
+		largest_free(list, n);
 		return;
 	}
+	/* stay on the selected file as others come and go */
+	char selected[PATH_MAX] = "";
+	if (sel_file < files->length)
+		strcpy(selected, files->items[sel_file].path);
+	arraylist_free(files);
+	tmp1 = arraylist_init(10);
+	tmp2 = arraylist_init(n + 1);
+	size_t skip = strlen(cwd);
+	for (int i = 0; i < n; i++) {
+		struct stat st;
+		/* gone since, deleted from this very listing perhaps */
+		if (lstat(list[i].path, &st) == -1)
+			continue;
+		const char *name = list[i].path + skip;
+		if (*name == '/')
+			name++;
+		add_file_stat(estrdup((char *) name), estrdup(list[i].path), 0);
+	}
+	largest_free(list, n);
+	arraylist_free(tmp1);
+	files = tmp2;
+	long i = selected[0] ? arraylist_search(files, selected, 0) : -1;
+	if (i != -1)
+		sel_file = i;
+	else if (sel_file >= files->length)
+		sel_file = files->length ? files->length - 1 : 0;
+}
 
-	int c;
-	long checked = 0;
-	const long BINARY_CHECK_LIMIT = 8192; /* only check first 8KB */
-	/* Check if its binary */
-	while (checked < BINARY_CHECK_LIMIT && (c = fgetc(file)) != EOF) {
-		if (c == '\0') {
-			fclose(file);
-			printf("binary");
-			return;
-		}
-		checked++;
+/*
+ * Show file content or directory listing in preview window, they are
+ * rendered in background and drawn by wait_for_input() once ready
+ */
+void show_file_content(void)
+{
+	if (sel_file >= files->length) {
+		preview_cancel();
+		return;
 	}
-	fclose(file);
+	file current_file = files->items[sel_file];
 
-	int pipe_fd[2];
-	if (pipe(pipe_fd) == -1) {
-		perror("pipe");
+	/* start at the top of every newly selected file */
+	static char previewed[PATH_MAX];
+	if (strcmp(previewed, current_file.path)) {
+		strncpy(previewed, current_file.path, PATH_MAX - 1);
+		preview_page = 0;
+		preview_hex = 0;
+	}
+	pane pn = preview_pane();
+	preview *p = NULL;
+	if (follow_mode && (p = preview_follow(current_file.path, &pn))) {
+		preview_cancel();
+		draw_preview(p);
 		return;
 	}
-	int pid = fork();
-	if (pid == 0) {
-		/* Child */
-		close(pipe_fd[0]);
-		dup2(pipe_fd[1], STDOUT_FILENO);
-		dup2(pipe_fd[1], STDERR_FILENO);
-		close(pipe_fd[1]);
-		execlp("vip", "vip", "-c", current_file.name, NULL);
-		_exit(1);
-	} else if (pid > 0) {
-		/* Parent */
-		close(pipe_fd[1]);
-		char buffer[4096];
-		int row = 1;
-		FILE *stream = fdopen(pipe_fd[0], "r");
-		while (fgets(buffer, sizeof(buffer), stream) && row <= rows - 1) {
-			buffer[strcspn(buffer, "\n")] = 0;
-			size_t buflen = strlen(buffer);
-			if (buffer[0] == '\0' || strspn(buffer, " \t") == buflen) {
-				move_cursor(row++, half_width);
-				printf("\n");
-				continue;
-			}
-			move_cursor(row++, half_width);
-			size_t len = 0;
-			size_t i = 0;
-
-			/* tracks last-seen SGR sequence */
-			char current_sgr[32] = "\033[0m";
-
-			while (i < buflen) {
-				unsigned char b = buffer[i];
-
-				/* CSI escape sequence: ESC '[' params... final-byte */
-				if (b == '\033' && buffer[i + 1] == '[') {
-					size_t start = i;
-					i += 2; /* skip ESC [ */
-					/* consume parameter/intermediate bytes: 0x20-0x3F */
-					while (i < buflen && buffer[i] >= 0x20 && buffer[i] <= 0x3F)
-						i++;
-					/* consume the final byte: 0x40-0x7E */
-					if (i < buflen && buffer[i] >= 0x40 && buffer[i] <= 0x7E) {
-						/* remember it if it's an SGR sequence (ends in 'm') */
-						if (buffer[i] == 'm') {
-							size_t seqlen = i + 1 - start;
-							if (seqlen < sizeof(current_sgr)) {
-								memcpy(current_sgr, buffer + start, seqlen);
-								current_sgr[seqlen] = '\0';
-							}
-						}
-						i++;
-					}
-					fwrite(buffer + start, 1, i - start, stdout);
-					continue; /* zero visible width, don't touch len */
-				}
+	preview_unfollow();
+	p = preview_request(current_file.path, &pn);
+	if (p)
+		draw_preview(p);
+	prefetch_previews();
+}
 
-				/* UTF-8 multi-byte sequence: count as ONE visible column */
-				size_t charlen = 1;
-				if ((b & 0x80) == 0x00) charlen = 1;      /* ASCII */
-				else if ((b & 0xE0) == 0xC0) charlen = 2; /* 2-byte */
-				else if ((b & 0xF0) == 0xE0) charlen = 3; /* 3-byte */
-				else if ((b & 0xF8) == 0xF0) charlen = 4; /* 4-byte */
+/*
+ * Get the preview window as it is now
+ */
+pane preview_pane(void)
+{
+	pane pn = { rows - 1, cols - half_width + 1, 0, preview_page };
+	/* names wider than the window leave no room, previews need a column */
+	if (pn.width < 1)
+		pn.width = 1;
+	if (show_hidden)
+		pn.flags |= PREVIEW_HIDDEN;
+	if (show_icons)
+		pn.flags |= PREVIEW_ICONS;
+	return pn;
+}
 
-				if (i + charlen > buflen) charlen = 1; /* truncated at buffer edge, don't overread */
+/*
+ * Queue previews of the next files in scroll direction to be rendered
+ * while idle, dropping them if the selection jumped far away
+ */
+void prefetch_previews(void)
+{
+	static int direction = 1;
 
-				fwrite(buffer + i, 1, charlen, stdout);
-				i += charlen;
-				len++; /* ONE visible column per codepoint, not per byte */
+	if (sel_file != prefetch_sel) {
+		if (labs(sel_file - prefetch_sel) > prefetch_count)
+			preview_prefetch_cancel();
+		direction = sel_file > prefetch_sel ? 1 : -1;
+		prefetch_sel = sel_file;
+	}
 
-				if (len && len % (cols - half_width + 1) == 0) {
-					if (row + 1 < rows) {
-						printf("\033[0m");        /* reset before breaking */
-						move_cursor(row++, half_width);
-						printf("%s", current_sgr); /* reapply active color */
-					}
-				}
-			}
-		}
-		fclose(stream);
-		waitpid(pid, NULL, 0);
-	} else {
-		wpprintw("fork failed: %s", strerror(errno));
+	char *paths[prefetch_count + 1];
+	int n = 0;
+	for (int k = 1; k <= prefetch_count; k++) {
+		long i = sel_file + k * direction;
+		if (i < 0 || i >= files->length)
+			break;
+		paths[n++] = files->items[i].path;
+	}
+	pane pn = preview_pane();
+	pn.page = 0;
+	preview_prefetch(paths, n, &pn);
+}
+
+/*
+ * Print rendered preview rows to preview window
+ */
+void draw_preview(preview *p)
+{
+	preview_hex = p->hex;
+	for (int i = 0; i < rows - 1; i++) {
+		move_cursor(i + 1, half_width);
+		/* clear rows left over from a longer preview */
+		printf("\033[K%s\033[m", i < p->length ? p->lines[i] : "");
 	}
 }
 
@@ -681,6 +956,7 @@ void list_files(void)
 	long range = files->length;
 	/* not highlight if no files in directory */
 	if (range == 0) {
+		preview_cancel();
 		for (int i = 0; i < rows - 1; i++) {
 			move_cursor(i + 1, 1);
 			printf("\033[K");
@@ -695,6 +971,9 @@ void list_files(void)
 		/* overflown */
 		overflow = sel_file - (rows - 2);
 	}
+	/* scrolled, rows coming into view go first */
+	if (dirs_size && dir_sizes_top != -1 && overflow != dir_sizes_top)
+		request_dir_sizes();
 	if (range > rows - 1) {
 		/* if there are more files than rows available to display
 		 * shrink range to avaiable rows to display with
@@ -711,18 +990,7 @@ void list_files(void)
 		if ((overflow == 0 && i == sel_file) ||
 				(overflow != 0 && i == sel_file)) {
 			is_selected = 1;
-			/* check for marked files */
-			long num_marked = marked->length;
-			if (num_marked > 0) {
-				/* Determine length of formatted string */
-				int m_len = snprintf(NULL, 0, "[%ld] selected", num_marked);
-				char selected[m_len + 1];
-
-				snprintf(selected, m_len + 1, "[%ld] selected", num_marked);
-				wpprintw("(%ld/%ld) %s %s", sel_file + 1, files->length, selected, cwd);
-			} else {
-				wpprintw("(%ld/%ld) %s", sel_file + 1, files->length, cwd);
-			}
+			draw_status();
 		}
 		/* print the actual filename and stats */
 		char *line = get_line(files, i, show_details, show_icons);
@@ -735,8 +1003,13 @@ void list_files(void)
 		int is_marked = arraylist_search(marked, files->items[i].path, 0) != -1;
 		move_cursor(i - overflow + 1, 1);
 		if (is_marked) color = MAR_COLOR;
-		printf("\033[30m\033[%dm%s\033[m\n",
-				is_selected ? color + 10 : color, line);
+		const char *sgr = lscolors_sgr(color);
+		if (sgr)
+			/* reversed to show the selection whatever the colors */
+			printf("\033[0;%s%sm%s\033[m\n", sgr, is_selected ? ";7" : "", line);
+		else
+			printf("\033[30m\033[%dm%s\033[m\n",
+					is_selected ? color + 10 : color, line);
 
 		free(line);
 	}
@@ -746,6 +1019,33 @@ void list_files(void)
 	show_file_content();
 }
 
+/*
+ * Print position, marked files and progress of jobs in status line
+ */
+void draw_status(void)
+{
+	char jobs[192];
+	job_status(jobs, 128);
+	if (largest_mode) {
+		size_t l = strlen(jobs);
+		snprintf(jobs + l, sizeof(jobs) - l, "%s[largest of %ld files%s]", l ? " " : "",
+				largest_scanned, largest_going ? "…" : "");
+	}
+	/* check for marked files */
+	long num_marked = marked->length;
+	if (num_marked > 0) {
+		/* Determine length of formatted string */
+		int m_len = snprintf(NULL, 0, "[%ld] selected", num_marked);
+		char selected[m_len + 1];
+
+		snprintf(selected, m_len + 1, "[%ld] selected", num_marked);
+		wpprintw("(%ld/%ld) %s%s%s %s", sel_file + 1, files->length, selected,
+				jobs[0] ? " " : "", jobs, cwd);
+	} else {
+		wpprintw("(%ld/%ld) %s%s%s", sel_file + 1, files->length, jobs, jobs[0] ? " " : "", cwd);
+	}
+}
+
 /*
  * Opens $EDITOR to edit the file
  */
@@ -819,6 +1119,12 @@ char *get_panel_string(char *prompt)
 
 void quit(const Arg *arg)
 {
+	int running = job_running();
+	if (running) {
+		wpprintw("%d job%s still running, cancel and quit? (y/N)", running, running > 1 ? "s" : "");
+		if (readch() != 'y')
+			return;
+	}
 	if (!strcmp(last_d, "")) {
 		strcpy(last_d, getenv("CCC_LAST_D"));
 		if (!strcmp(last_d, "")) {
@@ -846,6 +1152,7 @@ void quit(const Arg *arg)
 		fwrite(cwd, strlen(cwd), sizeof(char), last_d_file);
 		fclose(last_d_file);
 	}
+	save_session();
 	cleanup();
 	exit(0);
 }
@@ -857,6 +1164,11 @@ void reload(const Arg *arg)
 
 void nav_back(const Arg *arg)
 {
+	/* back from the largest files to the directory they are under */
+	if (largest_mode) {
+		change_dir(cwd, 0, 0);
+		return;
+	}
 	char dir[PATH_MAX];
 	strcpy(dir, cwd);
 	/* get parent directory */
@@ -877,6 +1189,18 @@ void nav_enter(const Arg *arg)
 		return;
 	}
 	file c_file = files->items[sel_file];
+	if (largest_mode) {
+		/* jump to where the file is */
+		char dir[PATH_MAX], name[PATH_MAX];
+		strcpy(dir, c_file.path);
+		char *slash = strrchr(dir, '/');
+		strcpy(name, slash + 1);
+		*(slash == dir ? slash + 1 : slash) = '\0';
+		change_dir(dir, 0, 0);
+		long i = arraylist_search(files, name, 1);
+		sel_file = i == -1 ? 0 : i;
+		return;
+	}
 	/* Check if it is directory or a regular file */
 	if (c_file.type == DRY) {
 		/* Change cwd to directory */
@@ -937,6 +1261,27 @@ void nav_top(const Arg *arg)
 	sel_file = 0;
 }
 
+void preview_page_down(const Arg *arg)
+{
+	struct stat st;
+	if (!preview_hex || sel_file >= files->length || stat(files->items[sel_file].path, &st))
+		return;
+	pane pn = preview_pane();
+	if (preview_page + 1 < preview_pages(st.st_size, &pn))
+		preview_page++;
+}
+
+void preview_page_up(const Arg *arg)
+{
+	if (preview_hex && preview_page > 0)
+		preview_page--;
+}
+
+void toggle_follow(const Arg *arg)
+{
+	follow_mode = !follow_mode;
+}
+
 void goto_home_dir(const Arg *arg)
 {
 	char *home = getenv("HOME");
@@ -950,11 +1295,11 @@ void goto_home_dir(const Arg *arg)
 
 void goto_trash_dir(const Arg *arg)
 {
-	char *trash_dir = check_trash_dir();
-	if (trash_dir) {
-		change_dir(trash_dir, 0, 0);
-		free(trash_dir);
-	}
+	const char *dir = trash_files();
+	if (dir)
+		change_dir(dir, 0, 0);
+	else
+		wpprintw("Trash directory not defined");
 }
 
 void sort_files(const Arg *arg)
@@ -989,6 +1334,9 @@ void show_help(const Arg *arg)
 			"G: go to bottom\n\n"
 			"ctrl+u: jump up\n"
 			"ctrl+d: jump down\n\n"
+			"J: next page of binary preview\n"
+			"K: previous page of binary preview\n"
+			"F: follow the end of the file in preview\n\n"
 			"t: go to trash dir\n"
 			"~: go to home dir\n"
 			"-: go to previous dir\n"
@@ -1000,6 +1348,7 @@ void show_help(const Arg *arg)
 			"u: sort files\n"
 			"x: view file/dir attributes\n"
 			"e: show history\n"
+			"Z: jump to a visited directory matching a query\n"
 			"y: copy filename to clipboard\n"
 			"!: open shell in current dir\n\n"
 			"f: new file\n"
@@ -1008,7 +1357,11 @@ void show_help(const Arg *arg)
 			"X: toggle executable\n\n"
 			"space: mark file\n"
 			"a: mark all files in directory\n"
-			"d: trash\n\n"
+			"d: trash\n"
+			"D: delete permanently\n"
+			"T: show trash to restore from or empty\n"
+			"L: list largest files under here, enter jumps to one\n"
+			"v: show background jobs\n\n"
 			"[1-9]: favourites/bookmarks (see customizing)\n\n"
 			"?: show help\n"
 			"q: exit with last dir written to file\n"
@@ -1261,20 +1614,32 @@ void show_history(const Arg *arg)
 {
 	printf("\033[2J");
 	move_cursor(1, 1);
-	char history_path[PATH_MAX];
-	strcpy(history_path, "~/.cache/ccc/history");
-	replace_home(history_path);
-	FILE *history_file = fopen(history_path, "r");
-	char buffer[PATH_MAX];
-	int row = 1;
-	while (fgets(buffer, sizeof(buffer), history_file) && row <= rows - 1) {
-		move_cursor(row++, 1);
-		printf("%s", buffer);
+	char **paths;
+	int n = frecency_list(&paths);
+	for (int i = 0; i < n && i < rows - 1; i++) {
+		move_cursor(i + 1, 1);
+		printf("%s", paths[i]);
 	}
-	fclose(history_file);
+	frecency_list_free(paths, n);
 	readch();
 }
 
+/*
+ * Jump to the best ranked visited directory matching a query
+ */
+void jump_dir(const Arg *arg)
+{
+	char *query = get_panel_string("Jump to: ");
+	if (!query)
+		return;
+	char path[PATH_MAX];
+	if (frecency_query(query, cwd, path) == 0)
+		change_dir(path, 0, 0);
+	else
+		wpprintw("No visited directory matches %s", query);
+	free(query);
+}
+
 void open_fav(const Arg *arg)
 {
 	char envname[9];
@@ -1289,81 +1654,88 @@ void open_fav(const Arg *arg)
 
 void mark_file(const Arg *arg)
 {
-	add_file_stat(files->items[sel_file].name, files->items[sel_file].path, 1);
+	if (sel_file >= files->length)
+		return;
+	/* marked keeps its own copies, files is rebuilt under it */
+	add_file_stat(estrdup(files->items[sel_file].name), estrdup(files->items[sel_file].path), 1);
 }
 
 void mark_all(const Arg *arg)
 {
+	if (largest_mode) {
+		for (long i = 0; i < files->length; i++)
+			add_file_stat(estrdup(files->items[i].name), estrdup(files->items[i].path), 2);
+		return;
+	}
 	change_dir(cwd, sel_file, 2); /* reload current dir */
 }
 
+/*
+ * Paths of the marked files for a job
+ */
+char **marked_paths(void)
+{
+	char **paths = memalloc(marked->length * sizeof(char *));
+	for (long i = 0; i < marked->length; i++)
+		paths[i] = marked->items[i].path;
+	return paths;
+}
+
+/*
+ * Unmark everything, marked owns the strings of its files
+ */
+void clear_marked(void)
+{
+	while (marked->length) {
+		file *f = &marked->items[--marked->length];
+		free(f->name);
+		free(f->path);
+		free(f->stats);
+	}
+}
+
 void delete_files(const Arg *arg)
 {
 	if (marked->length) {
-		char *trash_dir = check_trash_dir();
-		if (trash_dir) {
-			for (int i = 0; i < marked->length; i++) {
-				char new_path[PATH_MAX];
-				snprintf(new_path, PATH_MAX, "%s/%s", trash_dir, marked->items[i].name);
-				if (rename(marked->items[i].path, new_path)) {
-					wpprintw("delete failed: %s", strerror(errno));
-				}
-			}
-			change_dir(cwd, 0, 0);
-			for (int i = 0; i < marked->length; i++) {
-				arraylist_remove(marked, 0);
-			}
+		if (trash_files()) {
+			char **paths = marked_paths();
+			job_add(JOB_TRASH, paths, marked->length, NULL);
+			free(paths);
+			clear_marked();
 		} else {
-			wpprintw("TODO: implement hard delete");
+			hard_delete_files(arg);
 		}
 	}
 }
 
-void move_files(const Arg *arg)
+void hard_delete_files(const Arg *arg)
 {
 	if (marked->length) {
-		char *input = get_panel_string("Move to: ");
-		if (!input) {
+		wpprintw("Permanently delete %ld file%s? (y/N)", marked->length, marked->length > 1 ? "s" : "");
+		if (readch() != 'y') {
+			wpprintw("");
 			return;
 		}
-		for (int i = 0; i < marked->length; i++) {
-			char new_path[PATH_MAX];
-			snprintf(new_path, PATH_MAX, "%s/%s", input, marked->items[i].name);
-			if (rename(marked->items[i].path, new_path)) {
-				wpprintw("move failed: %s", strerror(errno));
-			}
-		}
-		change_dir(cwd, 0, 0);
-		for (int i = 0; i < marked->length; i++) {
-			arraylist_remove(marked, 0);
-		}
-		free(input);
+		char **paths = marked_paths();
+		job_add(JOB_DELETE, paths, marked->length, NULL);
+		free(paths);
+		clear_marked();
 	}
 }
 
-int copy_file(const char *src, const char *dest)
+void move_files(const Arg *arg)
 {
-	int src_fd = open(src, O_RDONLY);
-	if (src_fd == -1) {
-		return 1;
-	}
-	int dest_fd = open(dest, O_WRONLY | O_CREAT, 0644);
-	if (dest_fd == -1) {
-		close(src_fd);
-		return 1;
-	}
-	char buffer[4096];
-	ssize_t bytes;
-	while ((bytes = read(src_fd, buffer, sizeof(buffer))) > 0) {
-		if (write(dest_fd, buffer, bytes) != bytes) {
-			close(src_fd);
-			close(dest_fd);
-			return 1;
+	if (marked->length) {
+		char *input = get_panel_string("Move to: ");
+		if (!input) {
+			return;
 		}
+		char **paths = marked_paths();
+		job_add(JOB_MOVE, paths, marked->length, input);
+		free(paths);
+		clear_marked();
+		free(input);
 	}
-	close(src_fd);
-	close(dest_fd);
-	return 0;
 }
 
 void copy_files(const Arg *arg)
@@ -1373,16 +1745,210 @@ void copy_files(const Arg *arg)
 		if (!input) {
 			return;
 		}
-		for (int i = 0; i < marked->length; i++) {
-			char new_path[PATH_MAX];
-			snprintf(new_path, PATH_MAX, "%s/%s", input, marked->items[i].name);
-			if (copy_file(marked->items[i].path, new_path)) {
-				wpprintw("copy failed: %s", strerror(errno));
+		char **paths = marked_paths();
+		job_add(JOB_COPY, paths, marked->length, input);
+		free(paths);
+		free(input);
+	}
+}
+
+/*
+ * List background jobs, the selected one can be paused or cancelled
+ */
+void show_jobs(const Arg *arg)
+{
+	static const char *states[] = { "queued", "running", "paused", "done", "failed", "cancelled" };
+	int sel = 0;
+	while (1) {
+		job_info list[rows > 1 ? rows - 1 : 1];
+		int n = job_list(list, LEN(list));
+		if (sel >= n)
+			sel = n ? n - 1 : 0;
+
+		printf("\033[2J");
+		for (int i = 0; i < n; i++) {
+			job_info *j = &list[i];
+			char progress[64] = "";
+			if (j->bytes_total > 0)
+				snprintf(progress, sizeof(progress), "%d%%", (int) (100 * j->bytes / j->bytes_total));
+			else if (j->type == JOB_DELETE)
+				snprintf(progress, sizeof(progress), "%ld", j->files);
+			else if (j->files_total > 0)
+				snprintf(progress, sizeof(progress), "%ld/%ld", j->files, j->files_total);
+			if (j->eta >= 0 && j->state == JOB_RUNNING)
+				snprintf(progress + strlen(progress), sizeof(progress) - strlen(progress),
+						" %.1fM/s %ld:%02ld", j->rate / (1024 * 1024), j->eta / 60, j->eta % 60);
+			move_cursor(i + 1, 1);
+			printf("%s%-9s %-6s %s%s%s\033[m", i == sel ? "\033[7m" : "", states[j->state],
+					progress, j->label, j->error ? ": " : "", j->error ? strerror(j->error) : "");
+		}
+		if (n == 0) {
+			move_cursor(1, 1);
+			printf("no jobs");
+		}
+		wpprintw("p: pause/resume, x: cancel, c: clear finished, q: back");
+		fflush(stdout);
+
+		struct pollfd fds[] = {
+			{ STDIN_FILENO, POLLIN, 0 },
+			{ job_fd(), POLLIN, 0 },
+		};
+		if (poll(fds, LEN(fds), -1) == -1 && errno != EINTR)
+			break;
+		if (fds[1].revents & POLLIN)
+			job_collect();
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		int c = readch();
+		if (c == 'q' || c == '\033' || c == 'v')
+			break;
+		else if ((c == 'j' || c == ARROW_DOWN) && sel < n - 1)
+			sel++;
+		else if ((c == 'k' || c == ARROW_UP) && sel > 0)
+			sel--;
+		else if (c == 'p' && n)
+			job_pause(list[sel].id);
+		else if (c == 'x' && n)
+			job_cancel(list[sel].id);
+		else if (c == 'c')
+			job_clear();
+	}
+	/* finished jobs may have changed the directory meanwhile */
+	refresh_files();
+}
+
+/*
+ * Browse the trash newest first, restoring or purging the selected entry
+ */
+void show_trash(const Arg *arg)
+{
+	if (!trash_files()) {
+		wpprintw("Trash directory not defined");
+		return;
+	}
+	static const char *units[] = { "B", "K", "M", "G", "T", "P" };
+	trash_entry *list = NULL;
+	int n = 0, sel = 0, top = 0, reload = 1;
+	char *search = NULL;
+	while (1) {
+		if (reload) {
+			trash_list_free(list, n);
+			n = trash_list(&list);
+			/* keep only what matches the search */
+			if (search) {
+				int kept = 0;
+				for (int i = 0; i < n; i++) {
+					if (strstr(list[i].path, search)) {
+						list[kept++] = list[i];
+					} else {
+						free(list[i].name);
+						free(list[i].path);
+					}
+				}
+				n = kept;
+			}
+			reload = 0;
+		}
+		int height = rows > 1 ? rows - 1 : 1;
+		if (sel >= n)
+			sel = n ? n - 1 : 0;
+		if (sel < top)
+			top = sel;
+		else if (sel >= top + height)
+			top = sel - height + 1;
+
+		printf("\033[2J");
+		for (int i = top; i < n && i < top + height; i++) {
+			char date[17], size[16];
+			strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&list[i].deleted));
+			double bytes = list[i].size;
+			int unit = 0;
+			while (bytes > 1024 && unit < (int) LEN(units) - 1) {
+				bytes /= 1024;
+				unit++;
+			}
+			snprintf(size, sizeof(size), "%.*f%s", bytes == (long) bytes ? 0 : 1, bytes, units[unit]);
+			move_cursor(i - top + 1, 1);
+			printf("%s%s %7s %.*s\033[m", i == sel ? "\033[7m" : "", date, size,
+					cols > 26 ? cols - 26 : 0, list[i].path);
+		}
+		if (n == 0) {
+			move_cursor(1, 1);
+			printf(search ? "nothing matches" : "trash is empty");
+		}
+		wpprintw("r: restore, x: delete, E: empty trash, /: search, q: back");
+		fflush(stdout);
+
+		struct pollfd fds[] = {
+			{ STDIN_FILENO, POLLIN, 0 },
+			{ job_fd(), POLLIN, 0 },
+		};
+		if (poll(fds, LEN(fds), -1) == -1 && errno != EINTR)
+			break;
+		if (fds[1].revents & POLLIN) {
+			draw_status();
+			reload = job_collect();
+		}
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		int c = readch();
+		if (c == 'q' || c == '\033' || c == 'T') {
+			break;
+		} else if ((c == 'j' || c == ARROW_DOWN) && sel < n - 1) {
+			sel++;
+		} else if ((c == 'k' || c == ARROW_UP) && sel > 0) {
+			sel--;
+		} else if (c == 'g') {
+			sel = 0;
+		} else if (c == 'G') {
+			sel = n ? n - 1 : 0;
+		} else if (c == 'r' && n) {
+			job_add(JOB_RESTORE, &list[sel].name, 1, NULL);
+		} else if (c == 'x' && n) {
+			wpprintw("Permanently delete %s? (y/N)", list[sel].name);
+			if (readch() == 'y')
+				job_add(JOB_PURGE, &list[sel].name, 1, NULL);
+		} else if (c == 'E' && n) {
+			wpprintw("Permanently delete all %d in the trash? (y/N)", n);
+			if (readch() == 'y') {
+				char **names = memalloc(n * sizeof(char *));
+				for (int i = 0; i < n; i++)
+					names[i] = list[i].name;
+				job_add(JOB_PURGE, names, n, NULL);
+				free(names);
 			}
+		} else if (c == '/') {
+			free(search);
+			search = get_panel_string("Search trash: ");
+			sel = top = 0;
+			reload = 1;
 		}
+	}
+	trash_list_free(list, n);
+	free(search);
+	/* restored files may have come back here */
+	refresh_files();
+}
+
+/*
+ * List the largest files under the current directory as they are found,
+ * or go back to the directory
+ */
+void show_largest(const Arg *arg)
+{
+	if (largest_mode) {
 		change_dir(cwd, 0, 0);
-		free(input);
+		return;
 	}
+	largest_start(cwd, largest_count, du_workers);
+	arraylist_free(files);
+	files = arraylist_init(10);
+	largest_mode = 1;
+	largest_scanned = 0;
+	largest_going = 1;
+	sel_file = 0;
 }
 
 void symbolic_link(const Arg *arg)
@@ -1443,16 +2009,50 @@ void bulk_rename(const Arg *arg)
 		readch();
 		return;
 	}
+	/* line i of the edited file is the new path of marked file i */
+	long n = marked->length;
+	char **from = marked_paths();
+	char **to = memalloc(n * sizeof(char *));
+	long lines = 0;
 	char buffer[PATH_MAX];
 	while (fgets(buffer, sizeof(buffer), rename_file_fp)) {
 		buffer[strcspn(buffer, "\n")] = 0;
-		char new_path[PATH_MAX];
-		snprintf(new_path, PATH_MAX, "%s", buffer);
-		if (rename(buffer, new_path)) {
-			wpprintw("rename failed: %s", strerror(errno));
+		if (lines < n) {
+			if (buffer[0] == '/' || !buffer[0]) {
+				to[lines] = estrdup(buffer);
+			} else {
+				/* a bare name stays in the directory it was in */
+				const char *slash = strrchr(from[lines], '/');
+				int dirlen = slash ? slash - from[lines] + 1 : 0;
+				to[lines] = memalloc(dirlen + strlen(buffer) + 1);
+				sprintf(to[lines], "%.*s%s", dirlen, from[lines], buffer);
+			}
 		}
+		lines++;
 	}
 	fclose(rename_file_fp);
+
+	int empty = 0;
+	for (long i = 0; i < n && i < lines; i++)
+		empty |= !to[i][0];
+	if (lines != n) {
+		wpprintw("%ld lines for %ld files, nothing renamed", lines, n);
+	} else if (empty) {
+		wpprintw("Empty line, nothing renamed");
+	} else {
+		const char *failed = NULL;
+		int renamed = rename_batch(from, to, n, &failed);
+		if (renamed == -1)
+			wpprintw("rename failed: %s: %s", failed ? failed : "", strerror(errno));
+		else
+			wpprintw("Renamed %d file%s", renamed, renamed == 1 ? "" : "s");
+		clear_marked();
+	}
+	for (long i = 0; i < n && i < lines; i++)
+		free(to[i]);
+	free(to);
+	free(from);
+	refresh_files();
 }
 
 /*
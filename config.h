@@ -1,8 +1,13 @@
 static int panel_height = 1; /* Panel height */
 static int jump_num = 14; /* Length of ctrl + u/d jump */
 static int decimal_place = 1; /* Number of decimal places size can be shown */
+static size_t preview_cache_size = 8 * 1024 * 1024; /* Memory for rendered previews in bytes */
+static int prefetch_count = 3; /* Previews rendered ahead in scroll direction */
+static int prefetch_workers = 2; /* Threads rendering them while idle, 0 disables prefetching */
+static int copy_workers = 4; /* Threads copying the files of a directory */
+static int delete_workers = 8; /* Threads removing directory trees */
 
-/* Colors for files */
+/* Colors for files, LS_COLORS goes before them where it has an entry */
 enum files_colors {
 	DIR_COLOR = 34, /* Directory */
 	REG_COLOR = 37, /* Regular file */
@@ -37,21 +42,54 @@ static int show_icons = 1; /* Show file icons at startup */
 
 /* Calculate directories' sizes RECURSIVELY upon entering
    `A` keybind at the startup
- **VERY EXPENSIVE**, **CAN TAKE UP TO A MINUTE IN ROOT** */
+ **EXPENSIVE** the first time in big trees, unchanged directories are
+ remembered in du_index so coming back is cheap after that */
 static int dirs_size = 0;
 
+/* Threads adding up directories' sizes */
+static int du_workers = 8;
+
+/* How many of the largest files `L` lists */
+static int largest_count = 100;
+
+/* File remembering directories' sizes between runs, empty for none */
+static char du_index[PATH_MAX] = "~/.cache/ccc/du.index";
+
+/* File ranking visited directories for `e` and `Z`, empty keeps them in
+   memory only */
+static char frecency_file[PATH_MAX] = "~/.cache/ccc/dirs";
+
+/* Ranks of visited directories are aged once they add up to more than this */
+static double frecency_max = 10000;
+
 /* Default text editor */
 static const char *editor = "nvim";
 
+/* Program run as `previewer -c file` to highlight previews, e.g. "vip"
+   Empty uses the built-in highlighter which doesn't fork for every preview */
+static const char *previewer = "";
+
 /* Default clipboard program */
 static const char *clipboard = "wl-copy";
 
 /* File location to write last directory */
 static char last_d[PATH_MAX] = "~/.cache/ccc/.ccc_d";
 
+/* File the session is saved to on quit and picked up from when ccc is
+   started without a path: directory, selection, marked files, options and
+   the listing, which is used as is if the directory hasn't changed.
+   Empty for none */
+static char session_file[PATH_MAX] = "";
+
 /* Will create this directory if doesn't exist! */
 static char trash_dir[PATH_MAX]  = "~/.cache/ccc/trash/";
 
+/* Purge things trashed more than this many days ago, 0 keeps them */
+static int trash_max_age = 0;
+
+/* Purge the oldest things when the trash grows beyond this many bytes, 0 for no limit */
+static off_t trash_max_size = 0;
+
 static Key keybindings[] = {
 	{'q', quit, {0}},
 	{'z', reload, {0}},
@@ -69,6 +107,9 @@ static Key keybindings[] = {
 	{'j', nav_down, {0}},
 	{'G', nav_bottom, {0}},
 	{'g', nav_top, {0}},
+	{'J', preview_page_down, {0}},
+	{'K', preview_page_up, {0}},
+	{'F', toggle_follow, {0}},
 	{'~', goto_home_dir, {0}},
 	{'t', goto_trash_dir, {0}},
 	{'u', sort_files, {0}},
@@ -89,6 +130,7 @@ static Key keybindings[] = {
 	{'O', open_detached, {0}},
 	{'x', view_file_attr, {0}},
 	{'e', show_history, {0}},
+	{'Z', jump_dir, {0}},
 	{'1', open_fav, {.i = 1}},
 	{'2', open_fav, {.i = 2}},
 	{'3', open_fav, {.i = 3}},
@@ -101,8 +143,12 @@ static Key keybindings[] = {
 	{' ', mark_file, {0}},
 	{'a', mark_all, {0}},
 	{'d', delete_files, {0}},
+	{'D', hard_delete_files, {0}},
 	{'m', move_files, {0}},
 	{'c', copy_files, {0}},
+	{'v', show_jobs, {0}},
+	{'T', show_trash, {0}},
+	{'L', show_largest, {0}},
 	{'s', symbolic_link, {0}},
 	{'b', bulk_rename, {0}},
 };
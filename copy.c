@@ -0,0 +1,457 @@
+#define _GNU_SOURCE /* copy_file_range, SEEK_DATA */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "copy.h"
+#include "pool.h"
+#include "util.h"
+
+#define CHUNK (64L << 20) /* bytes handed to the kernel at once, between progress reports */
+#define BUFFER_SIZE (1 << 20) /* when the kernel can't copy for us */
+#define QUEUE_SIZE 256 /* files waiting for a worker during a tree copy */
+
+/* Ways to copy data, each falls back to the next */
+enum {
+	COPY_RANGE,
+	COPY_SENDFILE,
+	COPY_BUFFER
+};
+
+/* Copy of one file */
+typedef struct {
+	int method; /* best way found to work so far */
+	copy_progress progress; /* may be NULL */
+	void *arg;
+	off_t reported; /* bytes told to progress */
+} copier;
+
+/*
+ * Tell progress about copied data
+ * Returns nonzero with errno set if the copy is to stop
+ */
+static int report(copier *c, long files, off_t bytes)
+{
+	c->reported += bytes;
+	if (c->progress && c->progress(c->arg, files, bytes)) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy len bytes at offset off of src_fd to the same offset of dest_fd
+ * with the best method that works, remembered in c->method
+ */
+static int copy_range(int src_fd, int dest_fd, off_t off, off_t len, copier *c)
+{
+	int *method = &c->method;
+	while (len > 0 && *method == COPY_RANGE) {
+		off_t in = off, out = off;
+		ssize_t n = copy_file_range(src_fd, &in, dest_fd, &out, len < CHUNK ? len : CHUNK, 0);
+		if (n > 0) {
+			off += n;
+			len -= n;
+			if (report(c, 0, n))
+				return -1;
+		} else if (n == 0) {
+			errno = EIO; /* file shrank under us */
+			return -1;
+		} else if (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+				|| errno == EOPNOTSUPP || errno == EBADF) {
+			*method = COPY_SENDFILE;
+		} else if (errno != EINTR) {
+			return -1;
+		}
+	}
+
+	if (len > 0 && *method == COPY_SENDFILE && lseek(dest_fd, off, SEEK_SET) == -1)
+		return -1;
+	while (len > 0 && *method == COPY_SENDFILE) {
+		off_t in = off;
+		ssize_t n = sendfile(dest_fd, src_fd, &in, len < CHUNK ? len : CHUNK);
+		if (n > 0) {
+			off += n;
+			len -= n;
+			if (report(c, 0, n))
+				return -1;
+		} else if (n == 0) {
+			errno = EIO;
+			return -1;
+		} else if (errno == EINVAL || errno == ENOSYS) {
+			*method = COPY_BUFFER;
+		} else if (errno != EINTR) {
+			return -1;
+		}
+	}
+
+	char *buffer = len > 0 ? memalloc(BUFFER_SIZE) : NULL;
+	while (len > 0) {
+		ssize_t n = pread(src_fd, buffer, len < BUFFER_SIZE ? len : BUFFER_SIZE, off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == 0)
+			errno = EIO;
+		if (n <= 0)
+			break;
+		for (ssize_t done = 0; done < n;) {
+			ssize_t w = pwrite(dest_fd, buffer + done, n - done, off + done);
+			if (w == -1 && errno == EINTR)
+				continue;
+			if (w <= 0) {
+				if (w == 0)
+					errno = EIO;
+				free(buffer);
+				return -1;
+			}
+			done += w;
+		}
+		off += n;
+		len -= n;
+		if (report(c, 0, n)) {
+			free(buffer);
+			return -1;
+		}
+	}
+	free(buffer);
+	return len > 0 ? -1 : 0;
+}
+
+/*
+ * Copy the data of src_fd to dest_fd, only the parts that aren't holes
+ */
+static int copy_data(int src_fd, int dest_fd, off_t size, copier *c)
+{
+	/* on btrfs and XFS the copy can share the source's extents */
+	if (ioctl(dest_fd, FICLONE, src_fd) == 0)
+		return 0;
+
+	off_t off = 0;
+	while (off < size) {
+		off_t data = lseek(src_fd, off, SEEK_DATA);
+		if (data == -1 && errno == ENXIO)
+			break; /* only a hole is left */
+		if (data == -1) {
+			/* holes are unknown to this filesystem */
+			return copy_range(src_fd, dest_fd, off, size - off, c);
+		}
+		off_t hole = lseek(src_fd, data, SEEK_HOLE);
+		if (hole == -1 || hole > size)
+			hole = size;
+		if (copy_range(src_fd, dest_fd, data, hole - data, c))
+			return -1;
+		off = hole;
+	}
+	/* a trailing hole */
+	return ftruncate(dest_fd, size);
+}
+
+/*
+ * Replace the contents of dest_fd with those of src_fd and copy its
+ * attributes, not owning it is fine
+ */
+static int copy_fd(int src_fd, int dest_fd, const struct stat *st, copier *c)
+{
+	struct stat dest_st;
+	if (fstat(dest_fd, &dest_st) == -1)
+		return -1;
+	if (dest_st.st_dev == st->st_dev && dest_st.st_ino == st->st_ino) {
+		/* truncating would destroy the source */
+		errno = EINVAL;
+		return -1;
+	}
+	if (ftruncate(dest_fd, 0) == -1 || copy_data(src_fd, dest_fd, st->st_size, c))
+		return -1;
+
+	/* chown before chmod as it clears setuid bits, which aren't given
+	 * back on a file owned by someone else, like cp -p */
+	mode_t mode = st->st_mode & 07777;
+	if (fchown(dest_fd, st->st_uid, st->st_gid) == -1) {
+		fchown(dest_fd, -1, st->st_gid);
+		mode &= ~(S_ISUID | S_ISGID);
+	}
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+	if (fchmod(dest_fd, mode) == -1 || futimens(dest_fd, times) == -1)
+		return -1;
+	/* holes and reflinked data count as copied too */
+	return report(c, 1, st->st_size - c->reported);
+}
+
+/*
+ * Copy regular file src to dest, telling progress how far it got
+ */
+static int copy_file_progress(const char *src, const char *dest, copy_progress progress, void *arg)
+{
+	int src_fd = open(src, O_RDONLY | O_CLOEXEC);
+	if (src_fd == -1)
+		return 1;
+	struct stat st;
+	if (fstat(src_fd, &st) == -1) {
+		close(src_fd);
+		return 1;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		close(src_fd);
+		errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+		return 1;
+	}
+	/* created private and given the source's mode once filled */
+	int dest_fd = open(dest, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (dest_fd == -1) {
+		close(src_fd);
+		return 1;
+	}
+
+	copier c = { COPY_RANGE, progress, arg, 0 };
+	int ret = copy_fd(src_fd, dest_fd, &st, &c) ? 1 : 0;
+	int err = errno;
+	close(src_fd);
+	if (close(dest_fd) == -1 && !ret) {
+		ret = 1;
+		err = errno;
+	}
+	/* a half copied file is worth nothing */
+	if (ret && err == ECANCELED)
+		unlink(dest);
+	errno = err;
+	return ret;
+}
+
+/*
+ * Copy regular file src to dest, replacing its contents if it exists,
+ * keeping holes, mode, timestamps and, when allowed, ownership.
+ * Returns nonzero on failure with errno set
+ */
+int copy_file(const char *src, const char *dest)
+{
+	return copy_file_progress(src, dest, NULL, NULL);
+}
+
+/* One copy_tree(), shared by the walker and the workers */
+typedef struct {
+	pthread_mutex_t lock;
+	int error; /* first errno, 0 while everything copies fine */
+	dev_t top_dev; /* the copy itself, never walked into */
+	ino_t top_ino;
+	int stopped; /* progress asked to stop */
+	copy_progress progress;
+	void *arg;
+	char **dirs; /* directories to give their attributes at the end */
+	struct stat *dir_st;
+	int ndirs, dirs_cap;
+} tree_copy;
+
+/* File copied by a worker */
+typedef struct {
+	char *src;
+	char *dest;
+} copy_job;
+
+static void tree_error(tree_copy *tc, int err)
+{
+	pthread_mutex_lock(&tc->lock);
+	if (!tc->error || err == ECANCELED)
+		tc->error = err;
+	if (err == ECANCELED)
+		tc->stopped = 1;
+	pthread_mutex_unlock(&tc->lock);
+}
+
+static int tree_stopped(tree_copy *tc)
+{
+	pthread_mutex_lock(&tc->lock);
+	int stopped = tc->stopped;
+	pthread_mutex_unlock(&tc->lock);
+	return stopped;
+}
+
+static void copy_worker(void *arg, void *item)
+{
+	tree_copy *tc = arg;
+	copy_job *job = item;
+	/* what was still queued when stopped is dropped */
+	if (!tree_stopped(tc) && copy_file_progress(job->src, job->dest, tc->progress, tc->arg))
+		tree_error(tc, errno);
+	free(job->src);
+	free(job->dest);
+	free(job);
+}
+
+/*
+ * Give dest the owner, mode and timestamps of st
+ */
+static int copy_attributes(const char *dest, const struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+	if (S_ISLNK(st->st_mode)) {
+		lchown(dest, st->st_uid, st->st_gid);
+		return utimensat(AT_FDCWD, dest, times, AT_SYMLINK_NOFOLLOW);
+	}
+	mode_t mode = st->st_mode & 07777;
+	if (chown(dest, st->st_uid, st->st_gid) == -1) {
+		chown(dest, -1, st->st_gid);
+		mode &= ~(S_ISUID | S_ISGID);
+	}
+	if (chmod(dest, mode) == -1)
+		return -1;
+	return utimensat(AT_FDCWD, dest, times, 0);
+}
+
+/*
+ * Recreate a symlink, FIFO, socket or device node
+ */
+static int copy_special(const char *src, const char *dest, const struct stat *st)
+{
+	if (S_ISLNK(st->st_mode)) {
+		char target[PATH_MAX];
+		ssize_t len = readlink(src, target, sizeof(target) - 1);
+		if (len == -1)
+			return -1;
+		target[len] = '\0';
+		if (symlink(target, dest) == -1)
+			return -1;
+	} else if (S_ISFIFO(st->st_mode)) {
+		if (mkfifo(dest, 0600) == -1)
+			return -1;
+	} else if (mknod(dest, (st->st_mode & S_IFMT) | 0600, st->st_rdev) == -1) {
+		return -1;
+	}
+	return copy_attributes(dest, st);
+}
+
+/*
+ * Create directory dest for src, its attributes are set once it is filled
+ */
+static int make_dir(tree_copy *tc, const char *dest, const struct stat *st)
+{
+	struct stat dest_st;
+	if (mkdir(dest, 0700) == -1 && errno != EEXIST)
+		return -1;
+	/* copying into an existing directory merges them */
+	if (stat(dest, &dest_st) == -1)
+		return -1;
+	if (!S_ISDIR(dest_st.st_mode)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	if (tc->ndirs == 0) {
+		tc->top_dev = dest_st.st_dev;
+		tc->top_ino = dest_st.st_ino;
+	}
+	if (tc->ndirs == tc->dirs_cap) {
+		tc->dirs_cap = tc->dirs_cap ? tc->dirs_cap * 2 : 64;
+		tc->dirs = rememalloc(tc->dirs, tc->dirs_cap * sizeof(char *));
+		tc->dir_st = rememalloc(tc->dir_st, tc->dirs_cap * sizeof(struct stat));
+	}
+	tc->dirs[tc->ndirs] = estrdup((char *) dest);
+	tc->dir_st[tc->ndirs++] = *st;
+	return 0;
+}
+
+/*
+ * Walk directory src recreating it as dest, regular files are handed to
+ * the pool and everything else is made right away
+ */
+static void walk_tree(tree_copy *tc, pool *p, const char *src, const char *dest, const struct stat *st)
+{
+	if (make_dir(tc, dest, st) == -1) {
+		tree_error(tc, errno);
+		return;
+	}
+	DIR *dp = opendir(src);
+	if (!dp) {
+		tree_error(tc, errno);
+		return;
+	}
+	struct dirent *ep;
+	while ((ep = readdir(dp)) && !tree_stopped(tc)) {
+		const char *name = ep->d_name;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+			continue;
+		char child_src[PATH_MAX], child_dest[PATH_MAX];
+		if (snprintf(child_src, PATH_MAX, "%s/%s", src, name) >= PATH_MAX
+				|| snprintf(child_dest, PATH_MAX, "%s/%s", dest, name) >= PATH_MAX) {
+			tree_error(tc, ENAMETOOLONG);
+			continue;
+		}
+
+		/* regular files are stat()ed by copy_file() anyway */
+		if (ep->d_type == DT_REG) {
+			copy_job *job = memalloc(sizeof(copy_job));
+			job->src = estrdup(child_src);
+			job->dest = estrdup(child_dest);
+			pool_submit(p, job);
+			continue;
+		}
+		struct stat child_st;
+		if (lstat(child_src, &child_st) == -1) {
+			tree_error(tc, errno);
+		} else if (S_ISDIR(child_st.st_mode)) {
+			if (child_st.st_dev != tc->top_dev || child_st.st_ino != tc->top_ino)
+				walk_tree(tc, p, child_src, child_dest, &child_st);
+		} else if (S_ISREG(child_st.st_mode)) {
+			copy_job *job = memalloc(sizeof(copy_job));
+			job->src = estrdup(child_src);
+			job->dest = estrdup(child_dest);
+			pool_submit(p, job);
+		} else if (copy_special(child_src, child_dest, &child_st) == -1) {
+			tree_error(tc, errno);
+		}
+	}
+	closedir(dp);
+}
+
+/*
+ * Copy src to dest, directories recursively with workers threads copying
+ * their files. Symlinks, FIFOs and device nodes inside are recreated, not
+ * followed. progress, if not NULL, is called from any of the threads as
+ * data is copied and stops the copy by returning nonzero.
+ * Returns nonzero with errno set to the first error, copying as much as
+ * possible regardless, or ECANCELED if stopped
+ */
+int copy_tree(const char *src, const char *dest, int workers, copy_progress progress, void *arg)
+{
+	struct stat st;
+	if (stat(src, &st) == -1)
+		return 1;
+	if (!S_ISDIR(st.st_mode))
+		return copy_file_progress(src, dest, progress, arg);
+	struct stat dest_st;
+	if (stat(dest, &dest_st) == 0 && dest_st.st_dev == st.st_dev && dest_st.st_ino == st.st_ino) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	tree_copy tc = { .progress = progress, .arg = arg };
+	pthread_mutex_init(&tc.lock, NULL);
+	pool *p = pool_new(workers, QUEUE_SIZE, copy_worker, &tc);
+	walk_tree(&tc, p, src, dest, &st);
+	pool_wait(p);
+	pool_free(p);
+
+	/* deepest first, filling a directory changes its mtime */
+	for (int i = tc.ndirs - 1; i >= 0; i--) {
+		if (copy_attributes(tc.dirs[i], &tc.dir_st[i]) == -1)
+			tree_error(&tc, errno);
+		free(tc.dirs[i]);
+	}
+	free(tc.dirs);
+	free(tc.dir_st);
+	pthread_mutex_destroy(&tc.lock);
+	if (tc.error) {
+		errno = tc.error;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef COPY_H_
+#define COPY_H_
+
+#include <sys/types.h>
+
+/* Told about copied files and bytes, returns nonzero to stop copying */
+typedef int (*copy_progress)(void *arg, long files, off_t bytes);
+
+int copy_file(const char *src, const char *dest);
+int copy_tree(const char *src, const char *dest, int workers, copy_progress progress, void *arg);
+
+#endif
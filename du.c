@@ -0,0 +1,1005 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "du.h"
+#include "util.h"
+
+/*
+ * Disk usage of directory trees, like du. Directories are spread over
+ * a few threads, each keeping its own stack and stealing from the
+ * bottom of the others' when it runs dry, so one deep subtree doesn't
+ * leave the rest idle. Allocated blocks are counted, hardlinked files
+ * once per walk.
+ *
+ * What each directory holds itself, and the names of its
+ * subdirectories, is cached by path and trusted for as long as the
+ * directory's mtime stays the same. Walking an unchanged tree again
+ * stats directories only, it never reads them.
+ */
+
+/* Directory waiting to be scanned */
+typedef struct {
+	char *path;
+	int root; /* which of the paths it is under */
+} du_dir;
+
+typedef struct {
+	dev_t dev;
+	ino_t ino; /* 0 for an empty slot */
+	off_t bytes;
+} du_inode;
+
+/* Stack of a worker, stolen from at the bottom */
+typedef struct {
+	pthread_mutex_t lock;
+	du_dir *items;
+	int bottom, top, capacity;
+} du_stack;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	du_stack *stacks;
+	int nstacks;
+	long pending; /* directories pushed and not scanned yet */
+	long version; /* bumped whenever something is pushed */
+	int idle; /* workers waiting for work */
+	int stopped;
+	off_t *sizes;
+	long *left; /* directories of each path not scanned yet */
+	du_callback done;
+	void *arg;
+	/* hardlinked files seen */
+	pthread_mutex_t seen_lock;
+	du_inode *seen;
+	long seen_length, seen_capacity;
+} du_walk;
+
+typedef struct {
+	du_walk *walk;
+	int self;
+} du_worker;
+
+/* What is known of a directory */
+typedef struct {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t own; /* blocks of the directory and its files */
+	char *subdirs; /* names, each ending with a NUL */
+	size_t subdirs_length;
+	du_inode *links; /* hardlinked files, left out of own */
+	int nlinks;
+} du_node;
+
+/* What a directory holds, as read or cached */
+typedef struct {
+	off_t own;
+	char *subdirs;
+	size_t subdirs_length;
+	du_inode *links;
+	int nlinks;
+} du_contents;
+
+/* Index file: header, a table of nslots record offsets by hash of the
+ * path (0 for none), then the records */
+#define INDEX_MAGIC "CCCDU001"
+
+typedef struct {
+	char magic[8];
+	uint64_t nslots; /* a power of two */
+	uint64_t count;
+} du_index_header;
+
+/* Directory in the index, followed by its path, subdirs and links, and
+ * padded to 8 bytes */
+typedef struct {
+	uint64_t dev, ino;
+	int64_t mtime_sec, mtime_nsec;
+	int64_t own;
+	uint32_t path_length, subdirs_length, nlinks, pad;
+} du_record;
+
+/* Directory to be written to the index, from memory or the old index */
+typedef struct {
+	const char *path;
+	du_record rec;
+	const void *subdirs, *links;
+} du_entry;
+
+/* Size worked out for the UI */
+typedef struct {
+	char *path;
+	off_t size;
+} du_result;
+
+/* Request being worked on by the service */
+typedef struct {
+	char **paths;
+	unsigned long generation;
+} du_request_state;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static du_node *cache = NULL;
+static long cache_length = 0, cache_capacity = 0;
+static int cache_dirty = 0; /* changed since the index was written */
+
+static char *index_path = NULL;
+static unsigned char *index_map = NULL; /* read only */
+static size_t index_size = 0;
+static uint64_t index_slots = 0;
+static unsigned char *index_hits = NULL; /* slots found unchanged by a walk */
+static char **walked = NULL; /* trees walked all the way through */
+static int nwalked = 0;
+
+static pthread_mutex_t service_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t service_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t service;
+static int service_started = 0;
+static int service_quitting = 0;
+static int service_workers = 1;
+static char **wanted = NULL; /* paths asked for, not started yet */
+static int nwanted = 0;
+static unsigned long generation = 0; /* bumped by every request */
+static du_result *results = NULL; /* ready for du_collect(), first in first out */
+static int results_head = 0, nresults = 0, results_capacity = 0;
+static int notify[2] = { -1, -1 }; /* service -> UI wakeup */
+
+static uint64_t hash(const char *s)
+{
+	uint64_t h = 14695981039346656037u;
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 1099511628211u;
+	return h;
+}
+
+/*
+ * Slot of path in the cache, empty if it isn't there, called with cache_lock held
+ */
+static du_node *cache_slot(const char *path)
+{
+	unsigned long b = hash(path) & (cache_capacity - 1);
+	while (cache[b].path && strcmp(cache[b].path, path))
+		b = (b + 1) & (cache_capacity - 1);
+	return &cache[b];
+}
+
+/*
+ * Remember a directory, taking what c points to, called with cache_lock held
+ */
+static void cache_put(const char *path, const struct stat *st, du_contents *c)
+{
+	if ((cache_length + 1) * 2 > cache_capacity) {
+		du_node *old = cache;
+		long old_capacity = cache_capacity;
+		cache_capacity = cache_capacity ? cache_capacity * 2 : 1024;
+		cache = memalloc(cache_capacity * sizeof(du_node));
+		memset(cache, 0, cache_capacity * sizeof(du_node));
+		for (long i = 0; i < old_capacity; i++) {
+			if (old[i].path)
+				*cache_slot(old[i].path) = old[i];
+		}
+		free(old);
+	}
+	du_node *node = cache_slot(path);
+	if (node->path) {
+		free(node->subdirs);
+		free(node->links);
+	} else {
+		node->path = estrdup((char *) path);
+		cache_length++;
+	}
+	node->dev = st->st_dev;
+	node->ino = st->st_ino;
+	node->mtime = st->st_mtim;
+	node->own = c->own;
+	node->subdirs = c->subdirs;
+	node->subdirs_length = c->subdirs_length;
+	node->links = c->links;
+	node->nlinks = c->nlinks;
+	cache_dirty = 1;
+}
+
+/*
+ * Find path in the index, copying its record to rec and its slot to slot
+ * Returns where its path starts, NULL if it isn't there
+ */
+static const unsigned char *index_find(const char *path, du_record *rec, uint64_t *slot)
+{
+	if (!index_map)
+		return NULL;
+	size_t len = strlen(path);
+	uint64_t mask = index_slots - 1;
+	uint64_t b = hash(path) & mask;
+	for (uint64_t probes = 0; probes < index_slots; probes++, b = (b + 1) & mask) {
+		uint64_t offset;
+		memcpy(&offset, index_map + sizeof(du_index_header) + b * sizeof(uint64_t), sizeof(offset));
+		if (!offset || offset > index_size - sizeof(du_record))
+			return NULL;
+		memcpy(rec, index_map + offset, sizeof(du_record));
+		/* a damaged index only misses */
+		uint64_t need = (uint64_t) rec->path_length + rec->subdirs_length
+			+ (uint64_t) rec->nlinks * sizeof(du_inode);
+		if (need > index_size - offset - sizeof(du_record))
+			return NULL;
+		const unsigned char *data = index_map + offset + sizeof(du_record);
+		if (rec->path_length == len && !memcmp(data, path, len)) {
+			*slot = b;
+			return data;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Look a directory up in the index, copying what it holds if unchanged
+ * Returns nonzero if it has to be read again
+ */
+static int index_get(const char *path, const struct stat *st, du_contents *c)
+{
+	du_record rec;
+	uint64_t slot;
+	const unsigned char *data = index_find(path, &rec, &slot);
+	if (!data || rec.dev != (uint64_t) st->st_dev || rec.ino != (uint64_t) st->st_ino
+			|| rec.mtime_sec != st->st_mtim.tv_sec || rec.mtime_nsec != st->st_mtim.tv_nsec)
+		return 1;
+	pthread_mutex_lock(&cache_lock);
+	index_hits[slot] = 1;
+	pthread_mutex_unlock(&cache_lock);
+	c->own = rec.own;
+	c->subdirs_length = rec.subdirs_length;
+	c->subdirs = memalloc(c->subdirs_length + 1);
+	memcpy(c->subdirs, data + rec.path_length, c->subdirs_length);
+	c->nlinks = rec.nlinks;
+	c->links = memalloc((c->nlinks + 1) * sizeof(du_inode));
+	memcpy(c->links, data + rec.path_length + rec.subdirs_length, c->nlinks * sizeof(du_inode));
+	return 0;
+}
+
+/*
+ * Look a directory up in the cache, copying what it holds if unchanged
+ * Returns nonzero if it has to be read again
+ */
+static int cache_get(const char *path, const struct stat *st, du_contents *c)
+{
+	pthread_mutex_lock(&cache_lock);
+	du_node *node = cache_capacity ? cache_slot(path) : NULL;
+	if (!node || !node->path) {
+		pthread_mutex_unlock(&cache_lock);
+		return index_get(path, st, c);
+	}
+	int stale = node->dev != st->st_dev || node->ino != st->st_ino
+		|| node->mtime.tv_sec != st->st_mtim.tv_sec || node->mtime.tv_nsec != st->st_mtim.tv_nsec;
+	if (!stale) {
+		c->own = node->own;
+		c->subdirs_length = node->subdirs_length;
+		c->subdirs = memalloc(c->subdirs_length + 1);
+		memcpy(c->subdirs, node->subdirs, c->subdirs_length);
+		c->nlinks = node->nlinks;
+		c->links = memalloc((c->nlinks + 1) * sizeof(du_inode));
+		memcpy(c->links, node->links, c->nlinks * sizeof(du_inode));
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return stale;
+}
+
+/*
+ * Map the index at path, a missing or broken one is left unused
+ */
+static void index_load(const char *path)
+{
+	index_path = estrdup((char *) path);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1)
+		return;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t) (sizeof(du_index_header) + sizeof(du_record))) {
+		index_size = st.st_size;
+		index_map = mmap(NULL, index_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (index_map == MAP_FAILED)
+			index_map = NULL;
+	}
+	close(fd);
+	if (!index_map)
+		return;
+	du_index_header h;
+	memcpy(&h, index_map, sizeof(h));
+	if (memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic)) || !h.nslots || h.nslots & (h.nslots - 1)
+			|| h.nslots > (index_size - sizeof(h)) / sizeof(uint64_t)) {
+		munmap(index_map, index_size);
+		index_map = NULL;
+		return;
+	}
+	index_slots = h.nslots;
+	index_hits = memalloc(index_slots);
+	memset(index_hits, 0, index_slots);
+}
+
+/*
+ * Whether path is one of the trees walked all the way through or in one
+ */
+static int under_walked(const char *path)
+{
+	for (int i = 0; i < nwalked; i++) {
+		size_t len = strlen(walked[i]);
+		if (!strncmp(path, walked[i], len) && (!path[len] || path[len] == '/'
+					|| (len && walked[i][len - 1] == '/')))
+			return 1;
+	}
+	return 0;
+}
+
+static size_t record_size(const du_record *rec)
+{
+	size_t size = sizeof(du_record) + rec->path_length + rec->subdirs_length
+		+ rec->nlinks * sizeof(du_inode);
+	return (size + 7) & ~(size_t) 7;
+}
+
+/*
+ * Write the index back with what was learned merged in, called once
+ * nothing uses the cache anymore. Records only in the old index are
+ * kept unless a walk over the tree they are in didn't come across them
+ */
+static void index_save(void)
+{
+	if (!index_path || !cache_dirty)
+		return;
+	/* everything in memory, and what is only in the old index */
+	uint64_t old = 0;
+	for (uint64_t b = 0; index_map && b < index_slots; b++) {
+		uint64_t offset;
+		memcpy(&offset, index_map + sizeof(du_index_header) + b * sizeof(uint64_t), sizeof(offset));
+		old += offset != 0;
+	}
+	du_entry *entries = memalloc((cache_length + old + 1) * sizeof(du_entry));
+	uint64_t n = 0;
+	for (long i = 0; i < cache_capacity; i++) {
+		du_node *node = &cache[i];
+		if (!node->path)
+			continue;
+		du_entry *e = &entries[n++];
+		memset(&e->rec, 0, sizeof(du_record));
+		e->path = node->path;
+		e->rec.dev = node->dev;
+		e->rec.ino = node->ino;
+		e->rec.mtime_sec = node->mtime.tv_sec;
+		e->rec.mtime_nsec = node->mtime.tv_nsec;
+		e->rec.own = node->own;
+		e->rec.path_length = strlen(node->path);
+		e->rec.subdirs_length = node->subdirs_length;
+		e->rec.nlinks = node->nlinks;
+		e->subdirs = node->subdirs;
+		e->links = node->links;
+	}
+	for (uint64_t b = 0; index_map && b < index_slots; b++) {
+		uint64_t offset;
+		memcpy(&offset, index_map + sizeof(du_index_header) + b * sizeof(uint64_t), sizeof(offset));
+		if (!offset || offset > index_size - sizeof(du_record))
+			continue;
+		du_entry *e = &entries[n];
+		memcpy(&e->rec, index_map + offset, sizeof(du_record));
+		if (record_size(&e->rec) > index_size - offset)
+			continue;
+		const char *path = (const char *) index_map + offset + sizeof(du_record);
+		char key[e->rec.path_length + 1];
+		memcpy(key, path, e->rec.path_length);
+		key[e->rec.path_length] = '\0';
+		if (cache_capacity && cache_slot(key)->path)
+			continue;
+		/* a complete walk over it missed it, it is gone */
+		if (!index_hits[b] && under_walked(key))
+			continue;
+		e->path = path;
+		e->subdirs = path + e->rec.path_length;
+		e->links = path + e->rec.path_length + e->rec.subdirs_length;
+		n++;
+	}
+
+	du_index_header h;
+	memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+	h.nslots = 16;
+	while (h.nslots < n * 2)
+		h.nslots *= 2;
+	h.count = n;
+	uint64_t *slots = memalloc(h.nslots * sizeof(uint64_t));
+	memset(slots, 0, h.nslots * sizeof(uint64_t));
+	uint64_t offset = sizeof(h) + h.nslots * sizeof(uint64_t);
+	for (uint64_t i = 0; i < n; i++) {
+		char key[entries[i].rec.path_length + 1];
+		memcpy(key, entries[i].path, entries[i].rec.path_length);
+		key[entries[i].rec.path_length] = '\0';
+		uint64_t b = hash(key) & (h.nslots - 1);
+		while (slots[b])
+			b = (b + 1) & (h.nslots - 1);
+		slots[b] = offset;
+		offset += record_size(&entries[i].rec);
+	}
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, PATH_MAX, "%s.%ld", index_path, (long) getpid());
+	FILE *f = fopen(tmp, "w");
+	if (f) {
+		static const char zeros[8];
+		fwrite(&h, sizeof(h), 1, f);
+		fwrite(slots, sizeof(uint64_t), h.nslots, f);
+		for (uint64_t i = 0; i < n; i++) {
+			du_record *rec = &entries[i].rec;
+			size_t size = sizeof(du_record) + rec->path_length + rec->subdirs_length
+				+ rec->nlinks * sizeof(du_inode);
+			fwrite(rec, sizeof(du_record), 1, f);
+			fwrite(entries[i].path, 1, rec->path_length, f);
+			fwrite(entries[i].subdirs, 1, rec->subdirs_length, f);
+			fwrite(entries[i].links, sizeof(du_inode), rec->nlinks, f);
+			fwrite(zeros, 1, record_size(rec) - size, f);
+		}
+		/* replaced in one go, whoever quits last wins */
+		if (fclose(f) || rename(tmp, index_path))
+			unlink(tmp);
+	}
+	free(slots);
+	free(entries);
+	cache_dirty = 0;
+}
+
+/*
+ * Forget everything cached
+ */
+void du_cache_free(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	for (long i = 0; i < cache_capacity; i++) {
+		free(cache[i].path);
+		free(cache[i].subdirs);
+		free(cache[i].links);
+	}
+	free(cache);
+	cache = NULL;
+	cache_length = cache_capacity = 0;
+	if (index_map)
+		munmap(index_map, index_size);
+	index_map = NULL;
+	free(index_hits);
+	index_hits = NULL;
+	for (int i = 0; i < nwalked; i++)
+		free(walked[i]);
+	free(walked);
+	walked = NULL;
+	nwalked = 0;
+	free(index_path);
+	index_path = NULL;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Add an inode to the set unless it is there, called with seen_lock held
+ * Returns nonzero if it was there
+ */
+static int seen_insert(du_walk *w, dev_t dev, ino_t ino)
+{
+	unsigned long b = (ino * 2654435761u ^ dev) & (w->seen_capacity - 1);
+	for (; w->seen[b].ino; b = (b + 1) & (w->seen_capacity - 1)) {
+		if (w->seen[b].ino == ino && w->seen[b].dev == dev)
+			return 1;
+	}
+	w->seen[b].dev = dev;
+	w->seen[b].ino = ino;
+	w->seen_length++;
+	return 0;
+}
+
+/*
+ * Check off a hardlinked file
+ * Returns nonzero if it was seen already
+ */
+static int seen(du_walk *w, const du_inode *inode)
+{
+	pthread_mutex_lock(&w->seen_lock);
+	if ((w->seen_length + 1) * 2 > w->seen_capacity) {
+		du_inode *old = w->seen;
+		long old_capacity = w->seen_capacity;
+		w->seen_capacity = old_capacity ? old_capacity * 2 : 256;
+		w->seen = memalloc(w->seen_capacity * sizeof(du_inode));
+		memset(w->seen, 0, w->seen_capacity * sizeof(du_inode));
+		w->seen_length = 0;
+		for (long i = 0; i < old_capacity; i++) {
+			if (old[i].ino)
+				seen_insert(w, old[i].dev, old[i].ino);
+		}
+		free(old);
+	}
+	int found = seen_insert(w, inode->dev, inode->ino);
+	pthread_mutex_unlock(&w->seen_lock);
+	return found;
+}
+
+/*
+ * Push a directory on a stack, called with its lock held
+ */
+static void push(du_stack *stack, char *path, int root)
+{
+	if (stack->top == stack->capacity) {
+		/* slide down what was stolen from the bottom before growing */
+		if (stack->bottom) {
+			memmove(stack->items, stack->items + stack->bottom,
+					(stack->top - stack->bottom) * sizeof(du_dir));
+			stack->top -= stack->bottom;
+			stack->bottom = 0;
+		}
+		if (stack->top == stack->capacity) {
+			stack->capacity = stack->capacity ? stack->capacity * 2 : 64;
+			stack->items = rememalloc(stack->items, stack->capacity * sizeof(du_dir));
+		}
+	}
+	stack->items[stack->top].path = path;
+	stack->items[stack->top].root = root;
+	stack->top++;
+}
+
+/*
+ * Take the next directory, from the top of our own stack or the
+ * bottom of someone else's
+ * Returns nonzero if there was none
+ */
+static int take(du_walk *w, int self, du_dir *d)
+{
+	du_stack *own = &w->stacks[self];
+	pthread_mutex_lock(&own->lock);
+	int empty = own->top == own->bottom;
+	if (!empty)
+		*d = own->items[--own->top];
+	pthread_mutex_unlock(&own->lock);
+	for (int i = 1; i < w->nstacks && empty; i++) {
+		du_stack *victim = &w->stacks[(self + i) % w->nstacks];
+		pthread_mutex_lock(&victim->lock);
+		empty = victim->top == victim->bottom;
+		if (!empty)
+			*d = victim->items[victim->bottom++];
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return empty;
+}
+
+/*
+ * Read a directory, adding up its files and collecting its
+ * subdirectories and hardlinked files
+ */
+static void read_dir(const char *path, const struct stat *st, du_contents *c)
+{
+	memset(c, 0, sizeof(du_contents));
+	c->own = (off_t) st->st_blocks * 512;
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dp = fd == -1 ? NULL : fdopendir(fd);
+	if (!dp) {
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	size_t capacity = 0;
+	int links_capacity = 0;
+	struct dirent *ep;
+	while ((ep = readdir(dp))) {
+		const char *name = ep->d_name;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+			continue;
+		struct stat child;
+		if (fstatat(fd, name, &child, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		if (S_ISDIR(child.st_mode)) {
+			size_t n = strlen(name) + 1;
+			if (c->subdirs_length + n > capacity) {
+				capacity = capacity ? capacity * 2 : 256;
+				while (c->subdirs_length + n > capacity)
+					capacity *= 2;
+				c->subdirs = rememalloc(c->subdirs, capacity);
+			}
+			memcpy(c->subdirs + c->subdirs_length, name, n);
+			c->subdirs_length += n;
+		} else if (child.st_nlink > 1) {
+			if (c->nlinks == links_capacity) {
+				links_capacity = links_capacity ? links_capacity * 2 : 16;
+				c->links = rememalloc(c->links, links_capacity * sizeof(du_inode));
+			}
+			du_inode *link = &c->links[c->nlinks++];
+			link->dev = child.st_dev;
+			link->ino = child.st_ino;
+			link->bytes = (off_t) child.st_blocks * 512;
+		} else {
+			c->own += (off_t) child.st_blocks * 512;
+		}
+	}
+	closedir(dp);
+}
+
+static void stop(du_walk *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->stopped = 1;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Check a directory off after pushing count subdirectories of it
+ */
+static void done_one(du_walk *w, long count)
+{
+	pthread_mutex_lock(&w->lock);
+	w->pending--;
+	if (count)
+		w->version++;
+	if ((count && w->idle) || !w->pending)
+		pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Size up a directory and push its subdirectories for whoever is free
+ */
+static void scan(du_walk *w, int self, du_dir *d)
+{
+	du_contents c;
+	memset(&c, 0, sizeof(c));
+	struct stat st;
+	if (stat(d->path, &st) == 0 && cache_get(d->path, &st, &c)) {
+		read_dir(d->path, &st, &c);
+		du_contents copy = c;
+		copy.subdirs = memalloc(c.subdirs_length + 1);
+		memcpy(copy.subdirs, c.subdirs, c.subdirs_length);
+		copy.links = memalloc((c.nlinks + 1) * sizeof(du_inode));
+		memcpy(copy.links, c.links, c.nlinks * sizeof(du_inode));
+		pthread_mutex_lock(&cache_lock);
+		cache_put(d->path, &st, &copy);
+		pthread_mutex_unlock(&cache_lock);
+	}
+	/* hardlinked files count where they are met first in this walk */
+	for (int i = 0; i < c.nlinks; i++) {
+		if (!seen(w, &c.links[i]))
+			c.own += c.links[i].bytes;
+	}
+	free(c.links);
+
+	long count = 0;
+	for (size_t i = 0; i < c.subdirs_length; i += strlen(c.subdirs + i) + 1)
+		count++;
+	if (count) {
+		/* counted before anyone can take them, so pending never drops to 0 early */
+		pthread_mutex_lock(&w->lock);
+		w->pending += count;
+		w->left[d->root] += count;
+		pthread_mutex_unlock(&w->lock);
+		du_stack *stack = &w->stacks[self];
+		size_t plen = strlen(d->path);
+		pthread_mutex_lock(&stack->lock);
+		for (size_t i = 0; i < c.subdirs_length; i += strlen(c.subdirs + i) + 1) {
+			char *child = memalloc(plen + strlen(c.subdirs + i) + 2);
+			sprintf(child, "%s/%s", d->path, c.subdirs + i);
+			push(stack, child, d->root);
+		}
+		pthread_mutex_unlock(&stack->lock);
+	}
+	free(c.subdirs);
+
+	pthread_mutex_lock(&w->lock);
+	w->sizes[d->root] += c.own;
+	int finished = --w->left[d->root] == 0;
+	off_t size = w->sizes[d->root];
+	pthread_mutex_unlock(&w->lock);
+	if (finished && w->done && w->done(w->arg, d->root, size))
+		stop(w);
+	free(d->path);
+	done_one(w, count);
+}
+
+static void *du_work(void *arg)
+{
+	du_worker *me = arg;
+	du_walk *w = me->walk;
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		long version = w->version;
+		int stopped = w->stopped;
+		pthread_mutex_unlock(&w->lock);
+
+		du_dir d = { NULL, 0 };
+		if (!take(w, me->self, &d)) {
+			/* once stopped what is left is only thrown away */
+			if (!stopped && w->done && w->done(w->arg, -1, 0)) {
+				stop(w);
+				stopped = 1;
+			}
+			if (stopped) {
+				free(d.path);
+				done_one(w, 0);
+			} else {
+				scan(w, me->self, &d);
+			}
+			continue;
+		}
+		/* nothing to take, wait for more unless all is done */
+		pthread_mutex_lock(&w->lock);
+		if (!w->pending) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		if (w->version == version) {
+			w->idle++;
+			pthread_cond_wait(&w->cond, &w->lock);
+			w->idle--;
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Disk usage of n directories with workers threads, the caller being one
+ * of them. sizes[i] is set to the bytes allocated under paths[i], -1 if
+ * it can't be read. done, if not NULL, is told of each as it finishes,
+ * the earlier ones first, and with -1 for i now and then to ask whether
+ * to stop
+ * Returns nonzero if any couldn't be read or it was stopped
+ */
+int du_sizes(char **paths, int n, off_t *sizes, int workers, du_callback done, void *arg)
+{
+	du_walk w;
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	pthread_mutex_init(&w.seen_lock, NULL);
+	w.nstacks = workers > 0 ? workers : 1;
+	w.stacks = memalloc(w.nstacks * sizeof(du_stack));
+	memset(w.stacks, 0, w.nstacks * sizeof(du_stack));
+	for (int i = 0; i < w.nstacks; i++)
+		pthread_mutex_init(&w.stacks[i].lock, NULL);
+	w.pending = w.version = 0;
+	w.idle = w.stopped = 0;
+	w.sizes = sizes;
+	w.left = memalloc((n ? n : 1) * sizeof(long));
+	w.done = done;
+	w.arg = arg;
+	w.seen = NULL;
+	w.seen_length = w.seen_capacity = 0;
+
+	int ret = 0;
+	/* dealt out backwards so the first ones are on top of every stack */
+	for (int i = n - 1; i >= 0; i--) {
+		struct stat st;
+		sizes[i] = 0;
+		w.left[i] = 1;
+		if (stat(paths[i], &st) == -1 || !S_ISDIR(st.st_mode)) {
+			sizes[i] = -1;
+			ret = -1;
+			continue;
+		}
+		push(&w.stacks[i % w.nstacks], estrdup(paths[i]), i);
+		w.pending++;
+	}
+
+	du_worker *me = memalloc(w.nstacks * sizeof(du_worker));
+	pthread_t *threads = memalloc(w.nstacks * sizeof(pthread_t));
+	/* Leave signals like SIGWINCH to the UI thread */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (int i = 0; i < w.nstacks; i++) {
+		me[i].walk = &w;
+		me[i].self = i;
+		if (i && pthread_create(&threads[i], NULL, du_work, &me[i]))
+			die("ccc: Cannot create du thread");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	for (int i = 0; i < n && done; i++) {
+		if (sizes[i] == -1 && done(arg, i, -1))
+			stop(&w);
+	}
+	du_work(&me[0]);
+	for (int i = 1; i < w.nstacks; i++)
+		pthread_join(threads[i], NULL);
+	/* what the index has under them and the walk missed is gone */
+	if (index_map && !w.stopped) {
+		pthread_mutex_lock(&cache_lock);
+		for (int i = 0; i < n; i++) {
+			if (sizes[i] == -1)
+				continue;
+			walked = rememalloc(walked, (nwalked + 1) * sizeof(char *));
+			walked[nwalked++] = estrdup(paths[i]);
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	for (int i = 0; i < w.nstacks; i++) {
+		pthread_mutex_destroy(&w.stacks[i].lock);
+		free(w.stacks[i].items);
+	}
+	free(w.stacks);
+	free(w.seen);
+	free(w.left);
+	free(me);
+	free(threads);
+	pthread_mutex_destroy(&w.lock);
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.seen_lock);
+	return ret || w.stopped ? -1 : 0;
+}
+
+/*
+ * Report a finished path to the UI, called from the walk
+ * Returns nonzero once the request is outdated
+ */
+static int service_report(void *arg, int i, off_t size)
+{
+	du_request_state *r = arg;
+	pthread_mutex_lock(&service_lock);
+	int stale = r->generation != generation || service_quitting;
+	if (!stale && i >= 0) {
+		if (nresults == results_capacity && results_head) {
+			nresults -= results_head;
+			memmove(results, results + results_head, nresults * sizeof(du_result));
+			results_head = 0;
+		}
+		if (nresults == results_capacity) {
+			results_capacity = results_capacity ? results_capacity * 2 : 64;
+			results = rememalloc(results, results_capacity * sizeof(du_result));
+		}
+		results[nresults].path = estrdup(r->paths[i]);
+		results[nresults].size = size;
+		nresults++;
+		char c = 0;
+		write(notify[1], &c, 1);
+	}
+	pthread_mutex_unlock(&service_lock);
+	return stale;
+}
+
+static void *du_service(void *arg)
+{
+	pthread_mutex_lock(&service_lock);
+	while (!service_quitting) {
+		if (!nwanted) {
+			pthread_cond_wait(&service_cond, &service_lock);
+			continue;
+		}
+		du_request_state r = { wanted, generation };
+		int n = nwanted;
+		wanted = NULL;
+		nwanted = 0;
+		pthread_mutex_unlock(&service_lock);
+
+		off_t *sizes = memalloc(n * sizeof(off_t));
+		du_sizes(r.paths, n, sizes, service_workers, service_report, &r);
+		free(sizes);
+		for (int i = 0; i < n; i++)
+			free(r.paths[i]);
+		free(r.paths);
+
+		pthread_mutex_lock(&service_lock);
+	}
+	pthread_mutex_unlock(&service_lock);
+	return NULL;
+}
+
+/*
+ * Drop what was asked for and not collected yet, called with service_lock held
+ */
+static void forget_requests(void)
+{
+	for (int i = 0; i < nwanted; i++)
+		free(wanted[i]);
+	free(wanted);
+	wanted = NULL;
+	nwanted = 0;
+	for (int i = results_head; i < nresults; i++)
+		free(results[i].path);
+	results_head = nresults = 0;
+	generation++;
+}
+
+/*
+ * Set up sizes for the UI, worked out by workers threads and kept in
+ * the index file at index, none if it is empty
+ */
+void du_init(int workers, const char *index)
+{
+	service_workers = workers;
+	if (index[0])
+		index_load(index);
+	if (pipe(notify) == -1)
+		die("ccc: Cannot create du pipe");
+	fcntl(notify[0], F_SETFL, O_NONBLOCK);
+	fcntl(notify[1], F_SETFL, O_NONBLOCK);
+}
+
+void du_cleanup(void)
+{
+	pthread_mutex_lock(&service_lock);
+	service_quitting = 1;
+	forget_requests();
+	pthread_cond_broadcast(&service_cond);
+	pthread_mutex_unlock(&service_lock);
+	if (service_started)
+		pthread_join(service, NULL);
+	free(results);
+	close(notify[0]);
+	close(notify[1]);
+	index_save();
+	du_cache_free();
+}
+
+/*
+ * File descriptor that becomes readable when sizes are ready
+ */
+int du_fd(void)
+{
+	return notify[0];
+}
+
+/*
+ * Work out the sizes of n directories in the background, most wanted
+ * first, dropping whatever was asked for before
+ */
+void du_request(char **paths, int n)
+{
+	pthread_mutex_lock(&service_lock);
+	forget_requests();
+	wanted = memalloc((n ? n : 1) * sizeof(char *));
+	for (int i = 0; i < n; i++)
+		wanted[i] = estrdup(paths[i]);
+	nwanted = n;
+	if (!service_started) {
+		/* Leave signals like SIGWINCH to the UI thread */
+		sigset_t all, old;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		if (pthread_create(&service, NULL, du_service, NULL))
+			die("ccc: Cannot create du thread");
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		service_started = 1;
+	}
+	pthread_cond_broadcast(&service_cond);
+	pthread_mutex_unlock(&service_lock);
+}
+
+/*
+ * Stop working out sizes nobody needs anymore
+ */
+void du_cancel(void)
+{
+	pthread_mutex_lock(&service_lock);
+	forget_requests();
+	pthread_mutex_unlock(&service_lock);
+}
+
+/*
+ * Take the oldest size that is ready, path holds PATH_MAX bytes, size
+ * is -1 if it couldn't be worked out
+ * Returns nonzero if there was one
+ */
+int du_collect(char *path, off_t *size)
+{
+	char buf[64];
+	while (read(notify[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&service_lock);
+	int found = results_head < nresults;
+	if (found) {
+		du_result *r = &results[results_head++];
+		snprintf(path, PATH_MAX, "%s", r->path);
+		*size = r->size;
+		free(r->path);
+		if (results_head == nresults)
+			results_head = nresults = 0;
+	}
+	pthread_mutex_unlock(&service_lock);
+	return found;
+}
@@ -0,0 +1,19 @@
+#ifndef DU_H_
+#define DU_H_
+
+#include <sys/types.h>
+
+/* Told path i is done and its size, or asked with i -1 whether to go
+ * on, returns nonzero to stop */
+typedef int (*du_callback)(void *arg, int i, off_t size);
+
+int du_sizes(char **paths, int n, off_t *sizes, int workers, du_callback done, void *arg);
+void du_cache_free(void);
+void du_init(int workers, const char *index);
+void du_cleanup(void);
+int du_fd(void);
+void du_request(char **paths, int n);
+void du_cancel(void);
+int du_collect(char *path, off_t *size);
+
+#endif
@@ -71,16 +71,24 @@ void arraylist_add(ArrayList *list, char *name, char *path, char *stats, int typ
 	file new_file = { name, path, type, stats, color };
 	strncpy(new_file.icon, icon, sizeof(new_file.icon) / sizeof(new_file.icon[0]));
 
-	if (list->capacity != list->length) {
-		if (marked) {
-			for (int i = 0; i < list->length; i++) {
-				if (strcmp(list->items[i].path, new_file.path) == 0) {
-					if (!force)
-						arraylist_remove(list, i);
-					return;
+	if (marked) {
+		for (int i = 0; i < list->length; i++) {
+			if (strcmp(list->items[i].path, new_file.path) == 0) {
+				/* marked owns its strings, those passed aren't kept */
+				if (!force) {
+					free(list->items[i].name);
+					free(list->items[i].path);
+					free(list->items[i].stats);
+					arraylist_remove(list, i);
 				}
+				free(name);
+				free(path);
+				free(stats);
+				return;
 			}
 		}
+	}
+	if (list->capacity != list->length) {
 		list->items[list->length] = new_file;
 	} else {
 		int new_cap = list->capacity * 2;
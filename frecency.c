@@ -0,0 +1,611 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frecency.h"
+#include "util.h"
+
+/*
+ * Directories visited, ranked by frecency: every visit adds one to the
+ * rank of a directory, and the rank counts for more the more recent the
+ * last visit was. Once the ranks add up to more than a limit they are
+ * all scaled down and those dropping below one are forgotten, so the
+ * store stays small and old habits fade.
+ *
+ * The store is a file mapped in memory. A visit to a known directory
+ * updates its record in place under the lock, new directories are appended in batches
+ * and only count once the header is updated after them, so a ccc dying
+ * halfway leaves a store that loads. Aging writes a new store and
+ * renames it over the old one.
+ */
+
+#define STORE_MAGIC "CCCFRC01"
+#define BATCH 16 /* new directories held back before appending them */
+#define GROWTH (64 * 1024) /* the file grows by this much at a time */
+#define MAX_WORDS 32
+
+typedef struct {
+	char magic[8];
+	uint64_t used; /* bytes of records after the header */
+} store_header;
+
+/* Followed by the path, a NUL and padding to 8 bytes */
+typedef struct {
+	double rank;
+	int64_t last; /* time of the last visit */
+	uint32_t length; /* of the path */
+	uint32_t pad;
+} store_record;
+
+typedef struct {
+	char *path;
+	double rank;
+	time_t last;
+	off_t offset; /* of its record in the store, 0 if not written yet */
+	int next; /* next in its hash bucket, -1 ends */
+} entry;
+
+static char *store_path = NULL;
+static int store_fd = -1;
+static unsigned char *map = NULL;
+static size_t map_size = 0;
+static uint64_t used = 0; /* as far as we know */
+static double max_total = 0;
+
+static entry *entries = NULL;
+static int length = 0, capacity = 0, pending = 0;
+static int *buckets = NULL;
+static int nbuckets = 0;
+static double total = 0; /* of the ranks */
+
+static unsigned long hash(const char *s)
+{
+	unsigned long h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+static void rehash(void)
+{
+	if (nbuckets < capacity * 2) {
+		nbuckets = nbuckets ? nbuckets : 64;
+		while (nbuckets < capacity * 2)
+			nbuckets *= 2;
+		free(buckets);
+		buckets = memalloc(nbuckets * sizeof(int));
+	}
+	for (int i = 0; i < nbuckets; i++)
+		buckets[i] = -1;
+	for (int i = 0; i < length; i++) {
+		int b = hash(entries[i].path) & (nbuckets - 1);
+		entries[i].next = buckets[b];
+		buckets[b] = i;
+	}
+}
+
+static entry *find(const char *path)
+{
+	if (!nbuckets)
+		return NULL;
+	for (int i = buckets[hash(path) & (nbuckets - 1)]; i != -1; i = entries[i].next) {
+		if (!strcmp(entries[i].path, path))
+			return &entries[i];
+	}
+	return NULL;
+}
+
+static entry *add(const char *path, double rank, time_t last, off_t offset)
+{
+	if (length == capacity) {
+		capacity = capacity ? capacity * 2 : 256;
+		entries = rememalloc(entries, capacity * sizeof(entry));
+		rehash();
+	}
+	entry *e = &entries[length];
+	e->path = estrdup((char *) path);
+	e->rank = rank;
+	e->last = last;
+	e->offset = offset;
+	int b = hash(path) & (nbuckets - 1);
+	e->next = buckets[b];
+	buckets[b] = length++;
+	total += rank;
+	return e;
+}
+
+static void clear_entries(void)
+{
+	for (int i = 0; i < length; i++)
+		free(entries[i].path);
+	length = pending = 0;
+	total = 0;
+	rehash();
+}
+
+static size_t record_size(size_t path_length)
+{
+	return (sizeof(store_record) + path_length + 1 + 7) & ~(size_t) 7;
+}
+
+/*
+ * Write what we know of a directory over its record
+ */
+static void write_entry(const entry *e)
+{
+	if (!e->offset || !map)
+		return;
+	store_record *r = (store_record *) (map + e->offset);
+	r->rank = e->rank;
+	r->last = e->last;
+}
+
+static void unmap_store(void)
+{
+	if (map)
+		munmap(map, map_size);
+	map = NULL;
+	map_size = 0;
+}
+
+/*
+ * Map the open store, starting it if it is empty or not a store.
+ * Returns nonzero if it can't be used
+ */
+static int map_store(void)
+{
+	unmap_store();
+	struct stat st;
+	if (fstat(store_fd, &st) == -1)
+		return -1;
+	if (st.st_size < GROWTH) {
+		if (ftruncate(store_fd, GROWTH) == -1)
+			return -1;
+		st.st_size = GROWTH;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, store_fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		return -1;
+	}
+	map_size = st.st_size;
+	store_header *h = (store_header *) map;
+	if (memcmp(h->magic, STORE_MAGIC, sizeof(h->magic))) {
+		h->used = 0;
+		memcpy(h->magic, STORE_MAGIC, sizeof(h->magic));
+	}
+	return 0;
+}
+
+/*
+ * Load the records from offset on, up to the first broken one. Visits
+ * not written yet are added to the record of the same directory if
+ * someone else wrote one
+ */
+static void load_store(uint64_t offset)
+{
+	store_header *h = (store_header *) map;
+	uint64_t end = sizeof(store_header) + h->used;
+	if (end > map_size)
+		end = map_size;
+	while (offset + sizeof(store_record) <= end) {
+		store_record *r = (store_record *) (map + offset);
+		const char *path = (const char *) (r + 1);
+		uint64_t size = record_size(r->length);
+		if (!r->length || r->length >= PATH_MAX || size > end - offset
+				|| path[r->length] != '\0' || !(r->rank >= 0))
+			break;
+		entry *e = find(path);
+		if (!e) {
+			add(path, r->rank, r->last, offset);
+		} else if (!e->offset) {
+			e->rank += r->rank;
+			total += r->rank;
+			if (r->last > e->last)
+				e->last = r->last;
+			e->offset = offset;
+			write_entry(e);
+			pending--;
+		}
+		offset += size;
+	}
+	used = offset - sizeof(store_header);
+}
+
+/*
+ * Lock the store, first catching up with what another ccc did to it
+ */
+static void lock_store(void)
+{
+	while (1) {
+		flock(store_fd, LOCK_EX);
+		struct stat st, cur;
+		if (stat(store_path, &st) == 0 && fstat(store_fd, &cur) == 0
+				&& st.st_ino == cur.st_ino && st.st_dev == cur.st_dev)
+			break;
+		/* replaced, start over from the new one keeping our visits
+		 * not written yet */
+		int keep = 0;
+		for (int i = 0; i < length; i++) {
+			if (entries[i].offset)
+				free(entries[i].path);
+			else
+				entries[keep++] = entries[i];
+		}
+		length = pending = keep;
+		total = 0;
+		for (int i = 0; i < length; i++)
+			total += entries[i].rank;
+		rehash();
+		close(store_fd);
+		unmap_store();
+		store_fd = open(store_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (store_fd == -1)
+			return;
+		flock(store_fd, LOCK_EX);
+		if (map_store() == 0)
+			load_store(sizeof(store_header));
+		flock(store_fd, LOCK_UN);
+	}
+	if (!map)
+		return;
+	if (sizeof(store_header) + ((store_header *) map)->used > map_size)
+		map_store();
+	if (map && ((store_header *) map)->used != used)
+		load_store(sizeof(store_header) + used);
+}
+
+/*
+ * Append the directories not written yet
+ */
+static void append_pending(void)
+{
+	size_t bytes = 0;
+	for (int i = 0; i < length; i++) {
+		if (!entries[i].offset)
+			bytes += record_size(strlen(entries[i].path));
+	}
+	size_t need = sizeof(store_header) + used + bytes;
+	if (need > map_size) {
+		size_t size = (need + GROWTH - 1) / GROWTH * GROWTH;
+		if (ftruncate(store_fd, size) == -1 || map_store() == -1)
+			return;
+	}
+	uint64_t offset = sizeof(store_header) + used;
+	for (int i = 0; i < length; i++) {
+		entry *e = &entries[i];
+		if (e->offset)
+			continue;
+		size_t len = strlen(e->path);
+		store_record *r = (store_record *) (map + offset);
+		memset(r, 0, record_size(len));
+		r->length = len;
+		memcpy(r + 1, e->path, len);
+		e->offset = offset;
+		write_entry(e);
+		offset += record_size(len);
+	}
+	/* only now do they count */
+	used = offset - sizeof(store_header);
+	((store_header *) map)->used = used;
+	pending = 0;
+}
+
+/*
+ * Scale the ranks down to 90% of the limit, forgetting the directories
+ * that drop below one
+ */
+static void age(void)
+{
+	double scale = max_total * 0.9 / total;
+	int keep = 0;
+	total = 0;
+	for (int i = 0; i < length; i++) {
+		entry *e = &entries[i];
+		e->rank *= scale;
+		if (e->rank < 1) {
+			free(e->path);
+			continue;
+		}
+		total += e->rank;
+		entries[keep++] = *e;
+	}
+	length = keep;
+	rehash();
+}
+
+/*
+ * Write everything to a new store and switch to it.
+ * Returns nonzero if that failed
+ */
+static int rewrite_store(void)
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, PATH_MAX, "%s.%ld", store_path, (long) getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	FILE *f = fd == -1 ? NULL : fdopen(fd, "w");
+	if (!f) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	static const char zeros[8];
+	store_header h = { STORE_MAGIC, 0 };
+	for (int i = 0; i < length; i++)
+		h.used += record_size(strlen(entries[i].path));
+	fwrite(&h, sizeof(h), 1, f);
+	for (int i = 0; i < length; i++) {
+		entry *e = &entries[i];
+		size_t len = strlen(e->path);
+		store_record r = { e->rank, e->last, len, 0 };
+		fwrite(&r, sizeof(r), 1, f);
+		fwrite(e->path, 1, len, f);
+		fwrite(zeros, 1, record_size(len) - sizeof(r) - len, f);
+	}
+	if (fclose(f) || rename(tmp, store_path)) {
+		unlink(tmp);
+		return -1;
+	}
+	/* whoever waits for the lock on the old one notices it was replaced */
+	clear_entries();
+	close(store_fd);
+	unmap_store();
+	store_fd = open(store_path, O_RDWR | O_CLOEXEC);
+	if (store_fd == -1)
+		return 0;
+	flock(store_fd, LOCK_EX);
+	if (map_store() == 0)
+		load_store(sizeof(store_header));
+	return 0;
+}
+
+/*
+ * Write out the batch of new directories, aging everything first if it
+ * is time to
+ */
+static void flush(void)
+{
+	int aging = total > max_total;
+	if (aging)
+		age();
+	if (store_fd == -1) {
+		pending = 0;
+		return;
+	}
+	lock_store();
+	if (store_fd == -1)
+		return;
+	if (!map || (aging && rewrite_store() == 0)) {
+		flock(store_fd, LOCK_UN);
+		return;
+	}
+	append_pending();
+	flock(store_fd, LOCK_UN);
+}
+
+/*
+ * Open the store at path, kept in memory only if it is empty or can't
+ * be opened. Ranks are aged once they add up to more than max_rank
+ */
+void frecency_init(const char *path, double max_rank)
+{
+	max_total = max_rank;
+	rehash();
+	if (!path[0])
+		return;
+	store_path = estrdup((char *) path);
+	store_fd = open(store_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (store_fd == -1)
+		return;
+	flock(store_fd, LOCK_EX);
+	if (map_store() == 0)
+		load_store(sizeof(store_header));
+	flock(store_fd, LOCK_UN);
+}
+
+void frecency_cleanup(void)
+{
+	if (pending)
+		flush();
+	unmap_store();
+	if (store_fd != -1)
+		close(store_fd);
+	store_fd = -1;
+	clear_entries();
+	free(entries);
+	free(buckets);
+	free(store_path);
+	entries = NULL;
+	buckets = NULL;
+	store_path = NULL;
+	capacity = nbuckets = 0;
+}
+
+/*
+ * Count a visit to the directory at path
+ */
+void frecency_visit(const char *path)
+{
+	if (strlen(path) >= PATH_MAX)
+		return;
+	entry *e = find(path);
+	int locked = 0;
+	if (e && e->offset && store_fd != -1) {
+		/* so that no other ccc writes the record or replaces the store
+		 * meanwhile, catching up may have reloaded e */
+		lock_store();
+		locked = store_fd != -1;
+		e = find(path);
+	}
+	if (!e) {
+		e = add(path, 0, 0, 0);
+		pending++;
+	}
+	e->last = time(NULL);
+	if (e->offset && map) {
+		/* another ccc may have been here since */
+		store_record *r = (store_record *) (map + e->offset);
+		total += r->rank - e->rank;
+		e->rank = r->rank;
+	}
+	e->rank += 1;
+	total += 1;
+	write_entry(e);
+	if (locked)
+		flock(store_fd, LOCK_UN);
+	if (pending >= BATCH || total > max_total)
+		flush();
+}
+
+static double score(const entry *e, time_t now)
+{
+	time_t age = now - e->last;
+	if (age < 60 * 60)
+		return e->rank * 4;
+	if (age < 24 * 60 * 60)
+		return e->rank * 2;
+	if (age < 7 * 24 * 60 * 60)
+		return e->rank / 2;
+	return e->rank / 4;
+}
+
+typedef struct {
+	double score;
+	int i;
+} ranked;
+
+static int best_first(const void *a, const void *b)
+{
+	double x = ((const ranked *) a)->score, y = ((const ranked *) b)->score;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * Whether the letters of word appear in order in s
+ */
+static int subsequence(const char *word, size_t wlen, const char *s, size_t n, int exact)
+{
+	size_t w = 0;
+	for (size_t i = 0; i < n && w < wlen; i++) {
+		char c = exact ? s[i] : tolower((unsigned char) s[i]);
+		if (c == word[w])
+			w++;
+	}
+	return w == wlen;
+}
+
+/*
+ * Whether path matches the words: each matches a component of its own
+ * in order, the last word the last component
+ */
+static int matches(const char *path, const char **words, const size_t *lens, int n, int exact)
+{
+	const char *base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	if (!subsequence(words[n - 1], lens[n - 1], base, strlen(base), exact))
+		return 0;
+	int w = 0;
+	const char *p = path;
+	while (w < n - 1 && p < base) {
+		size_t clen = strchr(p, '/') - p;
+		if (subsequence(words[w], lens[w], p, clen, exact))
+			w++;
+		p += clen + 1;
+	}
+	return w == n - 1;
+}
+
+/*
+ * Find the best ranked directory other than exclude matching the words
+ * of query, ignoring case unless it has capitals, and copy it to path.
+ * Directories that are gone are passed over and left to be forgotten.
+ * Returns nonzero if none matches
+ */
+int frecency_query(const char *query, const char *exclude, char *path)
+{
+	char buf[strlen(query) + 1];
+	int exact = 0;
+	for (size_t i = 0; i <= strlen(query); i++) {
+		buf[i] = query[i];
+		if (isupper((unsigned char) buf[i]))
+			exact = 1;
+	}
+	if (!exact) {
+		for (char *c = buf; *c; c++)
+			*c = tolower((unsigned char) *c);
+	}
+	const char *words[MAX_WORDS];
+	size_t lens[MAX_WORDS];
+	int n = 0;
+	for (char *w = strtok(buf, " \t"); w && n < MAX_WORDS; w = strtok(NULL, " \t")) {
+		words[n] = w;
+		lens[n++] = strlen(w);
+	}
+	if (!n)
+		return -1;
+
+	ranked *r = memalloc((length + 1) * sizeof(ranked));
+	time_t now = time(NULL);
+	int found = 0;
+	for (int i = 0; i < length; i++) {
+		entry *e = &entries[i];
+		if (e->rank <= 0 || (exclude && !strcmp(e->path, exclude))
+				|| !matches(e->path, words, lens, n, exact))
+			continue;
+		r[found].score = score(e, now);
+		r[found++].i = i;
+	}
+	qsort(r, found, sizeof(ranked), best_first);
+	for (int i = 0; i < found; i++) {
+		entry *e = &entries[r[i].i];
+		struct stat st;
+		if (stat(e->path, &st) == 0 && S_ISDIR(st.st_mode)) {
+			strcpy(path, e->path);
+			free(r);
+			return 0;
+		}
+		total -= e->rank;
+		e->rank = 0;
+		write_entry(e);
+	}
+	free(r);
+	return -1;
+}
+
+/*
+ * Copy the directories best ranked first to paths, returns how many
+ */
+int frecency_list(char ***paths)
+{
+	ranked *r = memalloc((length + 1) * sizeof(ranked));
+	time_t now = time(NULL);
+	int n = 0;
+	for (int i = 0; i < length; i++) {
+		if (entries[i].rank > 0) {
+			r[n].score = score(&entries[i], now);
+			r[n++].i = i;
+		}
+	}
+	qsort(r, n, sizeof(ranked), best_first);
+	*paths = memalloc((n + 1) * sizeof(char *));
+	for (int i = 0; i < n; i++)
+		(*paths)[i] = estrdup(entries[r[i].i].path);
+	free(r);
+	return n;
+}
+
+void frecency_list_free(char **paths, int n)
+{
+	for (int i = 0; i < n; i++)
+		free(paths[i]);
+	free(paths);
+}
@@ -0,0 +1,11 @@
+#ifndef FRECENCY_H_
+#define FRECENCY_H_
+
+void frecency_init(const char *path, double max_rank);
+void frecency_cleanup(void);
+void frecency_visit(const char *path);
+int frecency_query(const char *query, const char *exclude, char *path);
+int frecency_list(char ***paths);
+void frecency_list_free(char **paths, int n);
+
+#endif
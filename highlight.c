@@ -0,0 +1,474 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "highlight.h"
+#include "icons.h"
+#include "util.h"
+
+#define TAB_WIDTH 4
+#define WORD_MAX 32 /* longer words can't be keywords */
+
+/* SGR parameters of each kind of token */
+#define HL_COMMENT "90"
+#define HL_KEYWORD "33"
+#define HL_TYPE "36"
+#define HL_STRING "32"
+#define HL_NUMBER "35"
+#define HL_PREPROC "35"
+#define HL_VARIABLE "36"
+#define HL_KEY "34"
+#define HL_HEADING "1;34"
+#define HL_BOLD "1"
+#define HL_ITALIC "3"
+#define HL_CODE "32"
+#define HL_LINK "4;36"
+#define HL_MARKER "33"
+
+/* Syntax flags */
+enum {
+	HL_NUMBERS = 1 << 0, /* highlight numbers */
+	HL_PREPROC_LINE = 1 << 1, /* line starting with # is a directive */
+	HL_VARS = 1 << 2, /* $name and ${name} are variables */
+	HL_KEYS = 1 << 3, /* string followed by : is a key */
+	HL_LINE_KEYS = 1 << 4, /* line starting with "name: " is a key */
+	HL_WORD_COMMENT = 1 << 5, /* comment only starts at the beginning of a word */
+	HL_DECORATORS = 1 << 6, /* @name is a decorator */
+};
+
+/* Character classes */
+enum {
+	CL_WORD_START = 1 << 0,
+	CL_WORD = 1 << 1,
+	CL_DIGIT = 1 << 2,
+	CL_SPACE = 1 << 3,
+};
+
+typedef struct {
+	const char *line_comment;
+	const char *block_open;
+	const char *block_close;
+	const char *block_color;
+	const char *quotes;
+	const char **keywords; /* sorted for bsearch */
+	size_t nkeywords;
+	const char **types; /* sorted for bsearch */
+	size_t ntypes;
+	int flags;
+} syntax;
+
+static const char *c_keywords[] = {
+	"NULL", "auto", "break", "case", "class", "const", "continue",
+	"default", "delete", "do", "else", "enum", "extern", "false", "for",
+	"goto", "if", "inline", "namespace", "new", "nullptr", "operator",
+	"private", "protected", "public", "register", "restrict", "return",
+	"sizeof", "static", "struct", "switch", "template", "this", "true",
+	"typedef", "typename", "union", "using", "virtual", "volatile",
+	"while"
+};
+
+static const char *c_types[] = {
+	"FILE", "bool", "char", "double", "float", "int", "int16_t",
+	"int32_t", "int64_t", "int8_t", "intptr_t", "long", "off_t", "pid_t",
+	"short", "signed", "size_t", "ssize_t", "uint16_t", "uint32_t",
+	"uint64_t", "uint8_t", "uintptr_t", "unsigned", "void"
+};
+
+static const char *sh_keywords[] = {
+	"alias", "break", "case", "continue", "declare", "do", "done", "elif",
+	"else", "esac", "eval", "exec", "exit", "export", "fi", "for",
+	"function", "if", "in", "local", "readonly", "return", "select",
+	"set", "shift", "source", "then", "time", "trap", "unset", "until",
+	"while"
+};
+
+static const char *py_keywords[] = {
+	"False", "None", "True", "and", "as", "assert", "async", "await",
+	"break", "case", "class", "continue", "def", "del", "elif", "else",
+	"except", "finally", "for", "from", "global", "if", "import", "in",
+	"is", "lambda", "match", "nonlocal", "not", "or", "pass", "raise",
+	"return", "self", "try", "while", "with", "yield"
+};
+
+static const char *py_types[] = {
+	"Exception", "bool", "bytes", "dict", "float", "int", "isinstance",
+	"len", "list", "object", "open", "print", "range", "set", "str",
+	"super", "tuple", "type"
+};
+
+static const char *json_keywords[] = {
+	"false", "null", "true"
+};
+
+static const char *yaml_keywords[] = {
+	"FALSE", "False", "NO", "NULL", "No", "Null", "OFF", "ON", "Off",
+	"On", "TRUE", "True", "YES", "Yes", "false", "no", "null", "off",
+	"on", "true", "yes"
+};
+
+/* Indexed by enum langs, Markdown is handled by markdown_line() */
+static const syntax syntaxes[] = {
+	[LANG_NONE] = { NULL },
+	[LANG_C] = { "//", "/*", "*/", HL_COMMENT, "\"'",
+		c_keywords, LEN(c_keywords), c_types, LEN(c_types),
+		HL_NUMBERS | HL_PREPROC_LINE },
+	[LANG_SH] = { "#", NULL, NULL, NULL, "\"'`",
+		sh_keywords, LEN(sh_keywords), NULL, 0,
+		HL_NUMBERS | HL_VARS | HL_WORD_COMMENT },
+	[LANG_PY] = { "#", "\"\"\"", "\"\"\"", HL_STRING, "\"'",
+		py_keywords, LEN(py_keywords), py_types, LEN(py_types),
+		HL_NUMBERS | HL_DECORATORS },
+	[LANG_JSON] = { NULL, NULL, NULL, NULL, "\"",
+		json_keywords, LEN(json_keywords), NULL, 0,
+		HL_NUMBERS | HL_KEYS },
+	[LANG_MD] = { NULL },
+	[LANG_YAML] = { "#", NULL, NULL, NULL, "\"'",
+		yaml_keywords, LEN(yaml_keywords), NULL, 0,
+		HL_NUMBERS | HL_KEYS | HL_LINE_KEYS | HL_WORD_COMMENT },
+};
+
+static unsigned char cls[256];
+
+/*
+ * Fill the character class table, must be called before any worker runs
+ */
+void highlight_init(void)
+{
+	for (int c = 0; c < 256; c++) {
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+			cls[c] |= CL_WORD_START | CL_WORD;
+		if (c >= '0' && c <= '9')
+			cls[c] |= CL_DIGIT | CL_WORD;
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f')
+			cls[c] |= CL_SPACE;
+	}
+}
+
+/*
+ * Language of a file, looked up the same way as its icon
+ */
+int highlight_lang(const char *path)
+{
+	const char *name = strrchr(path, '/');
+	const icon *ic = icon_search(name ? name + 1 : path);
+	return ic ? ic->lang : LANG_NONE;
+}
+
+static void put(hl_buf *out, const char *s, size_t n)
+{
+	if (out->length + n + 1 > out->capacity) {
+		out->capacity = (out->length + n + 1) * 2;
+		out->s = rememalloc(out->s, out->capacity);
+	}
+	memcpy(out->s + out->length, s, n);
+	out->length += n;
+	out->s[out->length] = '\0';
+}
+
+/*
+ * Copy text to the output, expanding tabs and making control characters
+ * visible so file content can't move the cursor around
+ */
+static void put_text(hl_buf *out, const char *s, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		unsigned char c = s[i];
+		if (c == '\t') {
+			do {
+				put(out, " ", 1);
+			} while (++out->col % TAB_WIDTH);
+		} else if (c < 0x20 || c == 0x7f) {
+			char caret[2] = { '^', c ^ 0x40 };
+			put(out, caret, 2);
+			out->col += 2;
+		} else {
+			put(out, (char *) &c, 1);
+			/* UTF-8 continuation bytes don't take a column */
+			if ((c & 0xC0) != 0x80)
+				out->col++;
+		}
+	}
+}
+
+static void put_token(hl_buf *out, const char *color, const char *s, size_t n)
+{
+	put(out, "\033[", 2);
+	put(out, color, strlen(color));
+	put(out, "m", 1);
+	put_text(out, s, n);
+	put(out, "\033[0m", 4);
+}
+
+static int word_cmp(const void *a, const void *b)
+{
+	return strcmp(a, *(const char **) b);
+}
+
+static int in_list(const char **list, size_t n, const char *s, size_t len)
+{
+	if (!list || len >= WORD_MAX)
+		return 0;
+	char word[WORD_MAX];
+	memcpy(word, s, len);
+	word[len] = '\0';
+	return bsearch(word, list, n, sizeof(char *), word_cmp) != NULL;
+}
+
+static int starts_with(const char *s, size_t len, const char *prefix)
+{
+	size_t n = strlen(prefix);
+	return n <= len && !memcmp(s, prefix, n);
+}
+
+/*
+ * Find needle in the first len bytes of s, returns len if not found
+ */
+static size_t find(const char *s, size_t len, const char *needle)
+{
+	size_t n = strlen(needle);
+	for (size_t i = 0; i + n <= len; i++) {
+		if (!memcmp(s + i, needle, n))
+			return i;
+	}
+	return len;
+}
+
+/*
+ * Is the first non space byte at i a colon
+ */
+static int colon_follows(const char *s, size_t len, size_t i)
+{
+	while (i < len && (cls[(unsigned char) s[i]] & CL_SPACE))
+		i++;
+	return i < len && s[i] == ':';
+}
+
+/*
+ * Length of a quoted string starting at s, up to the end of the line
+ * if it isn't closed
+ */
+static size_t string_len(const char *s, size_t len)
+{
+	size_t i = 1;
+	while (i < len && s[i] != s[0]) {
+		if (s[i] == '\\' && i + 1 < len)
+			i++;
+		i++;
+	}
+	return i < len ? i + 1 : len;
+}
+
+static void markdown_inline(hl_buf *out, const char *s, size_t len)
+{
+	size_t i = 0, plain = 0;
+	while (i < len) {
+		size_t n = 0;
+		const char *color = NULL;
+		if (s[i] == '`') {
+			n = find(s + i + 1, len - i - 1, "`");
+			if (n < len - i - 1) {
+				n += 2;
+				color = HL_CODE;
+			}
+		} else if (starts_with(s + i, len - i, "**") || starts_with(s + i, len - i, "__")) {
+			char close[3] = { s[i], s[i], '\0' };
+			n = find(s + i + 2, len - i - 2, close);
+			if (n > 0 && n < len - i - 2) {
+				n += 4;
+				color = HL_BOLD;
+			}
+		} else if ((s[i] == '*' || s[i] == '_') && i + 1 < len && !(cls[(unsigned char) s[i + 1]] & CL_SPACE)) {
+			char close[2] = { s[i], '\0' };
+			n = find(s + i + 1, len - i - 1, close);
+			if (n > 0 && n < len - i - 1) {
+				n += 2;
+				color = HL_ITALIC;
+			}
+		} else if (s[i] == '[') {
+			size_t text = find(s + i, len - i, "](");
+			if (text < len - i) {
+				size_t url = find(s + i + text, len - i - text, ")");
+				if (url < len - i - text) {
+					n = text + url + 1;
+					color = HL_LINK;
+				}
+			}
+		}
+		if (!color) {
+			i++;
+			continue;
+		}
+		put_text(out, s + plain, i - plain);
+		put_token(out, color, s + i, n);
+		i += n;
+		plain = i;
+	}
+	put_text(out, s + plain, len - plain);
+}
+
+static void markdown_line(hl_state *st, const char *s, size_t len, hl_buf *out)
+{
+	size_t i = 0;
+	while (i < len && i < 3 && s[i] == ' ')
+		i++;
+
+	if (starts_with(s + i, len - i, "```") || starts_with(s + i, len - i, "~~~")) {
+		st->in_block = !st->in_block;
+		put_token(out, HL_CODE, s, len);
+		return;
+	}
+	if (st->in_block || (len >= 4 && !memcmp(s, "    ", 4))) {
+		put_token(out, HL_CODE, s, len);
+		return;
+	}
+	if (i < len && s[i] == '#') {
+		put_token(out, HL_HEADING, s, len);
+		return;
+	}
+	if (i < len && s[i] == '>') {
+		put_token(out, HL_COMMENT, s, len);
+		return;
+	}
+
+	/* list markers: -, *, + or a number followed by . or ) */
+	size_t marker = i;
+	if (i < len && (s[i] == '-' || s[i] == '*' || s[i] == '+')) {
+		marker = i + 1;
+	} else {
+		while (marker < len && (cls[(unsigned char) s[marker]] & CL_DIGIT))
+			marker++;
+		if (marker > i && marker < len && (s[marker] == '.' || s[marker] == ')'))
+			marker++;
+		else
+			marker = i;
+	}
+	if (marker > i && marker < len && s[marker] == ' ') {
+		put_text(out, s, i);
+		put_token(out, HL_MARKER, s + i, marker - i);
+		i = marker;
+	} else {
+		put_text(out, s, i);
+	}
+	markdown_inline(out, s + i, len - i);
+}
+
+/*
+ * Highlight one line of a file, appending it to out with SGR sequences
+ * st carries multiline constructs over to the next line
+ */
+void highlight_line(hl_state *st, const char *s, size_t len, hl_buf *out)
+{
+	out->col = 0;
+	if (st->lang == LANG_MD) {
+		markdown_line(st, s, len, out);
+		return;
+	}
+	const syntax *syn = &syntaxes[st->lang];
+	if (!syn->quotes) {
+		put_text(out, s, len);
+		return;
+	}
+
+	size_t i = 0, plain = 0;
+	if (syn->flags & HL_LINE_KEYS) {
+		while (i < len && (cls[(unsigned char) s[i]] & CL_SPACE))
+			i++;
+		if (starts_with(s + i, len - i, "- "))
+			i += 2;
+		size_t n = i;
+		while (n < len && s[n] != '#' && !strchr(syn->quotes, s[n])
+				&& !(s[n] == ':' && (n + 1 == len || (cls[(unsigned char) s[n + 1]] & CL_SPACE))))
+			n++;
+		if (n > i && n < len && s[n] == ':') {
+			put_text(out, s, i);
+			put_token(out, HL_KEY, s + i, n - i);
+			i = plain = n;
+		}
+	}
+	if (syn->flags & HL_PREPROC_LINE) {
+		while (i < len && (cls[(unsigned char) s[i]] & CL_SPACE))
+			i++;
+		if (i < len && s[i] == '#' && !st->in_block) {
+			put_token(out, HL_PREPROC, s, len);
+			return;
+		}
+		i = 0;
+	}
+
+	while (i < len) {
+		unsigned char c = s[i];
+		size_t n = 0;
+		const char *color = NULL;
+
+		if (st->in_block) {
+			n = find(s + i, len - i, syn->block_close);
+			if (n < len - i) {
+				n += strlen(syn->block_close);
+				st->in_block = 0;
+			}
+			color = syn->block_color;
+		} else if (syn->block_open && starts_with(s + i, len - i, syn->block_open)) {
+			size_t open = strlen(syn->block_open);
+			n = find(s + i + open, len - i - open, syn->block_close);
+			if (n < len - i - open) {
+				n += open + strlen(syn->block_close);
+			} else {
+				n = len - i;
+				st->in_block = 1;
+			}
+			color = syn->block_color;
+		} else if (syn->line_comment && starts_with(s + i, len - i, syn->line_comment)
+				&& (!(syn->flags & HL_WORD_COMMENT) || i == 0
+				|| (cls[(unsigned char) s[i - 1]] & CL_SPACE))) {
+			n = len - i;
+			color = HL_COMMENT;
+		} else if (strchr(syn->quotes, c) && c) {
+			n = string_len(s + i, len - i);
+			color = (syn->flags & HL_KEYS) && colon_follows(s, len, i + n) ? HL_KEY : HL_STRING;
+		} else if ((syn->flags & HL_VARS) && c == '$' && i + 1 < len) {
+			if (s[i + 1] == '{') {
+				n = find(s + i, len - i, "}");
+				n = n < len - i ? n + 1 : len - i;
+			} else {
+				n = 1;
+				while (i + n < len && (cls[(unsigned char) s[i + n]] & CL_WORD))
+					n++;
+				if (n == 1 && i + 1 < len && strchr("#?@*!$0123456789-", s[i + 1]))
+					n = 2;
+			}
+			if (n > 1)
+				color = HL_VARIABLE;
+		} else if ((syn->flags & HL_DECORATORS) && c == '@' && i + 1 < len
+				&& (cls[(unsigned char) s[i + 1]] & CL_WORD_START)) {
+			n = 1;
+			while (i + n < len && (cls[(unsigned char) s[i + n]] & CL_WORD || s[i + n] == '.'))
+				n++;
+			color = HL_PREPROC;
+		} else if ((cls[c] & CL_DIGIT) && (syn->flags & HL_NUMBERS)
+				&& (i == 0 || !(cls[(unsigned char) s[i - 1]] & CL_WORD))) {
+			while (i + n < len && ((cls[(unsigned char) s[i + n]] & CL_WORD) || s[i + n] == '.'))
+				n++;
+			color = HL_NUMBER;
+		} else if (cls[c] & CL_WORD_START) {
+			while (i + n < len && (cls[(unsigned char) s[i + n]] & CL_WORD))
+				n++;
+			if (in_list(syn->keywords, syn->nkeywords, s + i, n))
+				color = HL_KEYWORD;
+			else if (in_list(syn->types, syn->ntypes, s + i, n))
+				color = HL_TYPE;
+			else {
+				i += n;
+				continue;
+			}
+		}
+
+		if (!color) {
+			i += n ? n : 1;
+			continue;
+		}
+		put_text(out, s + plain, i - plain);
+		put_token(out, color, s + i, n);
+		i += n;
+		plain = i;
+	}
+	put_text(out, s + plain, len - plain);
+}
@@ -0,0 +1,24 @@
+#ifndef HIGHLIGHT_H_
+#define HIGHLIGHT_H_
+
+#include <stddef.h>
+
+/* Highlighter state carried from one line to the next */
+typedef struct {
+	int lang;
+	int in_block; /* inside a block comment, multiline string or code fence */
+} hl_state;
+
+/* Growable output of the highlighter */
+typedef struct {
+	char *s;
+	size_t length;
+	size_t capacity;
+	int col; /* visible column, to expand tabs */
+} hl_buf;
+
+void highlight_init(void);
+int highlight_lang(const char *path);
+void highlight_line(hl_state *st, const char *line, size_t len, hl_buf *out);
+
+#endif
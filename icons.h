@@ -1,19 +1,42 @@
 #ifndef ICONS_H_
 #define ICONS_H_
 
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #define MAX_NAME 30
-#define TABLE_SIZE 100
+
+/* Languages known by the built-in preview highlighter */
+enum langs {
+    LANG_NONE,
+    LANG_C,
+    LANG_SH,
+    LANG_PY,
+    LANG_JSON,
+    LANG_MD,
+    LANG_YAML
+};
 
 typedef struct {
     char name[MAX_NAME];
-    char *icon;
+    const char *icon;
+    int lang;
 } icon;
 
-unsigned int hash(char *name);
-void hashtable_init(void);
-void hashtable_print(void);
-int hashtable_add(icon *p);
-icon *hashtable_search(char *name);
-void hashtable_free(void);
+/* Hashes the first n bytes of name ignoring case, shared with
+ * tools/mkicons which picks the seed making it perfect for icons.def */
+static inline uint64_t icon_hash(const char *name, size_t n, uint64_t seed)
+{
+    uint64_t h = 14695981039346656037ULL ^ seed;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ (unsigned char) tolower((unsigned char) name[i])) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+const icon *icon_search(const char *filename);
 
 #endif
@@ -0,0 +1,445 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "inflate.h"
+#include "util.h"
+
+/*
+ * Streaming DEFLATE (RFC 1951) decoder for gzip (RFC 1952) streams,
+ * reading the file as it goes and handing out data through a sink
+ * so a caller can stop as soon as it has seen enough.
+ * Huffman codes up to FAST_BITS long are decoded with one table lookup.
+ */
+
+#define FAST_BITS 9
+#define FAST_MASK ((1 << FAST_BITS) - 1)
+#define WINDOW_SIZE 32768
+#define IN_SIZE 65536
+#define OUT_SIZE 16384
+
+typedef struct {
+	uint16_t fast[1 << FAST_BITS]; /* length << FAST_BITS | symbol, 0 if longer */
+	uint16_t firstcode[16];
+	int maxcode[17]; /* shifted to 16 bits */
+	uint16_t firstsymbol[16];
+	uint8_t size[288];
+	uint16_t value[288];
+} huffman;
+
+typedef struct {
+	int fd;
+	unsigned char in[IN_SIZE];
+	size_t in_pos, in_len;
+	int eof; /* bytes past the end read as 0, too many of them is an error */
+	uint32_t bits;
+	int nbits;
+
+	unsigned char window[WINDOW_SIZE];
+	size_t wpos;
+	unsigned char out[OUT_SIZE];
+	size_t out_len;
+	inflate_sink sink;
+	void *arg;
+	int stopped;
+
+	huffman lit, dist;
+} inflater;
+
+static const uint16_t length_base[31] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0, 0
+};
+static const uint8_t length_extra[31] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0, 0, 0
+};
+static const uint16_t dist_base[32] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577, 0, 0
+};
+static const uint8_t dist_extra[32] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 0, 0
+};
+static const uint8_t clen_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static int next_byte(inflater *z)
+{
+	if (z->in_pos == z->in_len) {
+		if (z->eof)
+			return z->eof++ < 8 ? 0 : -1;
+		ssize_t n;
+		do {
+			n = read(z->fd, z->in, IN_SIZE);
+		} while (n == -1 && errno == EINTR);
+		if (n <= 0) {
+			z->eof = 1;
+			return 0;
+		}
+		z->in_pos = 0;
+		z->in_len = n;
+	}
+	return z->in[z->in_pos++];
+}
+
+static int fill_bits(inflater *z)
+{
+	while (z->nbits <= 24) {
+		int c = next_byte(z);
+		if (c < 0)
+			return -1;
+		z->bits |= (uint32_t) c << z->nbits;
+		z->nbits += 8;
+	}
+	return 0;
+}
+
+static int get_bits(inflater *z, int n)
+{
+	if (z->nbits < n && fill_bits(z))
+		return -1;
+	int v = z->bits & ((1u << n) - 1);
+	z->bits >>= n;
+	z->nbits -= n;
+	return v;
+}
+
+static int reverse_bits(int v, int n)
+{
+	int r = 0;
+	while (n--) {
+		r = (r << 1) | (v & 1);
+		v >>= 1;
+	}
+	return r;
+}
+
+/*
+ * Build a canonical Huffman decoder from code lengths
+ */
+static int build_huffman(huffman *h, const uint8_t *lengths, int n)
+{
+	int count[17] = { 0 }, next_code[16];
+	memset(h->fast, 0, sizeof(h->fast));
+	for (int i = 0; i < n; i++)
+		count[lengths[i]]++;
+	count[0] = 0;
+	for (int i = 1; i < 16; i++) {
+		if (count[i] > (1 << i))
+			return -1;
+	}
+
+	int code = 0, k = 0;
+	for (int i = 1; i < 16; i++) {
+		next_code[i] = code;
+		h->firstcode[i] = code;
+		h->firstsymbol[i] = k;
+		code += count[i];
+		if (count[i] && code - 1 >= (1 << i))
+			return -1;
+		h->maxcode[i] = code << (16 - i);
+		code <<= 1;
+		k += count[i];
+	}
+	h->maxcode[16] = 0x10000;
+
+	for (int i = 0; i < n; i++) {
+		int len = lengths[i];
+		if (!len)
+			continue;
+		int c = next_code[len] - h->firstcode[len] + h->firstsymbol[len];
+		h->size[c] = len;
+		h->value[c] = i;
+		if (len <= FAST_BITS) {
+			for (int j = reverse_bits(next_code[len], len); j < (1 << FAST_BITS); j += 1 << len)
+				h->fast[j] = len << FAST_BITS | i;
+		}
+		next_code[len]++;
+	}
+	return 0;
+}
+
+static int decode(inflater *z, const huffman *h)
+{
+	if (z->nbits < 16 && fill_bits(z))
+		return -1;
+	int b = h->fast[z->bits & FAST_MASK];
+	if (b) {
+		int len = b >> FAST_BITS;
+		z->bits >>= len;
+		z->nbits -= len;
+		return b & FAST_MASK;
+	}
+
+	/* longer code, codes are stored reversed in the stream */
+	int k = reverse_bits(z->bits & 0xffff, 16);
+	int len;
+	for (len = FAST_BITS + 1; k >= h->maxcode[len]; len++)
+		;
+	if (len >= 16)
+		return -1;
+	int c = (k >> (16 - len)) - h->firstcode[len] + h->firstsymbol[len];
+	if (c >= 288 || h->size[c] != len)
+		return -1;
+	z->bits >>= len;
+	z->nbits -= len;
+	return h->value[c];
+}
+
+static int flush(inflater *z)
+{
+	if (z->out_len && z->sink(z->arg, z->out, z->out_len))
+		z->stopped = 1;
+	z->out_len = 0;
+	return z->stopped;
+}
+
+static int put_byte(inflater *z, unsigned char c)
+{
+	z->window[z->wpos++ & (WINDOW_SIZE - 1)] = c;
+	z->out[z->out_len++] = c;
+	return z->out_len == OUT_SIZE ? flush(z) : 0;
+}
+
+static int inflate_block(inflater *z)
+{
+	while (1) {
+		int sym = decode(z, &z->lit);
+		if (sym < 0)
+			return -1;
+		if (sym < 256) {
+			if (put_byte(z, sym))
+				return 1;
+			continue;
+		}
+		if (sym == 256)
+			return 0;
+
+		sym -= 257;
+		if (sym >= 29)
+			return -1;
+		int len = length_base[sym];
+		if (length_extra[sym]) {
+			int extra = get_bits(z, length_extra[sym]);
+			if (extra < 0)
+				return -1;
+			len += extra;
+		}
+		sym = decode(z, &z->dist);
+		if (sym < 0 || sym >= 30)
+			return -1;
+		int dist = dist_base[sym];
+		if (dist_extra[sym]) {
+			int extra = get_bits(z, dist_extra[sym]);
+			if (extra < 0)
+				return -1;
+			dist += extra;
+		}
+		if (dist > z->wpos)
+			return -1;
+		while (len--) {
+			if (put_byte(z, z->window[(z->wpos - dist) & (WINDOW_SIZE - 1)]))
+				return 1;
+		}
+	}
+}
+
+static int stored_block(inflater *z)
+{
+	/* skip to byte boundary */
+	get_bits(z, z->nbits & 7);
+	int len = get_bits(z, 16);
+	int nlen = get_bits(z, 16);
+	if (len < 0 || nlen < 0 || len != (~nlen & 0xffff))
+		return -1;
+	while (len--) {
+		int c = z->nbits ? get_bits(z, 8) : next_byte(z);
+		if (c < 0)
+			return -1;
+		if (put_byte(z, c))
+			return 1;
+	}
+	return 0;
+}
+
+static int fixed_codes(inflater *z)
+{
+	uint8_t lengths[288 + 32];
+	int i = 0;
+	for (; i < 144; i++) lengths[i] = 8;
+	for (; i < 256; i++) lengths[i] = 9;
+	for (; i < 280; i++) lengths[i] = 7;
+	for (; i < 288; i++) lengths[i] = 8;
+	for (; i < 288 + 32; i++) lengths[i] = 5;
+	if (build_huffman(&z->lit, lengths, 288))
+		return -1;
+	return build_huffman(&z->dist, lengths + 288, 32);
+}
+
+static int dynamic_codes(inflater *z)
+{
+	int hlit = get_bits(z, 5) + 257;
+	int hdist = get_bits(z, 5) + 1;
+	int hclen = get_bits(z, 4) + 4;
+	if (hlit > 286 || hdist > 30)
+		return -1;
+
+	uint8_t clens[19] = { 0 };
+	for (int i = 0; i < hclen; i++) {
+		int v = get_bits(z, 3);
+		if (v < 0)
+			return -1;
+		clens[clen_order[i]] = v;
+	}
+	huffman clen;
+	if (build_huffman(&clen, clens, 19))
+		return -1;
+
+	uint8_t lengths[286 + 30];
+	int n = 0;
+	while (n < hlit + hdist) {
+		int c = decode(z, &clen);
+		int repeat, fill = 0;
+		if (c < 0)
+			return -1;
+		if (c < 16) {
+			lengths[n++] = c;
+			continue;
+		} else if (c == 16) {
+			if (n == 0)
+				return -1;
+			repeat = 3 + get_bits(z, 2);
+			fill = lengths[n - 1];
+		} else if (c == 17) {
+			repeat = 3 + get_bits(z, 3);
+		} else {
+			repeat = 11 + get_bits(z, 7);
+		}
+		if (repeat < 3 || n + repeat > hlit + hdist)
+			return -1;
+		memset(lengths + n, fill, repeat);
+		n += repeat;
+	}
+	if (build_huffman(&z->lit, lengths, hlit))
+		return -1;
+	return build_huffman(&z->dist, lengths + hlit, hdist);
+}
+
+/*
+ * Inflate one raw DEFLATE stream
+ * Returns 0 at its end, 1 if the sink stopped it and -1 if it is corrupt
+ */
+static int inflate_stream(inflater *z)
+{
+	int final;
+	do {
+		final = get_bits(z, 1);
+		int type = get_bits(z, 2);
+		int ret;
+		if (final < 0 || type < 0)
+			return -1;
+		if (type == 0) {
+			ret = stored_block(z);
+		} else if (type == 3) {
+			return -1;
+		} else {
+			if ((type == 1 ? fixed_codes(z) : dynamic_codes(z)))
+				return -1;
+			ret = inflate_block(z);
+		}
+		if (ret)
+			return ret;
+	} while (!final);
+	return flush(z);
+}
+
+/* Reads a byte of the gzip header or trailer, those are byte aligned */
+static int header_byte(inflater *z)
+{
+	if (z->nbits >= 8)
+		return get_bits(z, 8);
+	z->bits = z->nbits = 0;
+	return z->eof ? -1 : next_byte(z);
+}
+
+static int gzip_header(inflater *z)
+{
+	int id1 = header_byte(z), id2 = header_byte(z);
+	int method = header_byte(z), flags = header_byte(z);
+	if (id1 != 0x1f || id2 != 0x8b || method != 8)
+		return -1;
+	for (int i = 0; i < 6; i++) /* mtime, xfl, os */
+		header_byte(z);
+	if (flags & 4) { /* FEXTRA */
+		int xlen = header_byte(z);
+		xlen |= header_byte(z) << 8;
+		while (xlen-- > 0)
+			header_byte(z);
+	}
+	for (int field = 8; field <= 16; field <<= 1) { /* FNAME, FCOMMENT */
+		if (flags & field) {
+			int c;
+			while ((c = header_byte(z)) > 0)
+				;
+		}
+	}
+	if (flags & 2) { /* FHCRC */
+		header_byte(z);
+		header_byte(z);
+	}
+	return z->eof ? -1 : 0;
+}
+
+static int at_end(inflater *z)
+{
+	if (z->nbits >= 8 || z->in_pos < z->in_len)
+		return 0;
+	if (z->eof)
+		return 1;
+	next_byte(z);
+	if (z->eof)
+		return 1;
+	z->in_pos--;
+	return 0;
+}
+
+/*
+ * Inflate the gzip file fd, concatenated members included, into sink
+ * Returns 0 at the end of the file, 1 if the sink stopped it
+ * and -1 if it isn't a valid gzip file
+ */
+int inflate_gzip(int fd, inflate_sink sink, void *arg)
+{
+	/* too big for the stack of a worker */
+	inflater *z = memalloc(sizeof(inflater));
+	z->fd = fd;
+	z->in_pos = z->in_len = 0;
+	z->eof = 0;
+	z->bits = z->nbits = 0;
+	z->wpos = z->out_len = 0;
+	z->stopped = 0;
+	z->sink = sink;
+	z->arg = arg;
+
+	int ret = gzip_header(z);
+	while (!ret) {
+		ret = inflate_stream(z);
+		if (ret)
+			break;
+		/* drop the rest of the last byte, then crc32 and size */
+		get_bits(z, z->nbits & 7);
+		for (int i = 0; i < 8; i++)
+			header_byte(z);
+		/* another member may follow, anything else ends the stream */
+		if (at_end(z) || gzip_header(z))
+			break;
+	}
+	free(z);
+	return ret;
+}
@@ -0,0 +1,11 @@
+#ifndef INFLATE_H_
+#define INFLATE_H_
+
+#include <stddef.h>
+
+/* Gets every chunk of inflated data, returns nonzero to stop inflating */
+typedef int (*inflate_sink)(void *arg, const unsigned char *data, size_t len);
+
+int inflate_gzip(int fd, inflate_sink sink, void *arg);
+
+#endif
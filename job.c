@@ -0,0 +1,812 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "copy.h"
+#include "job.h"
+#include "remove.h"
+#include "trash.h"
+#include "util.h"
+
+/*
+ * Copying, moving, trashing and deleting of marked files, and restoring and
+ * purging the trash, run here, one job at a time on a thread of their own
+ * so browsing goes on meanwhile. The UI is woken through a pipe to redraw
+ * progress, at most every NOTIFY_INTERVAL.
+ */
+
+#define NOTIFY_INTERVAL 0.2 /* seconds between progress wakeups */
+#define JOB_NICE 10 /* jobs yield the CPU to the UI */
+/* ... and the disk, best effort class at its lowest priority */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_BE_LOWEST (2 << 13 | 7)
+
+typedef struct job {
+	int id;
+	int type;
+	int state;
+	char **paths;
+	int npaths;
+	char *dest; /* directory they go to */
+	char label[128];
+	long files, files_total;
+	off_t bytes, bytes_total;
+	double started; /* when it started running */
+	double paused_for; /* seconds spent paused */
+	double paused_at;
+	int error;
+	int pause, cancel; /* asked by the UI */
+	struct job *next;
+} job;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t runner;
+static int started = 0;
+static int quitting = 0;
+static job *jobs = NULL; /* oldest first */
+static int next_id = 1;
+static int copy_workers = 1;
+static int remove_workers = 1;
+static int notify[2] = { -1, -1 }; /* runner -> UI wakeup */
+static double last_notify = 0;
+static int finished = 0; /* a job finished since job_collect() */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Wake the UI up, called with lock held
+ */
+static void wake(int force)
+{
+	double t = now();
+	if (!force && t - last_notify < NOTIFY_INTERVAL)
+		return;
+	last_notify = t;
+	char c = 0;
+	write(notify[1], &c, 1);
+}
+
+/*
+ * Wait while j is paused
+ * Returns nonzero if it has been cancelled, called with lock held
+ */
+static int hold(job *j)
+{
+	while (j->pause && !j->cancel && !quitting)
+		pthread_cond_wait(&cond, &lock);
+	return j->cancel || quitting;
+}
+
+/*
+ * Progress of a copy, called from its workers
+ */
+static int copy_progress_cb(void *arg, long files, off_t bytes)
+{
+	job *j = arg;
+	pthread_mutex_lock(&lock);
+	j->files += files;
+	j->bytes += bytes;
+	wake(0);
+	int stop = hold(j);
+	pthread_mutex_unlock(&lock);
+	return stop;
+}
+
+/*
+ * Progress of a removal, called from its workers
+ */
+static int remove_progress_cb(void *arg, long files)
+{
+	return copy_progress_cb(arg, files, 0);
+}
+
+static int stopped(job *j)
+{
+	pthread_mutex_lock(&lock);
+	int stop = hold(j);
+	pthread_mutex_unlock(&lock);
+	return stop;
+}
+
+static void fail(job *j, int err)
+{
+	pthread_mutex_lock(&lock);
+	if (!j->error)
+		j->error = err;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Count the files and bytes under path so progress has a total
+ */
+static void measure(job *j, const char *path, long *files, off_t *bytes)
+{
+	struct stat st;
+	if (lstat(path, &st) == -1)
+		return;
+	if (!S_ISDIR(st.st_mode)) {
+		if (S_ISREG(st.st_mode)) {
+			(*files)++;
+			*bytes += st.st_size;
+		}
+		return;
+	}
+	DIR *dp = opendir(path);
+	if (!dp)
+		return;
+	struct dirent *ep;
+	while ((ep = readdir(dp)) && !stopped(j)) {
+		const char *name = ep->d_name;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+			continue;
+		char child[PATH_MAX];
+		if (snprintf(child, PATH_MAX, "%s/%s", path, name) < PATH_MAX)
+			measure(j, child, files, bytes);
+	}
+	closedir(dp);
+}
+
+/*
+ * Where path goes in directory dest
+ */
+static void dest_path(const job *j, const char *path, char *out)
+{
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	snprintf(out, PATH_MAX, "%s/%s", j->dest, name);
+}
+
+static void run_copy(job *j)
+{
+	long files = 0;
+	off_t bytes = 0;
+	for (int i = 0; i < j->npaths; i++) {
+		struct stat st;
+		/* the top is followed like copy_tree() does */
+		if (stat(j->paths[i], &st) == 0 && S_ISREG(st.st_mode)) {
+			files++;
+			bytes += st.st_size;
+		} else {
+			measure(j, j->paths[i], &files, &bytes);
+		}
+	}
+	pthread_mutex_lock(&lock);
+	j->files_total = files;
+	j->bytes_total = bytes;
+	wake(1);
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < j->npaths && !stopped(j); i++) {
+		char dest[PATH_MAX];
+		dest_path(j, j->paths[i], dest);
+		if (copy_tree(j->paths[i], dest, copy_workers, copy_progress_cb, j) && errno != ECANCELED)
+			fail(j, errno);
+	}
+}
+
+/*
+ * Check that dest holds everything src does with the same types and
+ * sizes, a cheap guard against a short copy rather than a verification
+ */
+static int same_tree(const char *src, const char *dest)
+{
+	struct stat a, b;
+	if (lstat(src, &a) == -1 || lstat(dest, &b) == -1)
+		return 0;
+	if ((a.st_mode & S_IFMT) != (b.st_mode & S_IFMT))
+		return 0;
+	if (!S_ISDIR(a.st_mode))
+		return !S_ISREG(a.st_mode) || a.st_size == b.st_size;
+
+	DIR *dp = opendir(src);
+	if (!dp)
+		return 0;
+	int same = 1;
+	struct dirent *ep;
+	while (same && (ep = readdir(dp))) {
+		const char *name = ep->d_name;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+			continue;
+		char child_src[PATH_MAX], child_dest[PATH_MAX];
+		snprintf(child_src, PATH_MAX, "%s/%s", src, name);
+		snprintf(child_dest, PATH_MAX, "%s/%s", dest, name);
+		same = same_tree(child_src, child_dest);
+	}
+	closedir(dp);
+	return same;
+}
+
+/*
+ * Move src to another filesystem: copy it, check the copy and only
+ * then remove the source. A copy that fails is removed again unless
+ * dest was there before. Accounts for the files and bytes it copies
+ */
+static int move_across(job *j, const char *src, const char *dest)
+{
+	struct stat st;
+	if (lstat(src, &st) == -1)
+		return -1;
+	long files = 0;
+	off_t bytes = 0;
+	measure(j, src, &files, &bytes);
+	pthread_mutex_lock(&lock);
+	/* it was counted as one file already */
+	j->files_total += (files ? files : 1) - 1;
+	j->bytes_total += bytes;
+	wake(1);
+	pthread_mutex_unlock(&lock);
+
+	struct stat dest_st;
+	int existed = lstat(dest, &dest_st) == 0;
+	/* symlinks are moved as they are, not what they point to */
+	int ret;
+	if (S_ISLNK(st.st_mode)) {
+		char target[PATH_MAX];
+		ssize_t len = readlink(src, target, sizeof(target) - 1);
+		if (len == -1)
+			return -1;
+		target[len] = '\0';
+		ret = symlink(target, dest);
+	} else {
+		ret = copy_tree(src, dest, copy_workers, copy_progress_cb, j);
+	}
+	if (!ret && !same_tree(src, dest)) {
+		errno = EIO;
+		ret = -1;
+	}
+	if (ret) {
+		int err = errno;
+		if (!existed)
+			remove_tree(dest, remove_workers, NULL, NULL);
+		errno = err;
+		return -1;
+	}
+	if (!files) {
+		pthread_mutex_lock(&lock);
+		j->files++;
+		pthread_mutex_unlock(&lock);
+	}
+	return remove_tree(src, remove_workers, NULL, NULL) ? -1 : 0;
+}
+
+/*
+ * Move src to dest, across filesystems if it has to
+ * Returns nonzero with errno set on failure
+ */
+static int move_one(job *j, const char *src, const char *dest)
+{
+	if (rename(src, dest) == 0) {
+		pthread_mutex_lock(&lock);
+		j->files++;
+		wake(0);
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	if (errno != EXDEV)
+		return -1;
+	return move_across(j, src, dest);
+}
+
+/*
+ * Move paths one rename at a time, copying what has to cross filesystems
+ */
+static void run_move(job *j)
+{
+	pthread_mutex_lock(&lock);
+	j->files_total = j->npaths;
+	j->bytes_total = 0;
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < j->npaths && !stopped(j); i++) {
+		char dest[PATH_MAX];
+		dest_path(j, j->paths[i], dest);
+		if (move_one(j, j->paths[i], dest) && errno != ECANCELED)
+			fail(j, errno);
+	}
+}
+
+/*
+ * Put paths in the trash, each recorded with where it came from
+ */
+static void run_trash(job *j)
+{
+	pthread_mutex_lock(&lock);
+	j->files_total = j->npaths;
+	j->bytes_total = 0;
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < j->npaths && !stopped(j); i++) {
+		char name[NAME_MAX + 1], dest[PATH_MAX];
+		if (trash_reserve(j->paths[i], name)) {
+			fail(j, errno);
+			continue;
+		}
+		snprintf(dest, PATH_MAX, "%s/%s", trash_files(), name);
+		if (move_one(j, j->paths[i], dest)) {
+			if (errno != ECANCELED)
+				fail(j, errno);
+			trash_abort(name);
+			continue;
+		}
+		/* sized once here so the size cap never walks the trash */
+		long files = 0;
+		off_t bytes = 0;
+		measure(j, dest, &files, &bytes);
+		trash_commit(name, j->paths[i], bytes);
+	}
+}
+
+/*
+ * Put things in the trash back where they came from
+ */
+static void run_restore(job *j)
+{
+	pthread_mutex_lock(&lock);
+	j->files_total = j->npaths;
+	j->bytes_total = 0;
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < j->npaths && !stopped(j); i++) {
+		char src[PATH_MAX], dest[PATH_MAX];
+		struct stat st;
+		if (trash_origin(j->paths[i], dest)) {
+			fail(j, ENOENT);
+			continue;
+		}
+		/* never overwrite what took its place */
+		if (lstat(dest, &st) == 0) {
+			fail(j, EEXIST);
+			continue;
+		}
+		snprintf(src, PATH_MAX, "%s/%s", trash_files(), j->paths[i]);
+		if (move_one(j, src, dest)) {
+			if (errno != ECANCELED)
+				fail(j, errno);
+			continue;
+		}
+		trash_forget(j->paths[i]);
+	}
+}
+
+/*
+ * Empty the given names out of the trash, or what is past its limits
+ */
+static void run_purge(job *j)
+{
+	char **names = j->paths;
+	int n = j->npaths;
+	if (!n)
+		n = trash_select(0, &names);
+	pthread_mutex_lock(&lock);
+	j->files_total = 0;
+	j->bytes_total = 0;
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < n && !stopped(j); i++) {
+		char path[PATH_MAX];
+		snprintf(path, PATH_MAX, "%s/%s", trash_files(), names[i]);
+		if (remove_tree(path, remove_workers, remove_progress_cb, j) && errno != ENOENT) {
+			if (errno != ECANCELED)
+				fail(j, errno);
+			continue;
+		}
+		trash_forget(names[i]);
+	}
+	if (names != j->paths) {
+		for (int i = 0; i < n; i++)
+			free(names[i]);
+		free(names);
+	}
+}
+
+/*
+ * Delete paths for good, how many files there are isn't known up front
+ */
+static void run_delete(job *j)
+{
+	pthread_mutex_lock(&lock);
+	j->files_total = 0;
+	j->bytes_total = 0;
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < j->npaths && !stopped(j); i++) {
+		if (remove_tree(j->paths[i], remove_workers, remove_progress_cb, j) && errno != ECANCELED)
+			fail(j, errno);
+	}
+}
+
+static void *job_runner(void *arg)
+{
+	/* copy workers started from here inherit both */
+	pid_t tid = syscall(SYS_gettid);
+	setpriority(PRIO_PROCESS, tid, JOB_NICE);
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_BE_LOWEST);
+
+	pthread_mutex_lock(&lock);
+	while (!quitting) {
+		job *j = jobs;
+		while (j && j->state != JOB_QUEUED)
+			j = j->next;
+		if (!j) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		if (j->cancel) {
+			j->state = JOB_CANCELLED;
+			continue;
+		}
+		j->state = j->pause ? JOB_PAUSED : JOB_RUNNING;
+		j->started = now();
+		if (j->pause)
+			j->paused_at = j->started;
+		wake(1);
+		pthread_mutex_unlock(&lock);
+
+		if (j->type == JOB_COPY)
+			run_copy(j);
+		else if (j->type == JOB_DELETE)
+			run_delete(j);
+		else if (j->type == JOB_TRASH)
+			run_trash(j);
+		else if (j->type == JOB_RESTORE)
+			run_restore(j);
+		else if (j->type == JOB_PURGE)
+			run_purge(j);
+		else
+			run_move(j);
+
+		pthread_mutex_lock(&lock);
+		j->state = j->cancel ? JOB_CANCELLED : j->error ? JOB_FAILED : JOB_DONE;
+		finished = 1;
+		wake(1);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/*
+ * Set up jobs, copies use copiers threads and deletes removers threads
+ */
+void job_init(int copiers, int removers)
+{
+	copy_workers = copiers;
+	remove_workers = removers;
+	if (pipe(notify) == -1)
+		die("ccc: Cannot create job pipe");
+	fcntl(notify[0], F_SETFL, O_NONBLOCK);
+	fcntl(notify[1], F_SETFL, O_NONBLOCK);
+}
+
+/*
+ * Stop every job and wait for the current one to notice
+ */
+void job_cleanup(void)
+{
+	pthread_mutex_lock(&lock);
+	quitting = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	if (started)
+		pthread_join(runner, NULL);
+	while (jobs) {
+		job *next = jobs->next;
+		for (int i = 0; i < jobs->npaths; i++)
+			free(jobs->paths[i]);
+		free(jobs->paths);
+		free(jobs->dest);
+		free(jobs);
+		jobs = next;
+	}
+	close(notify[0]);
+	close(notify[1]);
+}
+
+/*
+ * File descriptor that becomes readable when jobs made progress
+ */
+int job_fd(void)
+{
+	return notify[0];
+}
+
+/*
+ * Drain the wakeups
+ * Returns 1 if a job finished since last time so files may have changed
+ */
+int job_collect(void)
+{
+	char buf[64];
+	while (read(notify[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&lock);
+	int f = finished;
+	finished = 0;
+	pthread_mutex_unlock(&lock);
+	return f;
+}
+
+static const char *verbs[] = { "copy", "move", "trash", "delete", "restore", "purge" };
+
+/*
+ * Queue paths to be copied or moved into directory dest, or trashed,
+ * deleted, restored or purged with dest NULL
+ * Returns the id of the job
+ */
+int job_add(int type, char **paths, int n, const char *dest)
+{
+	job *j = memalloc(sizeof(job));
+	memset(j, 0, sizeof(job));
+	j->type = type;
+	j->state = JOB_QUEUED;
+	j->paths = memalloc((n ? n : 1) * sizeof(char *));
+	for (int i = 0; i < n; i++)
+		j->paths[i] = estrdup(paths[i]);
+	j->npaths = n;
+	j->dest = dest ? estrdup((char *) dest) : NULL;
+	j->files_total = -1;
+	if (n == 1) {
+		const char *name = strrchr(paths[0], '/');
+		snprintf(j->label, sizeof(j->label), "%s %s", verbs[type], name ? name + 1 : paths[0]);
+	} else if (n) {
+		snprintf(j->label, sizeof(j->label), "%s %d files", verbs[type], n);
+	} else {
+		snprintf(j->label, sizeof(j->label), "%s expired", verbs[type]);
+	}
+
+	pthread_mutex_lock(&lock);
+	j->id = next_id++;
+	job **tail = &jobs;
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = j;
+	if (!started) {
+		/* Leave signals like SIGWINCH to the UI thread */
+		sigset_t all, old;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		if (pthread_create(&runner, NULL, job_runner, NULL))
+			die("ccc: Cannot create job thread");
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		started = 1;
+	}
+	pthread_cond_broadcast(&cond);
+	wake(1);
+	pthread_mutex_unlock(&lock);
+	return j->id;
+}
+
+/*
+ * Fill out with up to max jobs, newest first
+ * Returns how many were filled
+ */
+int job_list(job_info *out, int max)
+{
+	int n = 0;
+	double t = now();
+	pthread_mutex_lock(&lock);
+	for (job *j = jobs; j; j = j->next)
+		n++;
+	int skip = n > max ? n - max : 0;
+	n = 0;
+	for (job *j = jobs; j; j = j->next) {
+		if (skip) {
+			skip--;
+			continue;
+		}
+		job_info *ji = &out[n++];
+		ji->id = j->id;
+		ji->type = j->type;
+		ji->state = j->state;
+		memcpy(ji->label, j->label, sizeof(ji->label));
+		ji->files = j->files;
+		ji->files_total = j->files_total;
+		ji->bytes = j->bytes;
+		ji->bytes_total = j->bytes_total;
+		ji->error = j->error;
+
+		double paused = j->paused_for + (j->state == JOB_PAUSED ? t - j->paused_at : 0);
+		double elapsed = t - j->started - paused;
+		ji->rate = j->state == JOB_RUNNING && elapsed > 0 ? j->bytes / elapsed : 0;
+		ji->file_rate = j->state == JOB_RUNNING && elapsed > 0 ? j->files / elapsed : 0;
+		ji->eta = -1;
+		if (ji->rate > 0 && j->bytes_total > 0)
+			ji->eta = (j->bytes_total - j->bytes) / ji->rate;
+	}
+	pthread_mutex_unlock(&lock);
+
+	/* newest first */
+	for (int i = 0; i < n / 2; i++) {
+		job_info tmp = out[i];
+		out[i] = out[n - 1 - i];
+		out[n - 1 - i] = tmp;
+	}
+	return n;
+}
+
+/*
+ * Number of jobs not finished yet
+ */
+int job_running(void)
+{
+	int n = 0;
+	pthread_mutex_lock(&lock);
+	for (job *j = jobs; j; j = j->next)
+		n += j->state <= JOB_PAUSED;
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+static void human_size(double bytes, char *buf, size_t len)
+{
+	static const char *units[] = { "B", "K", "M", "G", "T", "P" };
+	int unit = 0;
+	while (bytes > 1024 && unit < (int) LEN(units) - 1) {
+		bytes /= 1024;
+		unit++;
+	}
+	if (bytes == (long) bytes)
+		snprintf(buf, len, "%ld%s", (long) bytes, units[unit]);
+	else
+		snprintf(buf, len, "%.1f%s", bytes, units[unit]);
+}
+
+/*
+ * Append to the l bytes in buf, returns the new length, cut to fit
+ */
+static size_t append(char *buf, size_t len, size_t l, const char *fmt, ...)
+{
+	if (l + 1 >= len)
+		return l;
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf + l, len - l, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return l;
+	return l + n < len ? l + n : len - 1;
+}
+
+/*
+ * Short summary of the jobs for the status line, empty if there are none
+ */
+void job_status(char *buf, size_t len)
+{
+	job_info list[64];
+	int n = job_list(list, LEN(list));
+	int active = 0, failed = 0;
+	job_info *cur = NULL;
+	for (int i = n - 1; i >= 0; i--) {
+		if (list[i].state <= JOB_PAUSED) {
+			active++;
+			if (!cur || (cur->state == JOB_QUEUED && list[i].state != JOB_QUEUED))
+				cur = &list[i];
+		}
+		failed += list[i].state == JOB_FAILED;
+	}
+	buf[0] = '\0';
+	size_t l = 0;
+	if (cur) {
+		const char *verb = verbs[cur->type];
+		if (cur->state == JOB_QUEUED) {
+			l = append(buf, len, l, "[%s queued", verb);
+		} else if (cur->files_total < 0) {
+			l = append(buf, len, l, "[%s counting", verb);
+		} else if (cur->bytes_total > 0) {
+			char done[16], total[16], rate[16];
+			human_size(cur->bytes, done, sizeof(done));
+			human_size(cur->bytes_total, total, sizeof(total));
+			human_size(cur->rate, rate, sizeof(rate));
+			l = append(buf, len, l, "[%s %d%% %s/%s", verb,
+					(int) (100 * cur->bytes / cur->bytes_total), done, total);
+			if (cur->state == JOB_RUNNING)
+				l = append(buf, len, l, " %s/s", rate);
+			if (cur->eta >= 0)
+				l = append(buf, len, l, " %ld:%02ld", cur->eta / 60, cur->eta % 60);
+		} else if (cur->type == JOB_DELETE || cur->type == JOB_PURGE) {
+			l = append(buf, len, l, "[%s %ld files", verb, cur->files);
+			if (cur->state == JOB_RUNNING)
+				l = append(buf, len, l, " %.0f/s", cur->file_rate);
+		} else {
+			l = append(buf, len, l, "[%s %ld/%ld", verb, cur->files, cur->files_total);
+		}
+		if (cur->state == JOB_PAUSED)
+			l = append(buf, len, l, " paused");
+		if (active > 1)
+			l = append(buf, len, l, " +%d", active - 1);
+		l = append(buf, len, l, "]");
+	}
+	if (failed)
+		append(buf, len, l, "%s[%d failed]", l ? " " : "", failed);
+}
+
+static job *find(int id)
+{
+	for (job *j = jobs; j; j = j->next) {
+		if (j->id == id)
+			return j;
+	}
+	return NULL;
+}
+
+/*
+ * Pause job id, or resume it if paused
+ */
+void job_pause(int id)
+{
+	pthread_mutex_lock(&lock);
+	job *j = find(id);
+	if (j && j->state <= JOB_PAUSED) {
+		j->pause = !j->pause;
+		if (j->state != JOB_QUEUED) {
+			double t = now();
+			if (j->pause) {
+				j->state = JOB_PAUSED;
+				j->paused_at = t;
+			} else {
+				j->state = JOB_RUNNING;
+				j->paused_for += t - j->paused_at;
+			}
+		}
+		pthread_cond_broadcast(&cond);
+		wake(1);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Stop job id as soon as possible, or drop it if it is still queued
+ */
+void job_cancel(int id)
+{
+	pthread_mutex_lock(&lock);
+	job *j = find(id);
+	if (j && j->state <= JOB_PAUSED) {
+		j->cancel = 1;
+		if (j->state == JOB_QUEUED)
+			j->state = JOB_CANCELLED;
+		pthread_cond_broadcast(&cond);
+		wake(1);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Forget finished jobs
+ */
+void job_clear(void)
+{
+	pthread_mutex_lock(&lock);
+	job **jp = &jobs;
+	while (*jp) {
+		job *j = *jp;
+		if (j->state > JOB_PAUSED) {
+			*jp = j->next;
+			for (int i = 0; i < j->npaths; i++)
+				free(j->paths[i]);
+			free(j->paths);
+			free(j->dest);
+			free(j);
+		} else {
+			jp = &j->next;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,51 @@
+#ifndef JOB_H_
+#define JOB_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+enum job_types {
+	JOB_COPY,
+	JOB_MOVE,
+	JOB_TRASH,
+	JOB_DELETE,
+	JOB_RESTORE, /* paths are names in the trash */
+	JOB_PURGE /* paths are names in the trash, none for what expired */
+};
+
+enum job_states {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_PAUSED,
+	JOB_DONE,
+	JOB_FAILED,
+	JOB_CANCELLED
+};
+
+/* Snapshot of a job for showing it */
+typedef struct {
+	int id;
+	int type;
+	int state;
+	char label[128];
+	long files, files_total; /* done and to do, total is -1 while counting */
+	off_t bytes, bytes_total;
+	double rate; /* bytes a second */
+	double file_rate; /* files a second */
+	long eta; /* seconds left, -1 if unknown */
+	int error; /* errno of the first failure */
+} job_info;
+
+void job_init(int copiers, int removers);
+void job_cleanup(void);
+int job_fd(void);
+int job_collect(void);
+int job_add(int type, char **paths, int n, const char *dest);
+int job_list(job_info *out, int max);
+int job_running(void);
+void job_status(char *buf, size_t len);
+void job_pause(int id);
+void job_cancel(int id);
+void job_clear(void);
+
+#endif
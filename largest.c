@@ -0,0 +1,326 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "largest.h"
+#include "util.h"
+
+/*
+ * Finds the k largest files under a directory. A few threads take
+ * directories off a shared stack, reading them and pushing what is
+ * below, and files are offered to a min-heap of the k largest so far.
+ * Memory stays bounded by k and the directories waiting, not by how
+ * many files there are. Like du -x it stays on the filesystem it
+ * started on, a full disk being one filesystem.
+ */
+
+#define NOTIFY_INTERVAL 0.2 /* seconds between progress wakeups */
+
+/* Directory waiting to be read */
+typedef struct largest_dir {
+	char *path;
+	struct largest_dir *next;
+} largest_dir;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *threads = NULL;
+static int nthreads = 0;
+static largest_dir *stack = NULL;
+static long pending = 0; /* directories pushed and not read yet */
+static int stopped = 0;
+static int running = 0; /* threads not finished */
+static dev_t device; /* of the directory it started from */
+static largest_file *heap = NULL; /* smallest on top */
+static int heap_length = 0, heap_capacity = 0;
+static long scanned = 0;
+static int notify[2] = { -1, -1 }; /* walk -> UI wakeup */
+static double last_notify = 0;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Wake the UI up, called with lock held
+ */
+static void wake(int force)
+{
+	double t = now();
+	if (!force && t - last_notify < NOTIFY_INTERVAL)
+		return;
+	last_notify = t;
+	char c = 0;
+	write(notify[1], &c, 1);
+}
+
+/*
+ * dir/name, without doubling the slash of /
+ */
+static char *join(const char *dir, const char *name)
+{
+	size_t len = strlen(dir);
+	char *path = memalloc(len + strlen(name) + 2);
+	sprintf(path, "%s%s%s", dir, len && dir[len - 1] == '/' ? "" : "/", name);
+	return path;
+}
+
+static void sift_down(int i)
+{
+	while (1) {
+		int smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+		if (l < heap_length && heap[l].size < heap[smallest].size)
+			smallest = l;
+		if (r < heap_length && heap[r].size < heap[smallest].size)
+			smallest = r;
+		if (smallest == i)
+			return;
+		largest_file tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+/*
+ * Offer a file to the heap, called with lock held
+ * Returns the smallest size worth offering from now on
+ */
+static off_t offer(const char *dir, const char *name, off_t size)
+{
+	if (heap_length == heap_capacity && size <= heap[0].size)
+		return heap[0].size + 1;
+	char *path = join(dir, name);
+	if (heap_length < heap_capacity) {
+		/* sift up */
+		int i = heap_length++;
+		while (i && heap[(i - 1) / 2].size > size) {
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i].path = path;
+		heap[i].size = size;
+	} else {
+		free(heap[0].path);
+		heap[0].path = path;
+		heap[0].size = size;
+		sift_down(0);
+	}
+	return heap_length == heap_capacity ? heap[0].size + 1 : 0;
+}
+
+static void push(char *path)
+{
+	largest_dir *d = memalloc(sizeof(largest_dir));
+	d->path = path;
+	pthread_mutex_lock(&lock);
+	d->next = stack;
+	stack = d;
+	pending++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Offer the files of a directory and push its subdirectories
+ */
+static void scan(const char *path, off_t *threshold)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR *dp = fd == -1 ? NULL : fdopendir(fd);
+	if (!dp) {
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	long files = 0;
+	struct dirent *ep;
+	while ((ep = readdir(dp))) {
+		const char *name = ep->d_name;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+			continue;
+		/* symlinks and the like are neither big nor a way down */
+		if (ep->d_type != DT_UNKNOWN && ep->d_type != DT_DIR && ep->d_type != DT_REG)
+			continue;
+		struct stat st;
+		if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		if (S_ISDIR(st.st_mode) && st.st_dev == device) {
+			push(join(path, name));
+		} else if (S_ISREG(st.st_mode)) {
+			files++;
+			/* most files are too small to bother taking the lock */
+			if (st.st_size >= *threshold) {
+				pthread_mutex_lock(&lock);
+				*threshold = offer(path, name, st.st_size);
+				pthread_mutex_unlock(&lock);
+			}
+		}
+	}
+	closedir(dp);
+
+	pthread_mutex_lock(&lock);
+	scanned += files;
+	/* the threshold only goes up, catch up with the other threads */
+	if (heap_length == heap_capacity && heap[0].size + 1 > *threshold)
+		*threshold = heap[0].size + 1;
+	wake(0);
+	pthread_mutex_unlock(&lock);
+}
+
+static void *largest_worker(void *arg)
+{
+	off_t threshold = 0;
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (!stack && pending && !stopped)
+			pthread_cond_wait(&cond, &lock);
+		if (stopped || !stack)
+			break;
+		largest_dir *d = stack;
+		stack = d->next;
+		pthread_mutex_unlock(&lock);
+
+		scan(d->path, &threshold);
+		free(d->path);
+		free(d);
+
+		pthread_mutex_lock(&lock);
+		if (--pending == 0)
+			pthread_cond_broadcast(&cond);
+	}
+	if (--running == 0)
+		wake(1);
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+void largest_init(void)
+{
+	if (pipe(notify) == -1)
+		die("ccc: Cannot create largest pipe");
+	fcntl(notify[0], F_SETFL, O_NONBLOCK);
+	fcntl(notify[1], F_SETFL, O_NONBLOCK);
+}
+
+void largest_cleanup(void)
+{
+	largest_stop();
+	close(notify[0]);
+	close(notify[1]);
+}
+
+/*
+ * File descriptor that becomes readable when there is news
+ */
+int largest_fd(void)
+{
+	return notify[0];
+}
+
+/*
+ * Start looking for the k largest files under root with workers threads,
+ * dropping any earlier search
+ */
+void largest_start(const char *root, int k, int workers)
+{
+	largest_stop();
+	struct stat st;
+	if (stat(root, &st) == -1)
+		return;
+	device = st.st_dev;
+	heap_capacity = k > 0 ? k : 1;
+	heap = memalloc(heap_capacity * sizeof(largest_file));
+	heap_length = 0;
+	scanned = 0;
+	stopped = 0;
+	push(estrdup((char *) root));
+
+	nthreads = running = workers > 0 ? workers : 1;
+	threads = memalloc(nthreads * sizeof(pthread_t));
+	/* Leave signals like SIGWINCH to the UI thread */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, largest_worker, NULL))
+			die("ccc: Cannot create largest thread");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Stop searching and forget what was found
+ */
+void largest_stop(void)
+{
+	if (!threads)
+		return;
+	pthread_mutex_lock(&lock);
+	stopped = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	threads = NULL;
+	while (stack) {
+		largest_dir *next = stack->next;
+		free(stack->path);
+		free(stack);
+		stack = next;
+	}
+	pending = 0;
+	for (int i = 0; i < heap_length; i++)
+		free(heap[i].path);
+	free(heap);
+	heap = NULL;
+	heap_length = heap_capacity = 0;
+}
+
+static int largest_first(const void *a, const void *b)
+{
+	const largest_file *x = a, *y = b;
+	return (y->size > x->size) - (y->size < x->size);
+}
+
+/*
+ * The largest files found so far, largest first, how many files were
+ * looked at and whether it is still going
+ * Returns how many there are, free them with largest_free()
+ */
+int largest_collect(largest_file **list, long *files, int *going)
+{
+	char buf[64];
+	while (read(notify[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&lock);
+	int n = heap_length;
+	largest_file *out = memalloc((n + 1) * sizeof(largest_file));
+	for (int i = 0; i < n; i++) {
+		out[i].path = estrdup(heap[i].path);
+		out[i].size = heap[i].size;
+	}
+	*files = scanned;
+	*going = threads && running;
+	pthread_mutex_unlock(&lock);
+	qsort(out, n, sizeof(largest_file), largest_first);
+	*list = out;
+	return n;
+}
+
+void largest_free(largest_file *list, int n)
+{
+	for (int i = 0; i < n; i++)
+		free(list[i].path);
+	free(list);
+}
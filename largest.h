@@ -0,0 +1,19 @@
+#ifndef LARGEST_H_
+#define LARGEST_H_
+
+#include <sys/types.h>
+
+typedef struct {
+	char *path;
+	off_t size;
+} largest_file;
+
+void largest_init(void);
+void largest_cleanup(void);
+int largest_fd(void);
+void largest_start(const char *root, int k, int workers);
+void largest_stop(void);
+int largest_collect(largest_file **list, long *scanned, int *running);
+void largest_free(largest_file *list, int n);
+
+#endif
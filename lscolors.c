@@ -0,0 +1,302 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "lscolors.h"
+#include "util.h"
+
+/*
+ * LS_COLORS, and icons given the same way, compiled once into a trie of
+ * reversed name suffixes: classifying a file is a look at its type and
+ * one backward walk over its name, however many rules there are.
+ *
+ * Entries are key=value separated by colons. Keys are two letter file
+ * types (di, ex, ...) or *suffix, which covers extensions with several
+ * dots (*.tar.gz) and whole names (*README) as well. The longest suffix
+ * wins and case is ignored. Like ls, suffixes are only looked at for
+ * regular files that aren't colored as executable, setuid or setgid.
+ */
+
+/* Type keys, they are the first rules */
+enum {
+	KEY_NO, KEY_FI, KEY_DI, KEY_LN, KEY_PI, KEY_SO, KEY_BD, KEY_CD,
+	KEY_EX, KEY_SU, KEY_SG, KEY_TW, KEY_OW, KEY_ST, KEYS,
+	KEY_NAME = -1, /* rule of the name's suffix */
+};
+
+static const char type_keys[KEYS][3] = {
+	"no", "fi", "di", "ln", "pi", "so", "bd", "cd",
+	"ex", "su", "sg", "tw", "ow", "st",
+};
+
+typedef struct {
+	int color; /* -1 if none */
+	char *icon;
+} rule;
+
+/* Trie being built, children are linked through siblings */
+typedef struct {
+	int rule; /* -1 if no suffix ends here */
+	int child, sibling;
+	unsigned char c;
+} build_node;
+
+/* Compiled trie, the children of a node are next to each other */
+typedef struct {
+	int rule;
+	int first, count;
+	unsigned char c;
+} node;
+
+static rule *rules = NULL;
+static int nrules = 0;
+static char **sgrs = NULL; /* color LSCOLOR_BASE + i is sgrs[i] */
+static int nsgrs = 0;
+static build_node *building = NULL;
+static int nbuilding = 0;
+static node *trie = NULL;
+
+static int add_rule(void)
+{
+	if (nrules % 64 == 0)
+		rules = rememalloc(rules, (nrules + 64) * sizeof(rule));
+	rules[nrules].color = -1;
+	rules[nrules].icon = NULL;
+	return nrules++;
+}
+
+static int add_build_node(unsigned char c)
+{
+	if (nbuilding % 256 == 0)
+		building = rememalloc(building, (nbuilding + 256) * sizeof(build_node));
+	building[nbuilding] = (build_node) { -1, -1, -1, c };
+	return nbuilding++;
+}
+
+/*
+ * Rule of suffix, put in the trie last character first if it isn't there
+ */
+static int suffix_rule(const char *suffix)
+{
+	int n = 0;
+	for (const char *c = suffix + strlen(suffix); c > suffix; ) {
+		unsigned char ch = tolower((unsigned char) *--c);
+		int child = building[n].child;
+		while (child != -1 && building[child].c != ch)
+			child = building[child].sibling;
+		if (child == -1) {
+			child = add_build_node(ch);
+			building[child].sibling = building[n].child;
+			building[n].child = child;
+		}
+		n = child;
+	}
+	if (building[n].rule == -1)
+		building[n].rule = add_rule();
+	return building[n].rule;
+}
+
+/*
+ * Rule of key, -1 for the keys of ls not about files (lc, rs, ...)
+ */
+static int key_rule(const char *key)
+{
+	if (key[0] == '*')
+		return key[1] ? suffix_rule(key + 1) : -1;
+	for (int i = 0; i < KEYS; i++) {
+		if (!strcmp(key, type_keys[i]))
+			return i;
+	}
+	return -1;
+}
+
+/* SGR parameters only, anything else could mess up the terminal */
+static int valid_sgr(const char *value)
+{
+	if (!*value || strlen(value) > LSCOLOR_MAX)
+		return 0;
+	for (const char *c = value; *c; c++) {
+		if (!isdigit((unsigned char) *c) && *c != ';')
+			return 0;
+	}
+	return 1;
+}
+
+static int add_sgr(const char *value)
+{
+	for (int i = 0; i < nsgrs; i++) {
+		if (!strcmp(sgrs[i], value))
+			return LSCOLOR_BASE + i;
+	}
+	sgrs = rememalloc(sgrs, (nsgrs + 1) * sizeof(char *));
+	sgrs[nsgrs] = estrdup((char *) value);
+	return LSCOLOR_BASE + nsgrs++;
+}
+
+/*
+ * Read the entries of spec into the rules, their values are colors or
+ * icons. Later entries win over earlier ones with the same key.
+ */
+static void parse(const char *spec, int icons)
+{
+	char *copy = estrdup((char *) spec);
+	for (char *entry = copy, *next; entry; entry = next) {
+		next = strchr(entry, ':');
+		if (next)
+			*next++ = '\0';
+		char *value = strchr(entry, '=');
+		if (!value || value == entry)
+			continue;
+		*value++ = '\0';
+		int r = key_rule(entry);
+		if (r == -1)
+			continue;
+		if (!icons && valid_sgr(value)) {
+			rules[r].color = add_sgr(value);
+		} else if (icons && *value && strlen(value) <= LSICON_MAX) {
+			free(rules[r].icon);
+			rules[r].icon = estrdup((char *) value);
+		}
+	}
+	free(copy);
+}
+
+/*
+ * Lay the built trie out breadth first so that the children of every
+ * node are together
+ */
+static void compile(void)
+{
+	trie = memalloc(nbuilding * sizeof(node));
+	int *from = memalloc(nbuilding * sizeof(int));
+	trie[0] = (node) { building[0].rule, 0, 0, 0 };
+	from[0] = 0;
+	int length = 1;
+	for (int i = 0; i < length; i++) {
+		trie[i].first = length;
+		for (int c = building[from[i]].child; c != -1; c = building[c].sibling) {
+			trie[length] = (node) { building[c].rule, 0, 0, building[c].c };
+			from[length++] = c;
+			trie[i].count++;
+		}
+	}
+	free(from);
+	free(building);
+	building = NULL;
+	nbuilding = 0;
+}
+
+/*
+ * Compile the rules of colors, in the format of LS_COLORS, and icons, in
+ * the same format with icons for values. Either may be NULL.
+ */
+void lscolors_init(const char *colors, const char *icons)
+{
+	for (int i = 0; i < KEYS; i++)
+		add_rule();
+	add_build_node(0);
+	if (colors)
+		parse(colors, 0);
+	if (icons)
+		parse(icons, 1);
+	compile();
+}
+
+void lscolors_cleanup(void)
+{
+	for (int i = 0; i < nrules; i++)
+		free(rules[i].icon);
+	for (int i = 0; i < nsgrs; i++)
+		free(sgrs[i]);
+	free(rules);
+	free(sgrs);
+	free(trie);
+	rules = NULL;
+	sgrs = NULL;
+	trie = NULL;
+	nrules = nsgrs = 0;
+}
+
+/*
+ * Rule of the longest suffix of name in the trie, -1 if none
+ */
+static int name_rule(const char *name)
+{
+	int best = -1, n = 0;
+	for (const char *c = name + strlen(name); c > name && trie[n].count; ) {
+		unsigned char ch = tolower((unsigned char) *--c);
+		const node *child = &trie[trie[n].first], *end = child + trie[n].count;
+		while (child < end && child->c != ch)
+			child++;
+		if (child == end)
+			break;
+		n = child - trie;
+		if (trie[n].rule != -1)
+			best = trie[n].rule;
+	}
+	return best;
+}
+
+/*
+ * Classify a file by its name and mode.
+ * Returns its color, -1 if no rule gives it one, and sets icon, if not
+ * NULL, to its icon or NULL
+ */
+int lscolors_match(const char *name, mode_t mode, const char **icon)
+{
+	if (icon)
+		*icon = NULL;
+	if (!trie)
+		return -1;
+
+	/* keys in the order they are tried, the first with a value wins */
+	int keys[6], n = 0;
+	if (S_ISREG(mode)) {
+		if (mode & S_ISUID)
+			keys[n++] = KEY_SU;
+		if (mode & S_ISGID)
+			keys[n++] = KEY_SG;
+		if (mode & (S_IXUSR | S_IXGRP | S_IXOTH))
+			keys[n++] = KEY_EX;
+		keys[n++] = KEY_NAME;
+		keys[n++] = KEY_FI;
+	} else if (S_ISDIR(mode)) {
+		if ((mode & S_ISVTX) && (mode & S_IWOTH))
+			keys[n++] = KEY_TW;
+		if (mode & S_IWOTH)
+			keys[n++] = KEY_OW;
+		if (mode & S_ISVTX)
+			keys[n++] = KEY_ST;
+		keys[n++] = KEY_DI;
+	} else {
+		keys[n++] = S_ISLNK(mode) ? KEY_LN : S_ISFIFO(mode) ? KEY_PI
+			: S_ISSOCK(mode) ? KEY_SO : S_ISBLK(mode) ? KEY_BD : KEY_CD;
+	}
+	keys[n++] = KEY_NO;
+
+	int color = -1;
+	for (int i = 0; i < n && (color == -1 || (icon && !*icon)); i++) {
+		int r = keys[i] == KEY_NAME ? name_rule(name) : keys[i];
+		if (r == -1)
+			continue;
+		if (color == -1)
+			color = rules[r].color;
+		if (icon && !*icon)
+			*icon = rules[r].icon;
+	}
+	return color;
+}
+
+/*
+ * SGR parameters of a color from LS_COLORS, NULL for a plain SGR code
+ */
+const char *lscolors_sgr(int color)
+{
+	if (color < LSCOLOR_BASE)
+		return NULL;
+	/* colors left by a run with other LS_COLORS */
+	if (color - LSCOLOR_BASE >= nsgrs)
+		return "0";
+	return sgrs[color - LSCOLOR_BASE];
+}
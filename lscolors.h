@@ -0,0 +1,20 @@
+#ifndef LSCOLORS_H_
+#define LSCOLORS_H_
+
+#include <sys/types.h>
+
+/* Colors from this one on are entries of LS_COLORS rather than SGR codes */
+#define LSCOLOR_BASE 1000
+
+/* Longest SGR parameters taken, previews leave room for that much */
+#define LSCOLOR_MAX 24
+
+/* Longest icon taken, it has to fit in a file's icon */
+#define LSICON_MAX 7
+
+void lscolors_init(const char *colors, const char *icons);
+void lscolors_cleanup(void);
+int lscolors_match(const char *name, mode_t mode, const char **icon);
+const char *lscolors_sgr(int color);
+
+#endif
@@ -0,0 +1,125 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "util.h"
+
+/*
+ * Fixed set of threads working through a bounded queue of items.
+ * Submitting blocks while the queue is full so a fast producer, like a
+ * directory walker, never gets far ahead of the workers.
+ */
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full, idle;
+	void **items; /* ring of queued items */
+	int capacity, head, count;
+	int busy; /* items taken but not done yet */
+	int quitting;
+	pthread_t *threads;
+	int nthreads;
+	pool_fn fn;
+	void *arg;
+};
+
+static void *pool_worker(void *data)
+{
+	pool *p = data;
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		while (!p->count && !p->quitting)
+			pthread_cond_wait(&p->not_empty, &p->lock);
+		if (!p->count)
+			break;
+		void *item = p->items[p->head];
+		p->head = (p->head + 1) % p->capacity;
+		p->count--;
+		p->busy++;
+		pthread_cond_signal(&p->not_full);
+		pthread_mutex_unlock(&p->lock);
+
+		p->fn(p->arg, item);
+
+		pthread_mutex_lock(&p->lock);
+		if (--p->busy == 0 && !p->count)
+			pthread_cond_broadcast(&p->idle);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/*
+ * Start workers threads calling fn on items, at most capacity of them queued
+ */
+pool *pool_new(int workers, int capacity, pool_fn fn, void *arg)
+{
+	pool *p = memalloc(sizeof(pool));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->not_empty, NULL);
+	pthread_cond_init(&p->not_full, NULL);
+	pthread_cond_init(&p->idle, NULL);
+	p->capacity = capacity > 0 ? capacity : 1;
+	p->items = memalloc(p->capacity * sizeof(void *));
+	p->head = p->count = p->busy = p->quitting = 0;
+	p->nthreads = workers > 0 ? workers : 1;
+	p->threads = memalloc(p->nthreads * sizeof(pthread_t));
+	p->fn = fn;
+	p->arg = arg;
+
+	/* Leave signals like SIGWINCH to the UI thread */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (int i = 0; i < p->nthreads; i++) {
+		if (pthread_create(&p->threads[i], NULL, pool_worker, p))
+			die("ccc: Cannot create worker thread");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return p;
+}
+
+/*
+ * Queue an item, waiting for room if the queue is full
+ */
+void pool_submit(pool *p, void *item)
+{
+	pthread_mutex_lock(&p->lock);
+	while (p->count == p->capacity)
+		pthread_cond_wait(&p->not_full, &p->lock);
+	p->items[(p->head + p->count) % p->capacity] = item;
+	p->count++;
+	pthread_cond_signal(&p->not_empty);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Wait until every submitted item is done
+ */
+void pool_wait(pool *p)
+{
+	pthread_mutex_lock(&p->lock);
+	while (p->count || p->busy)
+		pthread_cond_wait(&p->idle, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Finish queued items and stop the workers
+ */
+void pool_free(pool *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->quitting = 1;
+	pthread_cond_broadcast(&p->not_empty);
+	pthread_mutex_unlock(&p->lock);
+	for (int i = 0; i < p->nthreads; i++)
+		pthread_join(p->threads[i], NULL);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->not_empty);
+	pthread_cond_destroy(&p->not_full);
+	pthread_cond_destroy(&p->idle);
+	free(p->items);
+	free(p->threads);
+	free(p);
+}
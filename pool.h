@@ -0,0 +1,14 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+typedef struct pool pool;
+
+/* Does one item of work, arg is the one given to pool_new() */
+typedef void (*pool_fn)(void *arg, void *item);
+
+pool *pool_new(int workers, int capacity, pool_fn fn, void *arg);
+void pool_submit(pool *p, void *item);
+void pool_wait(pool *p);
+void pool_free(pool *p);
+
+#endif
@@ -0,0 +1,1351 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "archive.h"
+#include "cache.h"
+#include "file.h"
+#include "highlight.h"
+#include "icons.h"
+#include "lscolors.h"
+#include "preview.h"
+#include "util.h"
+
+#define SGR_MAX 32 /* longest SGR sequence carried over to the next row */
+#define BINARY_CHECK_LIMIT 8192 /* only check first 8KB for NUL */
+#define HEAD_CHUNK 65536 /* bytes read at once from the head of a file */
+/* Columns of a hex dump row of n bytes: offset, hex with a gap every 8, ascii */
+#define HEX_ROW_WIDTH(n) (10 + 3 * (n) + (n) / 8 + (n))
+#define HEX_ROW_MAX 32
+
+/* A file to be previewed in a pane */
+typedef struct {
+	char *path;
+	pane pn;
+	int prefetch; /* rendered ahead of time rather than for the selection */
+	unsigned long gen; /* gen or pf_gen it was asked in */
+	struct stat st; /* file as it was when rendered, keys the cache */
+	int have_st;
+} request;
+
+/* What a worker is busy with */
+typedef struct {
+	pthread_t thread;
+	request r;
+	int busy;
+	pid_t child; /* in-flight previewer, killed when cancelled */
+} slot;
+
+/* Prefetched preview waiting to be collected into cache */
+typedef struct ready {
+	preview *p;
+	request r;
+	struct ready *next;
+} ready;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int quitting = 0;
+/*
+ * Worker 0 renders the selection, the rest only prefetch while it is idle
+ * so the selection never waits behind a neighbour
+ */
+static slot *slots = NULL;
+static int nslots = 0;
+
+static request req; /* what the UI currently wants to see */
+static int pending = 0; /* req hasn't been picked up by a worker yet */
+static int finished = 0; /* req has been rendered and collected */
+/* Bumped for every new request, work done for an older gen is thrown away */
+static unsigned long gen = 0;
+static preview *done = NULL; /* finished preview waiting to be collected */
+static request done_req;
+static preview *last = NULL; /* collected preview of req that can't be cached */
+
+/* Neighbours of the selection to render while idle */
+static char **pf_paths = NULL;
+static int pf_length = 0;
+static pane pf_pane;
+static unsigned long pf_gen = 0; /* bumped when the selection jumps away */
+static ready *pf_ready = NULL;
+
+static int notify[2] = { -1, -1 }; /* worker -> UI wakeup */
+static const char *previewer = NULL; /* external highlighter, built-in one if empty */
+static const int *type_colors = NULL; /* color of each enum ftypes */
+static char hex_pairs[256][2]; /* byte to its two hex digits */
+
+static preview *preview_new(void)
+{
+	preview *p = memalloc(sizeof(preview));
+	p->length = 0;
+	p->capacity = 16;
+	p->hex = 0;
+	p->lines = memalloc(p->capacity * sizeof(char *));
+	return p;
+}
+
+void preview_free(preview *p)
+{
+	if (!p)
+		return;
+	for (int i = 0; i < p->length; i++)
+		free(p->lines[i]);
+	free(p->lines);
+	free(p);
+}
+
+/*
+ * Append n bytes of s to a new row of the preview
+ */
+static void add_row(preview *p, const char *s, size_t n)
+{
+	if (p->length == p->capacity) {
+		p->capacity *= 2;
+		p->lines = rememalloc(p->lines, p->capacity * sizeof(char *));
+	}
+	char *line = memalloc(n + 1);
+	memcpy(line, s, n);
+	line[n] = '\0';
+	p->lines[p->length++] = line;
+}
+
+/*
+ * Split one line of previewer output into rows of width columns,
+ * keeping CSI sequences intact and counting a UTF-8 character as one column.
+ * The last seen SGR sequence is kept in current_sgr and reapplied to every
+ * new row as each row is printed on its own.
+ * Returns 1 once the preview has all the rows it needs
+ */
+static int wrap_line(preview *p, const char *buffer, size_t buflen, int rows, int width, char *current_sgr)
+{
+	if (p->length >= rows)
+		return 1;
+	if (buflen == 0 || strspn(buffer, " \t") == buflen) {
+		add_row(p, "", 0);
+		return p->length >= rows;
+	}
+
+	/* a row is at most the whole line plus the reapplied SGR */
+	char row[buflen + SGR_MAX];
+	size_t rowlen = strlen(current_sgr);
+	size_t len = 0;
+	size_t i = 0;
+	memcpy(row, current_sgr, rowlen);
+
+	while (i < buflen) {
+		unsigned char b = buffer[i];
+
+		/* CSI escape sequence: ESC '[' params... final-byte */
+		if (b == '\033' && i + 1 < buflen && buffer[i + 1] == '[') {
+			size_t start = i;
+			i += 2; /* skip ESC [ */
+			/* consume parameter/intermediate bytes: 0x20-0x3F */
+			while (i < buflen && buffer[i] >= 0x20 && buffer[i] <= 0x3F)
+				i++;
+			/* consume the final byte: 0x40-0x7E */
+			if (i < buflen && buffer[i] >= 0x40 && buffer[i] <= 0x7E) {
+				/* remember it if it's an SGR sequence (ends in 'm') */
+				if (buffer[i] == 'm') {
+					size_t seqlen = i + 1 - start;
+					if (seqlen < SGR_MAX) {
+						memcpy(current_sgr, buffer + start, seqlen);
+						current_sgr[seqlen] = '\0';
+					}
+				}
+				i++;
+			}
+			memcpy(row + rowlen, buffer + start, i - start);
+			rowlen += i - start;
+			continue; /* zero visible width, don't touch len */
+		}
+
+		/* UTF-8 multi-byte sequence: count as ONE visible column */
+		size_t charlen = 1;
+		if ((b & 0x80) == 0x00) charlen = 1;      /* ASCII */
+		else if ((b & 0xE0) == 0xC0) charlen = 2; /* 2-byte */
+		else if ((b & 0xF0) == 0xE0) charlen = 3; /* 3-byte */
+		else if ((b & 0xF8) == 0xF0) charlen = 4; /* 4-byte */
+
+		if (i + charlen > buflen) charlen = 1; /* truncated at buffer edge, don't overread */
+
+		memcpy(row + rowlen, buffer + i, charlen);
+		rowlen += charlen;
+		i += charlen;
+		len++; /* ONE visible column per codepoint, not per byte */
+
+		if (len % width == 0 && i < buflen) {
+			add_row(p, row, rowlen);
+			if (p->length >= rows)
+				return 1;
+			/* reapply active color on the next row */
+			rowlen = strlen(current_sgr);
+			memcpy(row, current_sgr, rowlen);
+		}
+	}
+	add_row(p, row, rowlen);
+	return p->length >= rows;
+}
+
+static int wanted(const request *r)
+{
+	return !quitting && r->gen == (r->prefetch ? pf_gen : gen);
+}
+
+/*
+ * Worker side check if the request it is working on is still wanted
+ */
+static int cancelled(slot *sl)
+{
+	pthread_mutex_lock(&lock);
+	int c = !wanted(&sl->r);
+	pthread_mutex_unlock(&lock);
+	return c;
+}
+
+static int same_request(const request *r, const char *path, const pane *pn)
+{
+	return r->path && !strcmp(r->path, path) && r->pn.rows == pn->rows
+		&& r->pn.width == pn->width && r->pn.flags == pn->flags && r->pn.page == pn->page;
+}
+
+/*
+ * Read the head of fd into a buffer, only as much as the window can show:
+ * reading stops after rows lines, or rows full lines of width columns of
+ * 4 byte characters. The first read is at least BINARY_CHECK_LIMIT bytes
+ * so the same buffer can be checked for being binary.
+ * Returns the number of bytes read into *data, which must be freed
+ */
+static size_t read_head(int fd, int rows, int width, char **data)
+{
+	size_t cap = (size_t) rows * (width * 4 + 1);
+	if (cap < BINARY_CHECK_LIMIT)
+		cap = BINARY_CHECK_LIMIT;
+	char *buf = memalloc(cap);
+	size_t length = 0;
+	int lines = 0;
+
+	while (length < cap && lines < rows) {
+		size_t chunk = cap - length < HEAD_CHUNK ? cap - length : HEAD_CHUNK;
+		ssize_t n = pread(fd, buf + length, chunk, length);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		for (char *nl = buf + length; (nl = memchr(nl, '\n', buf + length + n - nl)); nl++)
+			lines++;
+		length += n;
+	}
+	*data = buf;
+	return length;
+}
+
+/*
+ * Render the head of a file with the built-in highlighter
+ */
+static preview *render_builtin(slot *sl, const char *data, size_t length)
+{
+	const request *r = &sl->r;
+	preview *p = preview_new();
+	hl_state st = { highlight_lang(r->path), 0 };
+	hl_buf out = { NULL, 0, 0, 0 };
+	char sgr[SGR_MAX] = "\033[0m";
+	const char *end = data + length;
+
+	while (data < end && !cancelled(sl)) {
+		const char *nl = memchr(data, '\n', end - data);
+		size_t len = (nl ? nl : end) - data;
+		if (len && data[len - 1] == '\r')
+			len--;
+		out.length = 0;
+		highlight_line(&st, data, len, &out);
+		if (wrap_line(p, out.s, out.length, r->pn.rows, r->pn.width, sgr) || !nl)
+			break;
+		data = nl + 1;
+	}
+	free(out.s);
+	return p;
+}
+
+/*
+ * Render a file by running the external previewer over it,
+ * one row per line of output
+ */
+static preview *render_external(slot *sl)
+{
+	const request *r = &sl->r;
+	preview *p = preview_new();
+	int pipe_fd[2];
+	if (pipe(pipe_fd) == -1) {
+		preview_free(p);
+		return NULL;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		/* Child, the worker blocks signals meant for the UI */
+		sigset_t empty;
+		sigemptyset(&empty);
+		sigprocmask(SIG_SETMASK, &empty, NULL);
+		/* don't let prefetching compete with the selection */
+		if (r->prefetch)
+			nice(10);
+		close(pipe_fd[0]);
+		dup2(pipe_fd[1], STDOUT_FILENO);
+		dup2(pipe_fd[1], STDERR_FILENO);
+		close(pipe_fd[1]);
+		execlp(previewer, previewer, "-c", r->path, NULL);
+		_exit(1);
+	} else if (pid < 0) {
+		close(pipe_fd[0]);
+		close(pipe_fd[1]);
+		preview_free(p);
+		return NULL;
+	}
+
+	/* Parent, let the UI kill the child if the selection moves */
+	close(pipe_fd[1]);
+	pthread_mutex_lock(&lock);
+	sl->child = pid;
+	if (!wanted(r))
+		kill(pid, SIGTERM);
+	pthread_mutex_unlock(&lock);
+
+	char buffer[4096];
+	char sgr[SGR_MAX] = "\033[0m";
+	FILE *stream = fdopen(pipe_fd[0], "r");
+	while (!cancelled(sl) && fgets(buffer, sizeof(buffer), stream)) {
+		buffer[strcspn(buffer, "\n")] = 0;
+		if (wrap_line(p, buffer, strlen(buffer), r->pn.rows, r->pn.width, sgr))
+			break;
+	}
+	fclose(stream);
+
+	/* the pid can't be reused until it is reaped below */
+	pthread_mutex_lock(&lock);
+	sl->child = 0;
+	pthread_mutex_unlock(&lock);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return p;
+}
+
+/*
+ * Bytes shown on each row of a hex dump for a pane width
+ */
+static int hex_row_bytes(int width)
+{
+	int n = HEX_ROW_MAX;
+	while (n > 4 && HEX_ROW_WIDTH(n) > width)
+		n /= 2;
+	return n;
+}
+
+/*
+ * Number of pages of the hex dump of a size bytes file in pane pn
+ */
+long preview_pages(off_t size, const pane *pn)
+{
+	long page_bytes = (long) hex_row_bytes(pn->width) * (pn->rows > 0 ? pn->rows : 1);
+	return size ? (size + page_bytes - 1) / page_bytes : 1;
+}
+
+static void add_hex_row(preview *p, off_t offset, const unsigned char *bytes, int len, int n)
+{
+	char row[HEX_ROW_WIDTH(HEX_ROW_MAX) + 32];
+	int k = sprintf(row, "\033[90m%08llx\033[0m: ", (unsigned long long) offset);
+	for (int i = 0; i < n; i++) {
+		if (i && i % 8 == 0)
+			row[k++] = ' ';
+		if (i < len) {
+			row[k++] = hex_pairs[bytes[i]][0];
+			row[k++] = hex_pairs[bytes[i]][1];
+		} else {
+			row[k++] = ' ';
+			row[k++] = ' ';
+		}
+		row[k++] = ' ';
+	}
+	for (int i = 0; i < len; i++)
+		row[k++] = bytes[i] >= 0x20 && bytes[i] < 0x7f ? bytes[i] : '.';
+	add_row(p, row, k);
+}
+
+/*
+ * Render a page of a hex dump of a binary file, reading only the bytes
+ * shown. head holds the first length bytes which are used if they cover
+ * the page, a later page is read with pread() at its offset.
+ */
+static preview *render_hex(slot *sl, int fd, const char *head, size_t length)
+{
+	const request *r = &sl->r;
+	preview *p = preview_new();
+	p->hex = 1;
+	int n = hex_row_bytes(r->pn.width);
+	long pages = preview_pages(r->st.st_size, &r->pn);
+	long page = r->pn.page < pages ? r->pn.page : pages - 1;
+	size_t want = (size_t) n * r->pn.rows;
+	off_t offset = (off_t) page * want;
+
+	/* head + offset is only formed while it points into head */
+	const unsigned char *bytes = NULL;
+	size_t got = 0;
+	if (offset < length) {
+		bytes = (const unsigned char *) head + offset;
+		got = length - offset;
+	}
+	unsigned char *buf = NULL;
+	if (got < want && offset + got < r->st.st_size) {
+		buf = memalloc(want);
+		ssize_t nread;
+		got = 0;
+		while (got < want && ((nread = pread(fd, buf + got, want - got, offset + got)) > 0
+					|| (nread == -1 && errno == EINTR)))
+			got += nread > 0 ? nread : 0;
+		bytes = buf;
+	}
+	if (got > want)
+		got = want;
+
+	for (size_t i = 0; i < got; i += n)
+		add_hex_row(p, offset + i, bytes + i, got - i < n ? got - i : n, n);
+	free(buf);
+	return p;
+}
+
+/* Directory entry shown in a directory preview */
+typedef struct {
+	char *name;
+	int type;
+} dir_entry;
+
+static int dir_entry_compare(const void *a, const void *b)
+{
+	const dir_entry *x = a, *y = b;
+	/* directories first like the listing */
+	if ((x->type == DRY) != (y->type == DRY))
+		return x->type == DRY ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+/*
+ * Keep heap, n entries with the last one just added, a max-heap: the
+ * entry coming last in the listing on top
+ */
+static void heap_up(dir_entry *heap, int n)
+{
+	for (int i = n - 1; i > 0 && dir_entry_compare(&heap[(i - 1) / 2], &heap[i]) < 0; i = (i - 1) / 2) {
+		dir_entry t = heap[i];
+		heap[i] = heap[(i - 1) / 2];
+		heap[(i - 1) / 2] = t;
+	}
+}
+
+/* Same once the top of the heap was replaced */
+static void heap_down(dir_entry *heap, int n)
+{
+	for (int i = 0; ; ) {
+		int top = i, l = 2 * i + 1, r = l + 1;
+		if (l < n && dir_entry_compare(&heap[l], &heap[top]) > 0)
+			top = l;
+		if (r < n && dir_entry_compare(&heap[r], &heap[top]) > 0)
+			top = r;
+		if (top == i)
+			return;
+		dir_entry t = heap[i];
+		heap[i] = heap[top];
+		heap[top] = t;
+		i = top;
+	}
+}
+
+/*
+ * Print the SGR sequence coloring name, of type ftype, to row.
+ * Returns its length
+ */
+static int name_color(char *row, const char *name, int ftype, const char **icon)
+{
+	static const mode_t modes[] = {
+		[REG] = S_IFREG, [DRY] = S_IFDIR, [LNK] = S_IFLNK, [CHR] = S_IFCHR,
+		[SOC] = S_IFSOCK, [BLK] = S_IFBLK, [FIF] = S_IFIFO,
+	};
+	const char *sgr = lscolors_sgr(lscolors_match(name, modes[ftype], icon));
+	if (sgr)
+		return sprintf(row, "\033[0;%sm", sgr);
+	return sprintf(row, "\033[%dm", type_colors[ftype]);
+}
+
+static int dtype_to_ftype(unsigned char d_type)
+{
+	switch (d_type) {
+		case DT_DIR: return DRY;
+		case DT_LNK: return LNK;
+		case DT_CHR: return CHR;
+		case DT_SOCK: return SOC;
+		case DT_BLK: return BLK;
+		case DT_FIFO: return FIF;
+		default: return REG;
+	}
+}
+
+/*
+ * Copy name into row of size bytes from len on, from column col until the
+ * pane width. Returns the new length of row
+ */
+static size_t put_name(char *row, size_t len, size_t size, const char *name, int col, int width)
+{
+	/* by bytes too, a name of continuation bytes takes no columns */
+	for (const char *c = name; *c && col < width && len < size - 8; c++) {
+		/* names may hold anything but a slash */
+		row[len++] = (unsigned char) *c < 0x20 || *c == 0x7f ? '?' : *c;
+		if ((*c & 0xC0) != 0x80)
+			col++;
+	}
+	return len;
+}
+
+/*
+ * Add a row for a directory entry, cut to the pane width
+ */
+static void add_entry_row(preview *p, const dir_entry *e, const pane *pn)
+{
+	char row[pn->width * 4 + 64];
+	const char *rule_icon;
+	size_t len = name_color(row, e->name, e->type, &rule_icon);
+	int col = 0;
+	if (pn->flags & PREVIEW_ICONS) {
+		const icon *ic = e->type == DRY ? NULL : icon_search(e->name);
+		len += sprintf(row + len, "%s ", rule_icon ? rule_icon : e->type == DRY ? "󰉋"
+				: ic ? ic->icon : "");
+		col += 2;
+	}
+	len = put_name(row, len, sizeof(row), e->name, col, pn->width);
+	add_row(p, row, len);
+}
+
+/*
+ * List a directory without stat()ing its entries, types come from d_type.
+ * Only the entries that fit in the pane are kept, the first ones in the
+ * order of the listing, the rest are only counted.
+ */
+static preview *render_dir(slot *sl, int fd)
+{
+	const request *r = &sl->r;
+	preview *p = preview_new();
+	DIR *dp = fdopendir(fd);
+	if (!dp) {
+		close(fd);
+		const char msg[] = "Unable to read unknown";
+		add_row(p, msg, sizeof(msg) - 1);
+		return p;
+	}
+
+	int want = r->pn.rows;
+	dir_entry entries[want > 0 ? want : 1];
+	int n = 0;
+	long total = 0;
+	struct dirent *ep;
+	while ((ep = readdir(dp))) {
+		const char *name = ep->d_name;
+		if (name[0] == '.' && (!(r->pn.flags & PREVIEW_HIDDEN) || !name[1]
+					|| (name[1] == '.' && !name[2])))
+			continue;
+		dir_entry e = { (char *) name, dtype_to_ftype(ep->d_type) };
+		if (n < want) {
+			e.name = estrdup(e.name);
+			entries[n++] = e;
+			heap_up(entries, n);
+		} else if (want > 0 && dir_entry_compare(&e, &entries[0]) < 0) {
+			/* goes before the last one kept */
+			free(entries[0].name);
+			e.name = estrdup(e.name);
+			entries[0] = e;
+			heap_down(entries, n);
+		}
+		/* counting a huge directory can take a while */
+		if ((++total & 4095) == 0 && cancelled(sl))
+			break;
+	}
+	closedir(dp);
+
+	qsort(entries, n, sizeof(dir_entry), dir_entry_compare);
+	/* leave the last row to the count if not everything fits */
+	int shown = total > want ? want - 1 : n;
+	for (int i = 0; i < n; i++) {
+		if (i < shown)
+			add_entry_row(p, &entries[i], &r->pn);
+		free(entries[i].name);
+	}
+	if (total == 0) {
+		const char msg[] = "empty directory";
+		add_row(p, msg, sizeof(msg) - 1);
+	} else if (total > shown) {
+		char row[64];
+		int len = snprintf(row, sizeof(row), "\033[90m%ld entries\033[0m", total);
+		add_row(p, row, len);
+	}
+	return p;
+}
+
+/* State of an archive listing being rendered */
+typedef struct {
+	slot *sl;
+	preview *p;
+} archive_render;
+
+/*
+ * Add a row for an archive member: its size, then its name cut to the pane
+ */
+static int add_member_row(void *arg, const char *name, off_t size, char type)
+{
+	archive_render *ar = arg;
+	const pane *pn = &ar->sl->r.pn;
+	if (!name)
+		return cancelled(ar->sl);
+
+	static const char *units[] = { "B", "K", "M", "G", "T", "P" };
+	char sz[16] = "";
+	if (type != '5') {
+		double bytes = size;
+		int unit = 0;
+		while (bytes > 1024 && unit < (int) LEN(units) - 1) {
+			bytes /= 1024;
+			unit++;
+		}
+		if (bytes == (long) bytes)
+			snprintf(sz, sizeof(sz), "%ld%s", (long) bytes, units[unit]);
+		else
+			snprintf(sz, sizeof(sz), "%.1f%s", bytes, units[unit]);
+	}
+
+	int ftype = type == '5' ? DRY : type == '2' ? LNK : type == '3' ? CHR
+		: type == '4' ? BLK : type == '6' ? FIF : REG;
+	char row[pn->width * 4 + 64];
+	size_t len = sprintf(row, "\033[90m%7s\033[0m ", sz);
+	len += name_color(row + len, name, ftype, NULL);
+	len = put_name(row, len, sizeof(row), name, 8, pn->width);
+	add_row(ar->p, row, len);
+	return ar->p->length >= pn->rows || cancelled(ar->sl);
+}
+
+/*
+ * List the members of a tar or tar.gz without extracting it, only reading
+ * as far as the pane can show. Returns NULL if fd isn't such an archive
+ */
+static preview *render_archive(slot *sl, int fd, int type)
+{
+	archive_render ar = { sl, preview_new() };
+	int n = archive_list(fd, type, add_member_row, &ar);
+	if (n == -1) {
+		preview_free(ar.p);
+		return NULL;
+	}
+	if (n == 0) {
+		const char msg[] = "empty archive";
+		add_row(ar.p, msg, sizeof(msg) - 1);
+	}
+	return ar.p;
+}
+
+/*
+ * Open path relative to its parent directory rather than the cwd,
+ * without blocking on FIFOs
+ */
+static int open_in_parent(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	if (!slash)
+		return open(path, O_RDONLY | O_NONBLOCK);
+
+	size_t len = slash == path ? 1 : slash - path;
+	char parent[len + 1];
+	memcpy(parent, path, len);
+	parent[len] = '\0';
+	int dfd = open(parent, O_RDONLY | O_DIRECTORY);
+	if (dfd == -1)
+		return -1;
+	int fd = openat(dfd, slash + 1, O_RDONLY | O_NONBLOCK);
+	close(dfd);
+	return fd;
+}
+
+/*
+ * Render a directory listing, the members of an archive, or a file with the
+ * built-in highlighter or the external previewer e.g. vip. A file is read once, from its head only,
+ * which is enough to tell if it is binary and to fill the window.
+ */
+static preview *render_file(slot *sl)
+{
+	request *r = &sl->r;
+	preview *p = NULL;
+	int fd = open_in_parent(r->path);
+	if (fd == -1 || fstat(fd, &r->st) == -1) {
+		if (fd != -1)
+			close(fd);
+		p = preview_new();
+		const char msg[] = "Unable to read unknown";
+		add_row(p, msg, sizeof(msg) - 1);
+		return p;
+	}
+	r->have_st = 1;
+	if (S_ISDIR(r->st.st_mode))
+		return render_dir(sl, fd);
+
+	int archive = S_ISREG(r->st.st_mode) ? archive_type(r->path) : ARCHIVE_NONE;
+	if (archive != ARCHIVE_NONE && (p = render_archive(sl, fd, archive))) {
+		close(fd);
+		return p;
+	}
+
+	char *data;
+	size_t length = read_head(fd, r->pn.rows, r->pn.width, &data);
+
+	size_t check = length < BINARY_CHECK_LIMIT ? length : BINARY_CHECK_LIMIT;
+	if (memchr(data, '\0', check)) {
+		p = render_hex(sl, fd, data, length);
+	} else if (!previewer || !strcmp(previewer, "")) {
+		p = render_builtin(sl, data, length);
+	} else {
+		p = render_external(sl);
+	}
+	close(fd);
+	free(data);
+	return p;
+}
+
+/*
+ * Pick the next request for worker sl, called with lock held
+ * Returns 0 if there is nothing to do
+ */
+static int take_request(slot *sl)
+{
+	if (sl == &slots[0]) {
+		if (!pending)
+			return 0;
+		sl->r = req;
+		sl->r.path = estrdup(req.path);
+		pending = 0;
+		return 1;
+	}
+	/* only prefetch while the selection has been rendered */
+	if (pending || slots[0].busy || pf_length == 0)
+		return 0;
+	sl->r.path = pf_paths[0];
+	sl->r.pn = pf_pane;
+	sl->r.prefetch = 1;
+	sl->r.gen = pf_gen;
+	memmove(pf_paths, pf_paths + 1, --pf_length * sizeof(char *));
+	return 1;
+}
+
+static void *preview_worker(void *arg)
+{
+	slot *sl = arg;
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (!quitting && !take_request(sl))
+			pthread_cond_wait(&cond, &lock);
+		if (quitting)
+			break;
+		sl->busy = 1;
+		pthread_mutex_unlock(&lock);
+
+		sl->r.have_st = 0;
+		preview *p = render_file(sl);
+
+		pthread_mutex_lock(&lock);
+		request r = sl->r;
+		sl->r.path = NULL;
+		sl->busy = 0;
+		if (p && wanted(&r) && !r.prefetch) {
+			preview_free(done);
+			free(done_req.path);
+			done = p;
+			done_req = r;
+			write(notify[1], "", 1);
+		} else if (p && wanted(&r)) {
+			ready *rd = memalloc(sizeof(ready));
+			rd->p = p;
+			rd->r = r;
+			rd->next = pf_ready;
+			pf_ready = rd;
+			write(notify[1], "", 1);
+		} else {
+			preview_free(p);
+			free(r.path);
+		}
+		/* prefetchers wait for the selection to be done */
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/*
+ * Start the preview workers, cache_size is the memory budget in bytes
+ * for previews kept around after they're drawn, prefetchers is the
+ * number of extra workers rendering neighbours of the selection and
+ * highlighter is run as `highlighter -c file` instead of the built-in one.
+ * colors are the colors of each enum ftypes in directory previews.
+ */
+void preview_init(size_t cache_size, int prefetchers, const char *highlighter, const int *colors)
+{
+	cache_init(cache_size);
+	highlight_init();
+	previewer = highlighter;
+	type_colors = colors;
+	for (int i = 0; i < 256; i++) {
+		hex_pairs[i][0] = "0123456789abcdef"[i >> 4];
+		hex_pairs[i][1] = "0123456789abcdef"[i & 0xf];
+	}
+	if (pipe(notify) == -1)
+		die("ccc: Cannot create preview pipe");
+	fcntl(notify[0], F_SETFL, O_NONBLOCK);
+	fcntl(notify[1], F_SETFL, O_NONBLOCK);
+
+	nslots = 1 + (prefetchers > 0 ? prefetchers : 0);
+	slots = memalloc(nslots * sizeof(slot));
+	memset(slots, 0, nslots * sizeof(slot));
+
+	/* Leave signals like SIGWINCH to the UI thread */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (int i = 0; i < nslots; i++) {
+		if (pthread_create(&slots[i].thread, NULL, preview_worker, &slots[i]))
+			die("ccc: Cannot create preview thread");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void clear_prefetch(void)
+{
+	for (int i = 0; i < pf_length; i++)
+		free(pf_paths[i]);
+	pf_length = 0;
+}
+
+void preview_cleanup(void)
+{
+	pthread_mutex_lock(&lock);
+	quitting = 1;
+	for (int i = 0; i < nslots; i++) {
+		if (slots[i].child)
+			kill(slots[i].child, SIGTERM);
+	}
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	for (int i = 0; i < nslots; i++)
+		pthread_join(slots[i].thread, NULL);
+	free(slots);
+	slots = NULL;
+
+	preview_free(done);
+	done = NULL;
+	free(done_req.path);
+	preview_free(last);
+	last = NULL;
+	free(req.path);
+	req.path = NULL;
+	clear_prefetch();
+	free(pf_paths);
+	while (pf_ready) {
+		ready *next = pf_ready->next;
+		preview_free(pf_ready->p);
+		free(pf_ready->r.path);
+		free(pf_ready);
+		pf_ready = next;
+	}
+	cache_free();
+	close(notify[0]);
+	close(notify[1]);
+}
+
+/*
+ * File descriptor that becomes readable when a preview is finished
+ */
+int preview_fd(void)
+{
+	return notify[0];
+}
+
+/*
+ * Stop working on req, called with lock held
+ */
+static void drop_request(void)
+{
+	gen++;
+	pending = 0;
+	finished = 0;
+	for (int i = 0; i < nslots; i++) {
+		if (slots[i].child && !slots[i].r.prefetch)
+			kill(slots[i].child, SIGTERM);
+	}
+	free(req.path);
+	req.path = NULL;
+	preview_free(last);
+	last = NULL;
+}
+
+/*
+ * Look for a prefetcher already rendering the request, called with lock held
+ */
+static slot *find_prefetch(const char *path, const pane *pn)
+{
+	for (int i = 1; i < nslots; i++) {
+		if (slots[i].busy && wanted(&slots[i].r)
+				&& same_request(&slots[i].r, path, pn))
+			return &slots[i];
+	}
+	return NULL;
+}
+
+/*
+ * Ask for path to be previewed in pane pn
+ * Returns the preview if it is cached, otherwise NULL and the preview
+ * is rendered in background, cancelling whatever was in flight
+ */
+preview *preview_request(const char *path, const pane *pn)
+{
+	struct stat st;
+	int have_st = stat(path, &st) == 0;
+	preview *p = NULL;
+
+	pthread_mutex_lock(&lock);
+	int same = same_request(&req, path, pn);
+	if (have_st && (p = cache_get(path, &st, pn))) {
+		if (!same || !finished)
+			drop_request();
+	} else if (same && !finished) {
+		/* still in flight */
+	} else if (same && last) {
+		p = last;
+	} else {
+		drop_request();
+		req.path = estrdup((char *) path);
+		req.pn = *pn;
+		req.prefetch = 0;
+		req.gen = gen;
+		slot *sl = find_prefetch(path, pn);
+		if (sl) {
+			/* already being rendered ahead, wait for that instead */
+			sl->r.prefetch = 0;
+			sl->r.gen = gen;
+		} else {
+			pending = 1;
+			pthread_cond_broadcast(&cond);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return p;
+}
+
+/*
+ * Get the preview that finished since the last request, if it is still wanted
+ * Previews are put in cache so revisiting the file won't render it again
+ */
+preview *preview_collect(void)
+{
+	char c;
+	while (read(notify[0], &c, 1) == 1)
+		;
+
+	pthread_mutex_lock(&lock);
+	while (pf_ready) {
+		ready *rd = pf_ready;
+		pf_ready = rd->next;
+		if (rd->r.have_st)
+			cache_put(rd->r.path, &rd->r.st, &rd->r.pn, rd->p);
+		else
+			preview_free(rd->p);
+		free(rd->r.path);
+		free(rd);
+	}
+
+	preview *p = done;
+	request r = done_req;
+	done = NULL;
+	done_req.path = NULL;
+	if (p && r.gen == gen) {
+		finished = 1;
+		if (r.have_st) {
+			cache_put(r.path, &r.st, &r.pn, p);
+		} else {
+			preview_free(last);
+			last = p;
+		}
+	} else {
+		preview_free(p);
+		p = NULL;
+	}
+	pthread_mutex_unlock(&lock);
+	free(r.path);
+	return p;
+}
+
+/*
+ * Drop the in-flight preview, e.g. when there is nothing selected anymore
+ */
+void preview_cancel(void)
+{
+	pthread_mutex_lock(&lock);
+	drop_request();
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Queue paths to be rendered ahead in pane pn,
+ * replacing what was queued before. Files already cached are skipped.
+ */
+void preview_prefetch(char **paths, int n, const pane *pn)
+{
+	pthread_mutex_lock(&lock);
+	clear_prefetch();
+	if (nslots > 1) {
+		pf_paths = rememalloc(pf_paths, (n + 1) * sizeof(char *));
+		pf_pane = *pn;
+		for (int i = 0; i < n; i++) {
+			struct stat st;
+			if (stat(paths[i], &st) == 0 && cache_get(paths[i], &st, pn))
+				continue;
+			if (same_request(&req, paths[i], pn) || find_prefetch(paths[i], pn))
+				continue;
+			pf_paths[pf_length++] = estrdup(paths[i]);
+		}
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Throw away queued and in-flight prefetching, e.g. when the selection
+ * jumps far away or the directory changes
+ */
+void preview_prefetch_cancel(void)
+{
+	pthread_mutex_lock(&lock);
+	pf_gen++;
+	clear_prefetch();
+	for (int i = 1; i < nslots; i++) {
+		if (slots[i].child && slots[i].r.prefetch)
+			kill(slots[i].child, SIGTERM);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Follow mode: the tail of a growing file, kept up to date from inotify
+ * events by reading only what was appended. Runs on the UI thread.
+ */
+static struct {
+	char *path;
+	pane pn;
+	int fd; /* followed file, -1 while it is gone */
+	dev_t dev;
+	ino_t ino;
+	off_t offset; /* bytes of it read so far */
+	int ifd; /* inotify */
+	int wd, dir_wd; /* watches on the file and its directory */
+	char **lines; /* last pn.rows complete lines, oldest at head */
+	size_t *lens;
+	int head, count;
+	char *partial; /* unfinished last line */
+	size_t partial_len;
+	preview *shown;
+} follow = { .fd = -1, .ifd = -1, .wd = -1, .dir_wd = -1 };
+
+/* Bytes that can ever be seen in the pane, anything older is skipped */
+static size_t follow_cap(void)
+{
+	return (size_t) follow.pn.rows * (follow.pn.width * 4 + 1);
+}
+
+static void follow_clear(void)
+{
+	for (int i = 0; i < follow.count; i++)
+		free(follow.lines[(follow.head + i) % follow.pn.rows]);
+	follow.head = follow.count = 0;
+	follow.partial_len = 0;
+}
+
+/*
+ * Split appended bytes into lines, keeping only the last pn.rows of them
+ */
+static void follow_feed(const char *data, size_t len)
+{
+	size_t cap = follow_cap();
+	while (len) {
+		const char *nl = memchr(data, '\n', len);
+		size_t n = (nl ? nl : data + len) - data;
+		size_t keep = follow.partial_len + n > cap ? cap - follow.partial_len : n;
+		memcpy(follow.partial + follow.partial_len, data, keep);
+		follow.partial_len += keep;
+		if (!nl)
+			break;
+
+		size_t linelen = follow.partial_len;
+		if (linelen && follow.partial[linelen - 1] == '\r')
+			linelen--;
+		int rows = follow.pn.rows;
+		int i = (follow.head + follow.count) % rows;
+		if (follow.count == rows) {
+			free(follow.lines[i]);
+			follow.head = (follow.head + 1) % rows;
+		} else {
+			follow.count++;
+		}
+		follow.lines[i] = memalloc(linelen + 1);
+		memcpy(follow.lines[i], follow.partial, linelen);
+		follow.lens[i] = linelen;
+		follow.partial_len = 0;
+		len -= n + 1;
+		data = nl + 1;
+	}
+}
+
+/*
+ * Find where the last pn.rows lines of a file of size bytes start
+ * by reading backwards from its end
+ */
+static off_t follow_tail_start(off_t size)
+{
+	off_t cap = follow_cap();
+	off_t limit = size > cap ? size - cap : 0;
+	off_t pos = size;
+	int lines = 0;
+	char buf[8192];
+
+	while (pos > limit) {
+		size_t chunk = pos - limit < (off_t) sizeof(buf) ? pos - limit : sizeof(buf);
+		ssize_t n = pread(follow.fd, buf, chunk, pos - chunk);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n != (ssize_t) chunk)
+			break;
+		for (ssize_t i = n - 1; i >= 0; i--) {
+			/* a newline ending the file doesn't start a line */
+			if (buf[i] == '\n' && pos - chunk + i != size - 1 && ++lines == follow.pn.rows)
+				return pos - chunk + i + 1;
+		}
+		pos -= chunk;
+	}
+	return limit;
+}
+
+/*
+ * Read what was appended since last time, or the tail again if the file
+ * was truncated or grew by more than the pane can show
+ * Returns 1 if anything changed
+ */
+static int follow_read(void)
+{
+	struct stat st;
+	if (follow.fd == -1 || fstat(follow.fd, &st) == -1)
+		return 0;
+	if (st.st_size == follow.offset)
+		return 0;
+	if (st.st_size < follow.offset || st.st_size - follow.offset > (off_t) follow_cap()) {
+		follow_clear();
+		follow.offset = follow_tail_start(st.st_size);
+	}
+
+	char buf[HEAD_CHUNK];
+	while (follow.offset < st.st_size) {
+		ssize_t n = pread(follow.fd, buf, sizeof(buf), follow.offset);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		follow_feed(buf, n);
+		follow.offset += n;
+	}
+	return 1;
+}
+
+/*
+ * (Re)open the followed path, e.g. after it was rotated
+ * Returns 1 if a new file was opened
+ */
+static int follow_open(void)
+{
+	struct stat st;
+	int fd = open(follow.path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)
+			|| (follow.fd != -1 && st.st_dev == follow.dev && st.st_ino == follow.ino)) {
+		close(fd);
+		return 0;
+	}
+	if (follow.fd != -1) {
+		/* whatever was still written to the old file before the switch */
+		follow_read();
+		close(follow.fd);
+		inotify_rm_watch(follow.ifd, follow.wd);
+	}
+	follow.fd = fd;
+	follow.dev = st.st_dev;
+	follow.ino = st.st_ino;
+	follow.offset = 0;
+	follow.wd = inotify_add_watch(follow.ifd, follow.path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+	return 1;
+}
+
+static preview *follow_render(void)
+{
+	preview *p = preview_new();
+	hl_state st = { highlight_lang(follow.path), 0 };
+	hl_buf out = { NULL, 0, 0, 0 };
+	char sgr[SGR_MAX] = "\033[0m";
+	int rows = follow.pn.rows;
+
+	for (int i = 0; i <= follow.count; i++) {
+		const char *line = follow.partial;
+		size_t len = follow.partial_len;
+		if (i < follow.count) {
+			line = follow.lines[(follow.head + i) % rows];
+			len = follow.lens[(follow.head + i) % rows];
+		} else if (!len) {
+			break;
+		}
+		out.length = 0;
+		highlight_line(&st, line, len, &out);
+		wrap_line(p, out.s, out.length, INT_MAX, follow.pn.width, sgr);
+	}
+	free(out.s);
+
+	/* keep the bottom of the wrapped rows */
+	if (p->length > rows) {
+		int drop = p->length - rows;
+		for (int i = 0; i < drop; i++)
+			free(p->lines[i]);
+		memmove(p->lines, p->lines + drop, rows * sizeof(char *));
+		p->length = rows;
+	}
+	preview_free(follow.shown);
+	follow.shown = p;
+	return p;
+}
+
+/*
+ * Stop following, also when the followed file is replaced by another
+ */
+void preview_unfollow(void)
+{
+	if (follow.ifd == -1)
+		return;
+	if (follow.fd != -1)
+		close(follow.fd);
+	close(follow.ifd);
+	follow.fd = follow.ifd = follow.wd = follow.dir_wd = -1;
+	follow_clear();
+	free(follow.lines);
+	free(follow.lens);
+	free(follow.partial);
+	free(follow.path);
+	preview_free(follow.shown);
+	follow.lines = NULL;
+	follow.lens = NULL;
+	follow.partial = NULL;
+	follow.path = NULL;
+	follow.shown = NULL;
+}
+
+/*
+ * Show the last lines of path in pane pn and keep following it
+ * Returns NULL if it isn't a regular file that can be followed
+ */
+preview *preview_follow(const char *path, const pane *pn)
+{
+	if (follow.path && !strcmp(follow.path, path) && follow.pn.rows == pn->rows
+			&& follow.pn.width == pn->width)
+		return follow.shown;
+	preview_unfollow();
+	if (pn->rows <= 0 || pn->width <= 0)
+		return NULL;
+
+	follow.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (follow.ifd == -1)
+		return NULL;
+	follow.path = estrdup((char *) path);
+	follow.pn = *pn;
+	follow.lines = memalloc(pn->rows * sizeof(char *));
+	follow.lens = memalloc(pn->rows * sizeof(size_t));
+	follow.partial = memalloc(follow_cap());
+	if (!follow_open()) {
+		preview_unfollow();
+		return NULL;
+	}
+
+	/* rotated files are replaced by a new one with the same name */
+	const char *slash = strrchr(path, '/');
+	if (slash) {
+		size_t len = slash == path ? 1 : slash - path;
+		char parent[len + 1];
+		memcpy(parent, path, len);
+		parent[len] = '\0';
+		follow.dir_wd = inotify_add_watch(follow.ifd, parent, IN_CREATE | IN_MOVED_TO);
+	}
+
+	struct stat st;
+	if (fstat(follow.fd, &st) == 0)
+		follow.offset = follow_tail_start(st.st_size);
+	follow_read();
+	return follow_render();
+}
+
+/*
+ * File descriptor that becomes readable when the followed file changes,
+ * -1 when not following
+ */
+int preview_follow_fd(void)
+{
+	return follow.ifd;
+}
+
+/*
+ * Handle pending inotify events of the followed file
+ * Returns the updated preview, or NULL if nothing changed
+ */
+preview *preview_follow_update(void)
+{
+	union {
+		struct inotify_event ev; /* aligns buf for events */
+		char buf[4096];
+	} u;
+	char *buf = u.buf;
+	if (!follow.path)
+		return NULL;
+	const char *name = strrchr(follow.path, '/');
+	name = name ? name + 1 : follow.path;
+	int changed = 0;
+	ssize_t n;
+
+	while ((n = read(follow.ifd, buf, sizeof(u.buf))) > 0) {
+		for (char *ptr = buf; ptr < buf + n;) {
+			const struct inotify_event *ev = (const struct inotify_event *) ptr;
+			ptr += sizeof(struct inotify_event) + ev->len;
+			if (ev->wd == follow.wd && ev->mask & IN_MODIFY) {
+				changed |= follow_read();
+			} else if (ev->wd == follow.wd && ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+				/* rotated away, keep showing it until a new one shows up */
+				changed |= follow_read();
+				changed |= follow_open();
+			} else if (ev->wd == follow.dir_wd && ev->len && !strcmp(ev->name, name)) {
+				changed |= follow_open();
+			}
+		}
+	}
+	if (changed)
+		follow_read();
+	return changed ? follow_render() : NULL;
+}
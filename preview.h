@@ -0,0 +1,43 @@
+#ifndef PREVIEW_H_
+#define PREVIEW_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct {
+	char **lines; /* rows ready to print, may contain SGR sequences */
+	int length;
+	int capacity;
+	int hex; /* a page of a hex dump */
+} preview;
+
+/* Window a file is previewed in, previews are cached for each of them */
+typedef struct {
+	int rows;
+	int width;
+	int flags;
+	long page; /* page of a hex dump */
+} pane;
+
+/* Pane flags */
+enum {
+	PREVIEW_HIDDEN = 1 << 0, /* list hidden files of directories */
+	PREVIEW_ICONS = 1 << 1, /* show icons of directory entries */
+};
+
+void preview_free(preview *p);
+void preview_init(size_t cache_size, int prefetchers, const char *highlighter, const int *colors);
+void preview_cleanup(void);
+int preview_fd(void);
+preview *preview_request(const char *path, const pane *pn);
+preview *preview_collect(void);
+void preview_cancel(void);
+void preview_prefetch(char **paths, int n, const pane *pn);
+void preview_prefetch_cancel(void);
+long preview_pages(off_t size, const pane *pn);
+preview *preview_follow(const char *path, const pane *pn);
+int preview_follow_fd(void);
+preview *preview_follow_update(void);
+void preview_unfollow(void);
+
+#endif
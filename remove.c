@@ -0,0 +1,236 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "remove.h"
+#include "util.h"
+
+/*
+ * Removes trees like rm -rf with a few threads. Every directory is read
+ * once and its entries are unlinked relative to its fd, subdirectories
+ * are pushed on a shared stack for any thread to take, and a directory
+ * is removed by whoever finishes the last thing in it. Subdirectories are
+ * opened and removed relative to the fd of their parent, which is kept
+ * open until they are gone, so no path is ever followed again and the
+ * depth of the tree isn't bound by PATH_MAX.
+ */
+
+#define REPORT_EVERY 1024 /* files removed between progress reports */
+
+/* Directory being emptied */
+typedef struct rm_dir {
+	char *name; /* in its parent, the whole path for the top one */
+	int fd; /* -1 until it is read */
+	struct rm_dir *parent;
+	int pending; /* its own scan and subdirectories not removed yet */
+	struct rm_dir *next; /* on the stack */
+} rm_dir;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	rm_dir *stack;
+	int active; /* threads scanning a directory */
+	int error; /* first errno */
+	int stopped; /* progress asked to stop */
+	remove_progress progress;
+	void *arg;
+} rm_state;
+
+static void rm_error(rm_state *rs, int err)
+{
+	pthread_mutex_lock(&rs->lock);
+	if (!rs->error)
+		rs->error = err;
+	pthread_mutex_unlock(&rs->lock);
+}
+
+static int report(rm_state *rs, long files)
+{
+	if (!rs->progress || !files || !rs->progress(rs->arg, files))
+		return 0;
+	pthread_mutex_lock(&rs->lock);
+	rs->stopped = 1;
+	pthread_mutex_unlock(&rs->lock);
+	return 1;
+}
+
+static void push_dir(rm_state *rs, rm_dir *parent, const char *name)
+{
+	rm_dir *d = memalloc(sizeof(rm_dir));
+	d->name = estrdup((char *) name);
+	d->fd = -1;
+	d->parent = parent;
+	d->pending = 1;
+
+	pthread_mutex_lock(&rs->lock);
+	parent->pending++;
+	d->next = rs->stack;
+	rs->stack = d;
+	pthread_cond_signal(&rs->cond);
+	pthread_mutex_unlock(&rs->lock);
+}
+
+/*
+ * Drop one pending thing of d, removing it and going up while
+ * directories become empty
+ */
+static void dir_done(rm_state *rs, rm_dir *d)
+{
+	while (d) {
+		pthread_mutex_lock(&rs->lock);
+		int left = --d->pending;
+		int stopped = rs->stopped;
+		pthread_mutex_unlock(&rs->lock);
+		if (left)
+			return;
+		if (d->fd != -1)
+			close(d->fd);
+		rm_dir *parent = d->parent;
+		if (unlinkat(parent ? parent->fd : AT_FDCWD, d->name, AT_REMOVEDIR) == -1 && !stopped)
+			rm_error(rs, errno);
+		free(d->name);
+		free(d);
+		d = parent;
+	}
+}
+
+/*
+ * Unlink everything in d but its subdirectories, which are pushed
+ */
+static void scan_dir(rm_state *rs, rm_dir *d)
+{
+	int fd = openat(d->parent ? d->parent->fd : AT_FDCWD, d->name,
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	/* fd stays open for its subdirectories, the stream gets its own */
+	int dfd = fd == -1 ? -1 : fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	DIR *dp = dfd == -1 ? NULL : fdopendir(dfd);
+	if (!dp) {
+		rm_error(rs, errno);
+		if (dfd != -1)
+			close(dfd);
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	d->fd = fd;
+	long removed = 0;
+	struct dirent *ep;
+	while ((ep = readdir(dp))) {
+		const char *name = ep->d_name;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+			continue;
+		if (ep->d_type == DT_DIR) {
+			push_dir(rs, d, name);
+		} else if (unlinkat(fd, name, 0) == 0) {
+			if (++removed == REPORT_EVERY) {
+				if (report(rs, removed))
+					break;
+				removed = 0;
+			}
+		} else if (errno == EISDIR || errno == EPERM) {
+			/* d_type was unknown */
+			struct stat st;
+			if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+				push_dir(rs, d, name);
+			else
+				rm_error(rs, errno);
+		} else if (errno != ENOENT) {
+			rm_error(rs, errno);
+		}
+	}
+	report(rs, removed);
+	closedir(dp);
+}
+
+static void *rm_worker(void *data)
+{
+	rm_state *rs = data;
+	pthread_mutex_lock(&rs->lock);
+	while (1) {
+		while (!rs->stack && rs->active)
+			pthread_cond_wait(&rs->cond, &rs->lock);
+		rm_dir *d = rs->stack;
+		if (!d)
+			break;
+		rs->stack = d->next;
+		rs->active++;
+		int stopped = rs->stopped;
+		pthread_mutex_unlock(&rs->lock);
+
+		/* once stopped what's left is only unwound */
+		if (!stopped)
+			scan_dir(rs, d);
+		dir_done(rs, d);
+
+		pthread_mutex_lock(&rs->lock);
+		if (--rs->active == 0 && !rs->stack)
+			pthread_cond_broadcast(&rs->cond);
+	}
+	pthread_mutex_unlock(&rs->lock);
+	return NULL;
+}
+
+/*
+ * Remove path, directories with everything in them, using workers
+ * threads. progress, if not NULL, is called from any of them as files
+ * are removed and stops the removal by returning nonzero.
+ * Returns nonzero with errno set to the first error, removing as much as
+ * possible regardless, or ECANCELED if stopped
+ */
+int remove_tree(const char *path, int workers, remove_progress progress, void *arg)
+{
+	struct stat st;
+	if (lstat(path, &st) == -1)
+		return 1;
+	if (!S_ISDIR(st.st_mode)) {
+		if (unlink(path) == -1)
+			return 1;
+		if (progress && progress(arg, 1)) {
+			errno = ECANCELED;
+			return 1;
+		}
+		return 0;
+	}
+
+	rm_state rs = { .progress = progress, .arg = arg };
+	pthread_mutex_init(&rs.lock, NULL);
+	pthread_cond_init(&rs.cond, NULL);
+	rm_dir *root = memalloc(sizeof(rm_dir));
+	root->name = estrdup((char *) path);
+	root->fd = -1;
+	root->parent = NULL;
+	root->pending = 1;
+	root->next = NULL;
+	rs.stack = root;
+
+	/* the caller works too */
+	int n = workers > 1 ? workers - 1 : 0;
+	pthread_t threads[n > 0 ? n : 1];
+	int started = 0;
+	for (; started < n; started++) {
+		if (pthread_create(&threads[started], NULL, rm_worker, &rs))
+			break;
+	}
+	rm_worker(&rs);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&rs.lock);
+	pthread_cond_destroy(&rs.cond);
+	if (rs.stopped) {
+		errno = ECANCELED;
+		return 1;
+	}
+	if (rs.error) {
+		errno = rs.error;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef REMOVE_H_
+#define REMOVE_H_
+
+/* Told about removed files, returns nonzero to stop removing */
+typedef int (*remove_progress)(void *arg, long files);
+
+int remove_tree(const char *path, int workers, remove_progress progress, void *arg);
+
+#endif
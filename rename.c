@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "rename.h"
+#include "util.h"
+
+/*
+ * Renames many files at once as if it happened all together, so a
+ * renames b while b renames c works, and so do swaps and longer cycles.
+ * Every rename is checked before the first one is done. Renames that
+ * wait on others are done in chains from their free end, a cycle is
+ * opened up by moving one of its files to a temporary name first, or
+ * swapped in one go when it is just two.
+ */
+
+/* One rename of the batch */
+typedef struct {
+	const char *from, *to;
+	int blocker; /* whose source is our target, -1 if none */
+	int done;
+} move;
+
+/* A rename done, or an exchange of from and to */
+typedef struct {
+	const char *from, *to;
+	int swap;
+} done_rename;
+
+/* Parent directory open for renaming in, one kept since batches are
+ * mostly within a single directory */
+typedef struct {
+	char path[PATH_MAX];
+	int fd;
+} dir_cache;
+
+static unsigned long hash(const char *s)
+{
+	unsigned long h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+/*
+ * Index of the move whose source is path, -1 if none
+ */
+static int lookup(const move *moves, const int *table, int size, const char *path)
+{
+	for (unsigned long b = hash(path) & (size - 1); table[b] != -1; b = (b + 1) & (size - 1)) {
+		if (!strcmp(moves[table[b]].from, path))
+			return table[b];
+	}
+	return -1;
+}
+
+/*
+ * Put the directory of path in dc and point *name at its last component
+ * Returns the directory fd, -1 on failure
+ */
+static int parent_fd(dir_cache *dc, const char *path, const char **name)
+{
+	const char *slash = strrchr(path, '/');
+	char dir[PATH_MAX];
+	if (!slash)
+		snprintf(dir, PATH_MAX, ".");
+	else if (slash == path)
+		snprintf(dir, PATH_MAX, "/");
+	else
+		snprintf(dir, PATH_MAX, "%.*s", (int) (slash - path), path);
+	*name = slash ? slash + 1 : path;
+	if (dc->fd != -1 && !strcmp(dc->path, dir))
+		return dc->fd;
+	if (dc->fd != -1)
+		close(dc->fd);
+	dc->fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	snprintf(dc->path, PATH_MAX, "%s", dir);
+	return dc->fd;
+}
+
+/*
+ * Rename from to to relative to their directories, never replacing
+ * anything that appeared at to since the checks
+ */
+static int do_rename(dir_cache *src, dir_cache *dest, const char *from, const char *to)
+{
+	const char *from_name, *to_name;
+	int from_fd = parent_fd(src, from, &from_name);
+	int to_fd = parent_fd(dest, to, &to_name);
+	if (from_fd == -1 || to_fd == -1)
+		return -1;
+	if (renameat2(from_fd, from_name, to_fd, to_name, RENAME_NOREPLACE) == 0)
+		return 0;
+	/* some filesystems can't do it without replacing */
+	if (errno != EINVAL && errno != ENOSYS)
+		return -1;
+	if (faccessat(to_fd, to_name, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+		errno = EEXIST;
+		return -1;
+	}
+	return renameat(from_fd, from_name, to_fd, to_name);
+}
+
+/*
+ * Temporary name to park from under while its cycle is renamed, next
+ * to it and cut so that it fits in NAME_MAX with the suffix
+ * Returns nonzero with errno set if it doesn't fit in PATH_MAX
+ */
+static int park_name(char *tmp, const char *from)
+{
+	char suffix[32];
+	int slen = snprintf(suffix, sizeof(suffix), ".ccc-rename-%ld", (long) getpid());
+	const char *slash = strrchr(from, '/');
+	int dlen = slash ? slash + 1 - from : 0;
+	int nlen = strlen(from + dlen);
+	if (nlen > NAME_MAX - slen)
+		nlen = NAME_MAX - slen;
+	if (snprintf(tmp, PATH_MAX, "%.*s%.*s%s", dlen, from, nlen, from + dlen, suffix) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Check that every rename can be done before doing any
+ * Returns nonzero with errno set and *failed naming the culprit
+ */
+static int check(move *moves, int n, const int *table, int size, const char **failed)
+{
+	/* targets are hashed in a second table to find duplicates */
+	int *targets = memalloc(size * sizeof(int));
+	memset(targets, -1, size * sizeof(int));
+	int ret = 0;
+	for (int i = 0; i < n && !ret; i++) {
+		struct stat from_st, dir_st, to_st;
+		char dir[PATH_MAX];
+		const char *slash = strrchr(moves[i].to, '/');
+		snprintf(dir, PATH_MAX, "%.*s", slash ? (int) (slash - moves[i].to) + 1 : 1,
+				slash ? moves[i].to : ".");
+		*failed = moves[i].to;
+		if (lstat(moves[i].from, &from_st) == -1) {
+			*failed = moves[i].from;
+			ret = -1;
+		} else if (stat(dir, &dir_st) == -1) {
+			ret = -1;
+		} else if (dir_st.st_dev != from_st.st_dev) {
+			errno = EXDEV;
+			ret = -1;
+		} else if (moves[i].blocker == -1 && lstat(moves[i].to, &to_st) == 0) {
+			errno = EEXIST;
+			ret = -1;
+		}
+
+		unsigned long b = hash(moves[i].to) & (size - 1);
+		for (; targets[b] != -1 && !ret; b = (b + 1) & (size - 1)) {
+			if (!strcmp(moves[targets[b]].to, moves[i].to)) {
+				errno = EEXIST;
+				ret = -1;
+			}
+		}
+		targets[b] = i;
+	}
+	free(targets);
+	return ret;
+}
+
+/*
+ * Rename from[i] to to[i] for all n of them, sources have to be distinct
+ * Returns how many were renamed, or -1 with errno set and *failed naming
+ * the path at fault. Nothing is renamed when a check fails, and renames
+ * done before one fails are undone; if that fails too, *failed names
+ * where a file was left
+ */
+int rename_batch(char **from, char **to, int n, const char **failed)
+{
+	int size = 16;
+	while (size < n * 2)
+		size *= 2;
+	move *moves = memalloc((n ? n : 1) * sizeof(move));
+	int *table = memalloc(size * sizeof(int));
+	memset(table, -1, size * sizeof(int));
+
+	/* what stays put is left out */
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		if (!strcmp(from[i], to[i]))
+			continue;
+		moves[count].from = from[i];
+		moves[count].to = to[i];
+		moves[count].done = 0;
+		unsigned long b = hash(from[i]) & (size - 1);
+		while (table[b] != -1)
+			b = (b + 1) & (size - 1);
+		table[b] = count++;
+	}
+	for (int i = 0; i < count; i++)
+		moves[i].blocker = lookup(moves, table, size, moves[i].to);
+
+	if (check(moves, count, table, size, failed)) {
+		free(moves);
+		free(table);
+		return -1;
+	}
+
+	/*
+	 * Each target is some other source at most once, so renames form
+	 * chains and cycles. Follow a chain to its end and rename backwards
+	 * from there, each move vacating the target of the one before
+	 */
+	dir_cache src = { "", -1 }, dest = { "", -1 };
+	int *chain = memalloc((count ? count : 1) * sizeof(int));
+	/* every rename done, in order, so that a failure can undo them;
+	 * at most two per move and the parking of one per cycle */
+	done_rename *log = memalloc((2 * count + 1) * sizeof(done_rename));
+	char **tmps = memalloc((count / 2 + 1) * sizeof(char *));
+	int logged = 0, ntmps = 0, renamed = 0, error = 0;
+	for (int i = 0; i < count && !error; i++) {
+		if (moves[i].done)
+			continue;
+		int len = 0, k = i, cycle = 0;
+		while (k != -1 && !moves[k].done) {
+			chain[len++] = k;
+			k = moves[k].blocker;
+			if (k == i) {
+				cycle = 1;
+				break;
+			}
+		}
+
+		if (cycle && len == 2) {
+			/* a swap */
+			const char *a, *b;
+			int a_fd = parent_fd(&src, moves[i].from, &a);
+			int b_fd = parent_fd(&dest, moves[chain[1]].from, &b);
+			if (a_fd != -1 && b_fd != -1 && renameat2(a_fd, a, b_fd, b, RENAME_EXCHANGE) == 0) {
+				moves[i].done = moves[chain[1]].done = 1;
+				log[logged++] = (done_rename) { moves[i].from, moves[chain[1]].from, 1 };
+				renamed += 2;
+				continue;
+			}
+		}
+		char tmp[PATH_MAX] = "";
+		if (cycle) {
+			/* park the first in the cycle so the last can take its place */
+			if (park_name(tmp, moves[i].from) || do_rename(&src, &dest, moves[i].from, tmp)) {
+				*failed = moves[i].from;
+				error = errno;
+				break;
+			}
+			tmps[ntmps] = estrdup(tmp);
+			log[logged++] = (done_rename) { moves[i].from, tmps[ntmps++], 0 };
+		}
+		for (int c = len - 1; c >= (cycle ? 1 : 0) && !error; c--) {
+			move *m = &moves[chain[c]];
+			if (do_rename(&src, &dest, m->from, m->to)) {
+				*failed = m->from;
+				error = errno;
+			} else {
+				log[logged++] = (done_rename) { m->from, m->to, 0 };
+				m->done = 1;
+				renamed++;
+			}
+		}
+		if (cycle && !error) {
+			if (do_rename(&src, &dest, tmp, moves[i].to)) {
+				*failed = moves[i].from;
+				error = errno;
+			} else {
+				log[logged++] = (done_rename) { tmps[ntmps - 1], moves[i].to, 0 };
+				moves[i].done = 1;
+				renamed++;
+			}
+		}
+	}
+
+	/* undo in reverse order, each one vacating what the one before it
+	 * has to be renamed back to */
+	static char stuck[PATH_MAX];
+	for (int k = logged - 1; error && k >= 0; k--) {
+		done_rename *r = &log[k];
+		const char *a, *b;
+		int a_fd = parent_fd(&src, r->to, &a);
+		int b_fd = parent_fd(&dest, r->from, &b);
+		if (r->swap ? a_fd == -1 || b_fd == -1 || renameat2(a_fd, a, b_fd, b, RENAME_EXCHANGE)
+				: do_rename(&src, &dest, r->to, r->from)) {
+			/* tell where the file was left, the log doesn't outlive us */
+			snprintf(stuck, PATH_MAX, "%s", r->to);
+			*failed = stuck;
+			error = errno;
+			break;
+		}
+	}
+	if (src.fd != -1)
+		close(src.fd);
+	if (dest.fd != -1)
+		close(dest.fd);
+	for (int k = 0; k < ntmps; k++)
+		free(tmps[k]);
+	free(tmps);
+	free(log);
+	free(chain);
+	free(moves);
+	free(table);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return renamed;
+}
@@ -0,0 +1,6 @@
+#ifndef RENAME_H_
+#define RENAME_H_
+
+int rename_batch(char **from, char **to, int n, const char **failed);
+
+#endif
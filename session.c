@@ -0,0 +1,217 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "session.h"
+#include "util.h"
+
+/*
+ * Session saved on quit: a header, the two directories, then the files
+ * of the listing and the marked ones as records followed by their
+ * strings. It is mapped and turned back into lists without reading the
+ * directory or stating anything in it, as long as the directory's mtime
+ * and ctime show nothing was added, removed or renamed since it was
+ * listed.
+ */
+
+#define SESSION_MAGIC "CCCSESS1"
+
+typedef struct {
+	char magic[8];
+	int64_t sel;
+	uint32_t flags, cwd_length, p_cwd_length, nfiles, nmarked, pad;
+	/* cwd as it was when listed */
+	uint64_t dev, ino;
+	int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+} session_header;
+
+/* Followed by the name, path and stats */
+typedef struct {
+	uint32_t name_length, path_length;
+	uint32_t stats_length; /* 0 for none */
+	int32_t type, color;
+	char icon[8];
+} session_file;
+
+static void write_files(FILE *f, const ArrayList *list)
+{
+	for (size_t i = 0; i < list->length; i++) {
+		file *fl = &list->items[i];
+		session_file rec = { 0 };
+		rec.name_length = strlen(fl->name);
+		rec.path_length = strlen(fl->path);
+		rec.stats_length = fl->stats ? strlen(fl->stats) : 0;
+		rec.type = fl->type;
+		rec.color = fl->color;
+		memcpy(rec.icon, fl->icon, sizeof(rec.icon));
+		fwrite(&rec, sizeof(rec), 1, f);
+		fwrite(fl->name, 1, rec.name_length, f);
+		fwrite(fl->path, 1, rec.path_length, f);
+		if (fl->stats)
+			fwrite(fl->stats, 1, rec.stats_length, f);
+	}
+}
+
+/*
+ * Save s to path, with its listing if listed tells what cwd was like
+ * when it was read.
+ * Returns nonzero if it couldn't be written
+ */
+int session_save(const char *path, const session *s, const struct stat *listed)
+{
+	session_header h = { SESSION_MAGIC };
+	h.sel = s->sel;
+	h.flags = s->flags;
+	h.cwd_length = strlen(s->cwd);
+	h.p_cwd_length = strlen(s->p_cwd);
+	h.nfiles = s->files && listed ? s->files->length : 0;
+	h.nmarked = s->marked->length;
+	if (listed) {
+		h.dev = listed->st_dev;
+		h.ino = listed->st_ino;
+		h.mtime_sec = listed->st_mtim.tv_sec;
+		h.mtime_nsec = listed->st_mtim.tv_nsec;
+		h.ctime_sec = listed->st_ctim.tv_sec;
+		h.ctime_nsec = listed->st_ctim.tv_nsec;
+	}
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, PATH_MAX, "%s.%ld", path, (long) getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	FILE *f = fd == -1 ? NULL : fdopen(fd, "w");
+	if (!f) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(s->cwd, 1, h.cwd_length, f);
+	fwrite(s->p_cwd, 1, h.p_cwd_length, f);
+	if (h.nfiles)
+		write_files(f, s->files);
+	write_files(f, s->marked);
+	if (fclose(f) || rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Next n bytes of the mapped session as a string, NULL if it ends
+ * before that
+ */
+static char *take(const unsigned char **p, const unsigned char *end, size_t n)
+{
+	if (n >= PATH_MAX * 2 || (size_t) (end - *p) < n)
+		return NULL;
+	char *s = memalloc(n + 1);
+	memcpy(s, *p, n);
+	s[n] = '\0';
+	*p += n;
+	return s;
+}
+
+/*
+ * Read n records into list, returns nonzero if the session is broken
+ */
+static int read_files(const unsigned char **p, const unsigned char *end, uint32_t n, ArrayList *list)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		session_file rec;
+		if ((size_t) (end - *p) < sizeof(rec))
+			return -1;
+		memcpy(&rec, *p, sizeof(rec));
+		*p += sizeof(rec);
+		file *fl = &list->items[list->length];
+		fl->name = take(p, end, rec.name_length);
+		fl->path = fl->name ? take(p, end, rec.path_length) : NULL;
+		fl->stats = NULL;
+		if (fl->path && rec.stats_length)
+			fl->stats = take(p, end, rec.stats_length);
+		if (!fl->path || (rec.stats_length && !fl->stats)) {
+			free(fl->name);
+			free(fl->path);
+			return -1;
+		}
+		fl->type = rec.type;
+		fl->color = rec.color;
+		memcpy(fl->icon, rec.icon, sizeof(fl->icon));
+		fl->icon[sizeof(fl->icon) - 1] = '\0';
+		list->length++;
+	}
+	return 0;
+}
+
+/*
+ * Load the session saved at path into s, its listing only if cwd looks
+ * the same as when it was read.
+ * Returns nonzero if there is none or it is broken
+ */
+int session_load(const char *path, session *s)
+{
+	memset(s, 0, sizeof(*s));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	struct stat st;
+	unsigned char *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(session_header))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	const unsigned char *p = map, *end = map + st.st_size;
+	session_header h;
+	memcpy(&h, p, sizeof(h));
+	p += sizeof(h);
+	int broken = memcmp(h.magic, SESSION_MAGIC, sizeof(h.magic))
+		|| h.cwd_length >= PATH_MAX || h.p_cwd_length >= PATH_MAX;
+	if (!broken) {
+		s->cwd = take(&p, end, h.cwd_length);
+		s->p_cwd = s->cwd ? take(&p, end, h.p_cwd_length) : NULL;
+		broken = !s->p_cwd;
+	}
+	/* each record takes at least its own size */
+	if (!broken)
+		broken = (uint64_t) h.nfiles + h.nmarked > (uint64_t) (end - p) / sizeof(session_file);
+
+	struct stat cur;
+	if (!broken && h.nfiles) {
+		s->files = arraylist_init(h.nfiles);
+		broken = read_files(&p, end, h.nfiles, s->files);
+		if (stat(s->cwd, &cur) || cur.st_dev != h.dev || cur.st_ino != h.ino
+				|| cur.st_mtim.tv_sec != h.mtime_sec || cur.st_mtim.tv_nsec != h.mtime_nsec
+				|| cur.st_ctim.tv_sec != h.ctime_sec || cur.st_ctim.tv_nsec != h.ctime_nsec) {
+			arraylist_free(s->files);
+			s->files = NULL;
+		}
+	}
+	if (!broken) {
+		/* room for marking more */
+		s->marked = arraylist_init(h.nmarked < 100 ? 100 : h.nmarked);
+		broken = read_files(&p, end, h.nmarked, s->marked);
+	}
+	munmap(map, st.st_size);
+
+	if (broken) {
+		free(s->cwd);
+		free(s->p_cwd);
+		if (s->files)
+			arraylist_free(s->files);
+		if (s->marked)
+			arraylist_free(s->marked);
+		memset(s, 0, sizeof(*s));
+		return -1;
+	}
+	s->sel = h.sel;
+	s->flags = h.flags;
+	return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <sys/stat.h>
+
+#include "file.h"
+
+/* Where ccc was left */
+typedef struct {
+	char *cwd;
+	char *p_cwd;
+	long sel;
+	int flags;
+	ArrayList *files; /* listing of cwd, NULL if it changed since */
+	ArrayList *marked;
+} session;
+
+/* Session flags */
+enum {
+	SESSION_HIDDEN = 1 << 0, /* hidden files listed */
+	SESSION_DETAILS = 1 << 1,
+	SESSION_ICONS = 1 << 2,
+	SESSION_SIZES = 1 << 3, /* directory sizes added up */
+};
+
+int session_save(const char *path, const session *s, const struct stat *listed);
+int session_load(const char *path, session *s);
+
+#endif
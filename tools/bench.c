@@ -0,0 +1,417 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../copy.h"
+#include "../file.h"
+#include "../lscolors.h"
+#include "../preview.h"
+#include "../remove.h"
+#include "../util.h"
+
+/*
+ * Microbenchmarks of ccc on the trees made by tools/mktree, named
+ * shape-entries in dir. It is linked with ccc.c built with its main
+ * renamed so what is timed is what ccc runs. Results are written to
+ * stdout as JSON, the best and median time of the runs of every
+ * benchmark, while the listing drawn goes to /dev/null and progress to
+ * stderr.
+ *
+ * Usage: bench dir tree...
+ */
+
+#define MIN_RUNS 3
+#define MAX_RUNS 50
+#define RUN_BUDGET 1000000000LL /* ns a benchmark is run for at least */
+#define MARKED_MAX 10000 /* files marked at most, marking is quadratic */
+#define LIST_DRAWS 100 /* listings drawn by each run */
+#define BIG_SIZE (64 << 20)
+#define SMALL_FILES 1000
+#define SMALL_SIZE 4096
+#define COPY_WORKERS 4
+
+/* From ccc.c */
+extern ArrayList *files, *marked;
+extern long sel_file;
+extern int rows, cols;
+extern char cwd[];
+void populate_files(const char *path, int ftype, ArrayList **list);
+void list_files(void);
+int sort_compare(const void *a, const void *b);
+
+typedef struct {
+	const char *name;
+	const char *tree; /* NULL if not run on one */
+	long ops; /* done by each run */
+	int runs;
+	long long ns[MAX_RUNS];
+} bench;
+
+static FILE *json;
+static int reported = 0;
+static char scratch[PATH_MAX / 2]; /* leaves room for the names in it */
+
+static long long now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int by_ns(const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Time fn until it ran MIN_RUNS times for RUN_BUDGET, or MAX_RUNS times.
+ * setup, if not NULL, is run untimed before every run
+ */
+static void run(bench *b, void (*setup)(void *), void (*fn)(void *), void *arg)
+{
+	long long total = 0;
+	for (b->runs = 0; b->runs < MAX_RUNS && (b->runs < MIN_RUNS || total < RUN_BUDGET); b->runs++) {
+		if (setup)
+			setup(arg);
+		long long start = now();
+		fn(arg);
+		b->ns[b->runs] = now() - start;
+		total += b->ns[b->runs];
+	}
+}
+
+static void report(bench *b)
+{
+	qsort(b->ns, b->runs, sizeof(long long), by_ns);
+	long long median = b->ns[b->runs / 2];
+	fprintf(json, "%s\n\t\t{ \"name\": \"%s\", \"tree\": ", reported++ ? "," : "", b->name);
+	if (b->tree)
+		fprintf(json, "\"%s\"", b->tree);
+	else
+		fprintf(json, "null");
+	fprintf(json, ", \"ops\": %ld, \"runs\": %d, \"best_ns\": %lld, \"median_ns\": %lld, "
+			"\"ns_per_op\": %.1f }", b->ops, b->runs, b->ns[0], median,
+			b->ops ? (double) median / b->ops : 0.0);
+	fprintf(stderr, "%-16s %-16s %12.3f ms %12.1f ns/op\n", b->name, b->tree ? b->tree : "",
+			median / 1e6, b->ops ? (double) median / b->ops : 0.0);
+}
+
+/* Listing of a tree */
+
+typedef struct {
+	const char *path;
+	ArrayList *list;
+	file *shuffled, *work;
+	long n;
+} listing;
+
+static void free_listing(void *arg)
+{
+	listing *l = arg;
+	if (l->list)
+		arraylist_free(l->list);
+	l->list = NULL;
+}
+
+static void populate(void *arg)
+{
+	listing *l = arg;
+	populate_files(l->path, 0, &l->list);
+}
+
+static void unsort(void *arg)
+{
+	listing *l = arg;
+	memcpy(l->work, l->shuffled, l->n * sizeof(file));
+}
+
+static void sort(void *arg)
+{
+	listing *l = arg;
+	qsort(l->work, l->n, sizeof(file), sort_compare);
+}
+
+static void draw(void *arg)
+{
+	listing *l = arg;
+	/* all over the listing, scrolled or not */
+	for (long k = 0; k < LIST_DRAWS; k++) {
+		sel_file = k < LIST_DRAWS / 2 ? k % (rows - 1) : k * l->n / LIST_DRAWS;
+		list_files();
+	}
+	fflush(stdout);
+}
+
+static void unmark(void *arg)
+{
+	marked->length = 0;
+}
+
+static void mark(void *arg)
+{
+	listing *l = arg;
+	/* mark, look up then unmark every one */
+	for (long i = 0; i < l->n; i++) {
+		file *f = &l->list->items[i];
+		arraylist_add(marked, f->name, f->path, NULL, f->type, f->icon, f->color, 1, 0);
+	}
+	for (long i = 0; i < l->n; i++) {
+		if (arraylist_search(marked, l->list->items[i].path, 0) == -1)
+			die("bench: marked file not found");
+	}
+	for (long i = l->n - 1; i >= 0; i--)
+		arraylist_remove(marked, i);
+}
+
+/*
+ * Benchmarks of reading, sorting, drawing and marking a listing of path
+ */
+static void bench_listing(const char *tree, const char *path)
+{
+	listing l = { path, NULL, NULL, NULL, 0 };
+	bench b = { "populate_files", tree, 0, 0 };
+	run(&b, free_listing, populate, &l);
+	b.ops = l.list->length;
+	report(&b);
+
+	l.n = l.list->length;
+	l.shuffled = memalloc(l.n * sizeof(file));
+	l.work = memalloc(l.n * sizeof(file));
+	memcpy(l.shuffled, l.list->items, l.n * sizeof(file));
+	srand(1);
+	for (long i = l.n - 1; i > 0; i--) {
+		long j = ((long) rand() * RAND_MAX + rand()) % (i + 1);
+		file t = l.shuffled[i];
+		l.shuffled[i] = l.shuffled[j];
+		l.shuffled[j] = t;
+	}
+	b = (bench) { "sort", tree, l.n, 0 };
+	run(&b, unsort, sort, &l);
+	report(&b);
+	free(l.shuffled);
+	free(l.work);
+
+	files = l.list;
+	strcpy(cwd, path);
+	b = (bench) { "list_files", tree, LIST_DRAWS, 0 };
+	run(&b, NULL, draw, &l);
+	report(&b);
+	preview_cancel();
+	files = NULL;
+
+	l.n = l.n < MARKED_MAX ? l.n : MARKED_MAX;
+	b = (bench) { "marked", tree, l.n * 3, 0 };
+	run(&b, unmark, mark, &l);
+	report(&b);
+	free_listing(&l);
+}
+
+/* Copies */
+
+typedef struct {
+	const char *src, *dest;
+} copy;
+
+static void copy_one(void *arg)
+{
+	copy *c = arg;
+	if (copy_file(c->src, c->dest))
+		die("bench: copy_file failed");
+}
+
+static void copy_small(void *arg)
+{
+	char src[PATH_MAX], dest[PATH_MAX];
+	for (int i = 0; i < SMALL_FILES; i++) {
+		snprintf(src, PATH_MAX, "%s/small/%04d", scratch, i);
+		snprintf(dest, PATH_MAX, "%s/small-copy/%04d", scratch, i);
+		if (copy_file(src, dest))
+			die("bench: copy_file failed");
+	}
+}
+
+static void remove_dest(void *arg)
+{
+	copy *c = arg;
+	if (remove_tree(c->dest, COPY_WORKERS, NULL, NULL) && errno != ENOENT)
+		die("bench: remove_tree failed");
+}
+
+static void copy_all(void *arg)
+{
+	copy *c = arg;
+	if (copy_tree(c->src, c->dest, COPY_WORKERS, NULL, NULL))
+		die("bench: copy_tree failed");
+}
+
+/* Write size bytes of data to path, text if it is C code */
+static void make_file(const char *path, long size, int text)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		die("bench: can't write in the scratch directory");
+	unsigned x = 1;
+	for (long n = 0; n < size; ) {
+		if (text) {
+			n += fprintf(f, "static int f%ld(int a)\n{\n\t/* line %ld */\n\treturn a * %ld + \"%ld\"[0];\n}\n\n",
+					n, n, n % 97, n);
+		} else {
+			x = x * 1103515245 + 12345;
+			fputc(x >> 16, f);
+			n++;
+		}
+	}
+	fclose(f);
+}
+
+static void make_scratch(void)
+{
+	char path[PATH_MAX];
+	mkdir(scratch, 0755);
+	snprintf(path, PATH_MAX, "%s/small", scratch);
+	mkdir(path, 0755);
+	snprintf(path, PATH_MAX, "%s/small-copy", scratch);
+	mkdir(path, 0755);
+	for (int i = 0; i < SMALL_FILES; i++) {
+		snprintf(path, PATH_MAX, "%s/small/%04d", scratch, i);
+		make_file(path, SMALL_SIZE, 0);
+	}
+	snprintf(path, PATH_MAX, "%s/big", scratch);
+	make_file(path, BIG_SIZE, 0);
+	snprintf(path, PATH_MAX, "%s/source.c", scratch);
+	make_file(path, 1 << 20, 1);
+}
+
+static void bench_copies(void)
+{
+	char src[PATH_MAX], dest[PATH_MAX];
+	snprintf(src, PATH_MAX, "%s/big", scratch);
+	snprintf(dest, PATH_MAX, "%s/big-copy", scratch);
+	copy c = { src, dest };
+	bench b = { "copy_file_big", NULL, 1, 0 };
+	run(&b, NULL, copy_one, &c);
+	report(&b);
+	unlink(dest);
+
+	b = (bench) { "copy_file_small", NULL, SMALL_FILES, 0 };
+	run(&b, NULL, copy_small, NULL);
+	report(&b);
+}
+
+static void bench_copy_tree(const char *tree, const char *path, long entries)
+{
+	char dest[PATH_MAX];
+	snprintf(dest, PATH_MAX, "%s/tree-copy", scratch);
+	copy c = { path, dest };
+	bench b = { "copy_tree", tree, entries, 0 };
+	run(&b, remove_dest, copy_all, &c);
+	report(&b);
+	remove_dest(&c);
+}
+
+/* Previews */
+
+typedef struct {
+	const char *path;
+	int width; /* changed to miss the cache */
+} shown;
+
+static preview *wait_preview(const char *path, const pane *pn)
+{
+	preview *p = preview_request(path, pn);
+	while (!p) {
+		struct pollfd pfd = { preview_fd(), POLLIN, 0 };
+		if (poll(&pfd, 1, 10000) <= 0)
+			die("bench: no preview came");
+		p = preview_collect();
+	}
+	return p;
+}
+
+static void render(void *arg)
+{
+	shown *s = arg;
+	pane pn = { 50, s->width++, PREVIEW_HIDDEN | PREVIEW_ICONS, 0 };
+	wait_preview(s->path, &pn);
+}
+
+static void cached(void *arg)
+{
+	shown *s = arg;
+	pane pn = { 50, s->width, PREVIEW_HIDDEN | PREVIEW_ICONS, 0 };
+	for (int i = 0; i < 1000; i++) {
+		if (!preview_request(s->path, &pn))
+			die("bench: preview not cached");
+	}
+}
+
+static void bench_preview(const char *name, const char *tree, const char *path)
+{
+	shown s = { path, 80 };
+	bench b = { name, tree, 1, 0 };
+	run(&b, NULL, render, &s);
+	report(&b);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		die("Usage: bench dir tree...");
+	/* the listing is drawn to nowhere */
+	int fd = dup(STDOUT_FILENO);
+	if (fd == -1 || !(json = fdopen(fd, "w")) || !freopen("/dev/null", "w", stdout))
+		die("bench: can't set up output");
+
+	static const int type_colors[] = { 37, 34, 32, 33, 35, 33, 35 };
+	lscolors_init(getenv("LS_COLORS"), getenv("CCC_ICONS"));
+	preview_init(64 << 20, 0, "", type_colors);
+	marked = arraylist_init(MARKED_MAX);
+	rows = 50;
+	cols = 200;
+
+	if (snprintf(scratch, sizeof(scratch), "%s/scratch", argv[1]) >= (int) sizeof(scratch))
+		die("bench: dir is too long");
+	make_scratch();
+
+	fprintf(json, "{\n\t\"version\": \"%s\",\n\t\"time\": %ld,\n\t\"benchmarks\": [", VERSION,
+			(long) time(NULL));
+	for (int i = 2; i < argc; i++) {
+		const char *tree = argv[i];
+		char path[PATH_MAX];
+		snprintf(path, PATH_MAX, "%s/%s", argv[1], tree);
+		const char *dash = strchr(tree, '-');
+		long entries = dash ? atol(dash + 1) : 0;
+		if (!strncmp(tree, "flat-", 5) || !strncmp(tree, "long-", 5)) {
+			bench_listing(tree, path);
+			bench_preview("preview_dir", tree, path);
+		} else {
+			bench_copy_tree(tree, path, entries);
+		}
+	}
+	bench_copies();
+
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "%s/source.c", scratch);
+	bench_preview("preview_text", NULL, path);
+	shown s = { path, 80 };
+	wait_preview(path, &(pane) { 50, 80, PREVIEW_HIDDEN | PREVIEW_ICONS, 0 });
+	bench b = { "preview_cached", NULL, 1000, 0 };
+	run(&b, NULL, cached, &s);
+	report(&b);
+	snprintf(path, PATH_MAX, "%s/big", scratch);
+	bench_preview("preview_hex", NULL, path);
+
+	fprintf(json, "\n\t]\n}\n");
+	fclose(json);
+	preview_cleanup();
+	lscolors_cleanup();
+	return 0;
+}
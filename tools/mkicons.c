@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "../icons.h"
+
+/*
+ * Turns icons.def into icontable.h, a perfect hash table of the icons.
+ * Names are spread over buckets by the high half of their hash, and
+ * every bucket gets a displacement xored into the low half that lands
+ * its names on free slots. Buckets are placed biggest first, and other
+ * seeds are tried until all of them fit.
+ *
+ * Usage: mkicons < icons.def > icontable.h
+ */
+
+#define MAX_ICONS 4096
+
+typedef struct {
+	char name[MAX_NAME];
+	char icon[16];
+	char lang[16];
+	uint64_t hash;
+} entry;
+
+static entry entries[MAX_ICONS];
+static int nentries = 0;
+
+static void die(const char *fmt, const char *arg)
+{
+	fprintf(stderr, "mkicons: ");
+	fprintf(stderr, fmt, arg);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+static void read_def(void)
+{
+	char line[256];
+	while (fgets(line, sizeof(line), stdin)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '#' || line[0] == '\0')
+			continue;
+		if (nentries == MAX_ICONS)
+			die("more than %s icons", "4096");
+		entry *e = &entries[nentries];
+		char *name = strtok(line, " \t");
+		char *ic = strtok(NULL, " \t");
+		char *lang = strtok(NULL, " \t");
+		if (!name || !ic || !lang)
+			die("broken line for %s", name ? name : "?");
+		if (strlen(name) >= MAX_NAME || strlen(ic) >= sizeof(e->icon) || strlen(lang) >= sizeof(e->lang))
+			die("%s is too long", name);
+		for (int i = 0; i < nentries; i++) {
+			if (!strcasecmp(entries[i].name, name))
+				die("%s is there twice", name);
+		}
+		strcpy(e->name, name);
+		strcpy(e->icon, ic);
+		strcpy(e->lang, strcmp(lang, "-") ? lang : "NONE");
+		nentries++;
+	}
+}
+
+static int nbuckets, nslots;
+static int *bucket_of; /* of each entry */
+static int *order; /* buckets by size, biggest first */
+static int *sizes;
+static uint16_t *disp;
+static int *slot_of; /* entry in each slot, -1 if free */
+
+static int by_size(const void *a, const void *b)
+{
+	return sizes[*(const int *) b] - sizes[*(const int *) a];
+}
+
+/*
+ * Find displacements placing every name with seed, nonzero if some
+ * bucket doesn't fit
+ */
+static int place(uint64_t seed)
+{
+	for (int b = 0; b < nbuckets; b++) {
+		sizes[b] = 0;
+		order[b] = b;
+		disp[b] = 0;
+	}
+	for (int i = 0; i < nentries; i++) {
+		entries[i].hash = icon_hash(entries[i].name, strlen(entries[i].name), seed);
+		bucket_of[i] = (entries[i].hash >> 32) % nbuckets;
+		sizes[bucket_of[i]]++;
+	}
+	qsort(order, nbuckets, sizeof(int), by_size);
+	for (int s = 0; s < nslots; s++)
+		slot_of[s] = -1;
+
+	for (int k = 0; k < nbuckets && sizes[order[k]]; k++) {
+		int b = order[k], d;
+		for (d = 0; d < nslots; d++) {
+			int fits = 1;
+			for (int i = 0; i < nentries && fits; i++) {
+				if (bucket_of[i] != b)
+					continue;
+				int s = ((uint32_t) entries[i].hash ^ d) & (nslots - 1);
+				if (slot_of[s] != -1)
+					fits = 0;
+				else
+					slot_of[s] = i;
+			}
+			if (fits)
+				break;
+			/* take back what this bucket got */
+			for (int s = 0; s < nslots; s++) {
+				if (slot_of[s] != -1 && bucket_of[slot_of[s]] == b)
+					slot_of[s] = -1;
+			}
+		}
+		if (d == nslots)
+			return -1;
+		disp[b] = d;
+	}
+	return 0;
+}
+
+static void print_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			putchar('\\');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+int main(void)
+{
+	read_def();
+	if (!nentries)
+		die("no icons in %s", "input");
+	nslots = 16;
+	while (nslots < nentries * 2)
+		nslots *= 2;
+	nbuckets = (nentries + 3) / 4;
+	bucket_of = malloc(nentries * sizeof(int));
+	order = malloc(nbuckets * sizeof(int));
+	sizes = malloc(nbuckets * sizeof(int));
+	disp = malloc(nbuckets * sizeof(uint16_t));
+	slot_of = malloc(nslots * sizeof(int));
+	if (!bucket_of || !order || !sizes || !disp || !slot_of)
+		die("%s", "out of memory");
+
+	uint64_t seed;
+	for (seed = 0; seed < 100000 && place(seed); seed++)
+		;
+	if (seed == 100000)
+		die("no seed makes a perfect hash of %s", "icons.def");
+
+	printf("/* Generated from icons.def by tools/mkicons, do not edit */\n\n");
+	printf("#define ICON_SEED %lluULL\n", (unsigned long long) seed);
+	printf("#define ICON_SLOTS %d\n", nslots);
+	printf("#define ICON_BUCKETS %d\n\n", nbuckets);
+	printf("static const uint16_t icon_disp[ICON_BUCKETS] = {");
+	for (int b = 0; b < nbuckets; b++)
+		printf("%s%d", !b ? "\n\t" : b % 16 ? ", " : ",\n\t", disp[b]);
+	printf("\n};\n\n");
+	printf("static const icon icon_table[ICON_SLOTS] = {\n");
+	for (int s = 0; s < nslots; s++) {
+		if (slot_of[s] == -1)
+			continue;
+		entry *e = &entries[slot_of[s]];
+		printf("\t[%d] = { ", s);
+		print_string(e->name);
+		printf(", ");
+		print_string(e->icon);
+		printf(", LANG_%s },\n", e->lang);
+	}
+	printf("};\n");
+	return 0;
+}
@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Makes the synthetic trees tools/bench runs on. Entries are of mixed
+ * types: mostly regular files with all sorts of extensions, some of them
+ * executable or with a little in them, and directories, symlinks, FIFOs
+ * and hidden files among them. The tree is made next to dir and renamed
+ * to it once complete so that a half made one is never taken for done.
+ *
+ * Shapes:
+ *   flat  all the entries in dir
+ *   long  the same with names of about 200 bytes, some of them UTF-8
+ *   deep  a chain of 100 directories sharing the entries
+ *   wide  as many directories as entries in each
+ *
+ * Usage: mktree dir shape entries
+ */
+
+static const char *exts[] = {
+	".c", ".h", ".txt", ".md", ".tar.gz", ".png", ".json", "", ".py", ".sh",
+	".jpg", ".o", ".zip", ".yml", ".html", ".mp3",
+};
+
+static char tree[PATH_MAX];
+static long made = 0;
+
+static void die(const char *fmt, const char *arg)
+{
+	fprintf(stderr, "mktree: ");
+	fprintf(stderr, fmt, arg);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+/* Die of a failed system call on path */
+static void fail(const char *what, const char *path)
+{
+	fprintf(stderr, "mktree: can't %s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+static void make_dir(const char *path)
+{
+	if (mkdir(path, 0755))
+		fail("make", path);
+}
+
+/* Name of the ith entry, one in 50 is hidden */
+static void entry_name(char *name, size_t size, long i, int long_name)
+{
+	size_t len = snprintf(name, size, "%sf%07ld", i % 50 == 0 ? "." : "", i);
+	if (long_name) {
+		/* pad with ascii and two byte characters */
+		while (len < 200)
+			len += snprintf(name + len, size - len, i % 3 ? "_%ld" : "é%ld", i % 10);
+	}
+	snprintf(name + len, size - len, "%s", exts[i % (sizeof(exts) / sizeof(*exts))]);
+}
+
+/*
+ * Make the ith entry in dir, its type going by i
+ */
+static void make_entry(const char *dir, long i, int long_name)
+{
+	char name[256], path[PATH_MAX];
+	entry_name(name, sizeof(name), i, long_name);
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int) sizeof(path))
+		die("%s is too deep", dir);
+
+	int fd;
+	switch (i % 20) {
+		case 0:
+		case 1:
+			make_dir(path);
+			break;
+		case 2:
+			/* to the entry before, dangling if that went in another directory */
+			entry_name(name, sizeof(name), i - 1, long_name);
+			if (symlink(name, path))
+				fail("link", path);
+			break;
+		case 3:
+			if (mkfifo(path, 0644))
+				fail("make", path);
+			break;
+		default:
+			fd = open(path, O_WRONLY | O_CREAT | O_EXCL, i % 20 == 4 ? 0755 : 0644);
+			if (fd == -1)
+				fail("make", path);
+			if (i % 16 == 5) {
+				char buf[4096];
+				int n = snprintf(buf, sizeof(buf), "/* %s */\n", name);
+				for (long k = 0; k < i % 64 && n < (int) sizeof(buf) - 64; k++)
+					n += snprintf(buf + n, sizeof(buf) - n, "int line_%ld = %ld;\n", k, i * k);
+				if (write(fd, buf, n) != n)
+					fail("write", path);
+			}
+			close(fd);
+	}
+	if (++made % 100000 == 0)
+		fprintf(stderr, "mktree: %ld entries in %s\n", made, tree);
+}
+
+static void make_flat(const char *dir, long n, int long_name)
+{
+	for (long i = 0; i < n; i++)
+		make_entry(dir, i, long_name);
+}
+
+static void make_deep(const char *dir, long n)
+{
+	char path[PATH_MAX];
+	strcpy(path, dir);
+	int depth = 100;
+	for (int d = 0; d < depth; d++) {
+		size_t l = strlen(path);
+		snprintf(path + l, sizeof(path) - l, "/level%03d", d);
+		make_dir(path);
+		for (long i = n * d / depth; i < n * (d + 1) / depth; i++)
+			make_entry(path, i, 0);
+	}
+}
+
+static void make_wide(const char *dir, long n)
+{
+	long width = 1;
+	while (width * width < n)
+		width++;
+	char path[PATH_MAX];
+	for (long d = 0; d < width; d++) {
+		snprintf(path, sizeof(path), "%s/dir%05ld", dir, d);
+		make_dir(path);
+		for (long i = d * width; i < n && i < (d + 1) * width; i++)
+			make_entry(path, i, 0);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 4)
+		die("usage: %s dir flat|long|deep|wide entries", "mktree");
+	long n = atol(argv[3]);
+	if (n <= 0)
+		die("bad number of entries %s", argv[3]);
+	if (snprintf(tree, sizeof(tree), "%s.tmp", argv[1]) >= (int) sizeof(tree))
+		die("%s is too long", argv[1]);
+
+	if (mkdir(tree, 0755)) {
+		if (errno == EEXIST)
+			die("%s is left from an interrupted run, remove it first", tree);
+		fail("make", tree);
+	}
+
+	const char *shape = argv[2];
+	if (!strcmp(shape, "flat"))
+		make_flat(tree, n, 0);
+	else if (!strcmp(shape, "long"))
+		make_flat(tree, n, 1);
+	else if (!strcmp(shape, "deep"))
+		make_deep(tree, n);
+	else if (!strcmp(shape, "wide"))
+		make_wide(tree, n);
+	else
+		die("unknown shape %s", shape);
+
+	if (rename(tree, argv[1]))
+		fail("rename to", argv[1]);
+	return 0;
+}
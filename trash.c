@@ -0,0 +1,687 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "trash.h"
+#include "util.h"
+
+/*
+ * Trash laid out like the freedesktop.org trash: trashed things live in
+ * files/, each with a info/<name>.trashinfo telling where it came from
+ * and when. On top of that an index file holds the same as fixed size
+ * records plus names, so listing, looking up, restoring and purging
+ * never scan or stat the trash. The index is rebuilt from info/ whenever
+ * it is missing, broken or info/ was changed by someone else. Every
+ * change to it counts a generation in its header, by which other ccc
+ * tell they have to load it again.
+ */
+
+#define INDEX_MAGIC "CCCTRSH2"
+#define TRASHINFO ".trashinfo"
+/* Longest name in the trash, its .trashinfo has to fit in NAME_MAX too */
+#define TRASH_NAME_MAX ((int) (NAME_MAX - (sizeof(TRASHINFO) - 1)))
+
+/* Index header, then records one after another */
+typedef struct {
+	char magic[8];
+	int64_t info_sec, info_nsec; /* mtime of info/ as last left by us */
+	uint64_t generation; /* changes made to the index */
+} index_header;
+
+typedef struct {
+	uint32_t length; /* of the whole record */
+	uint8_t live; /* cleared when restored or purged */
+	uint8_t pad[3];
+	int64_t deleted;
+	int64_t size;
+	uint16_t name_length, path_length;
+	/* name and path follow */
+} index_record;
+
+/* A record loaded from the index */
+typedef struct {
+	char *name;
+	char *path;
+	time_t deleted;
+	off_t size;
+	off_t offset; /* of its record in the index */
+	int live;
+	int next; /* next in its hash bucket, -1 ends */
+} record;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char *root = NULL;
+static char *files_dir, *info_dir, *index_path;
+static int info_fd = -1, index_fd = -1;
+static uint64_t generation = 0; /* of the index as we know it */
+static int stale = 0; /* changed by someone else since we loaded it */
+static int max_age_days = 0;
+static off_t max_bytes = 0;
+
+static record *records = NULL;
+static int length = 0, capacity = 0, dead = 0;
+static int *buckets = NULL;
+static int nbuckets = 0;
+
+static unsigned long hash(const char *s)
+{
+	unsigned long h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+static void rehash(void)
+{
+	free(buckets);
+	nbuckets = 1024;
+	while (nbuckets < length * 2)
+		nbuckets *= 2;
+	buckets = memalloc(nbuckets * sizeof(int));
+	memset(buckets, -1, nbuckets * sizeof(int));
+	for (int i = 0; i < length; i++) {
+		unsigned long b = hash(records[i].name) & (nbuckets - 1);
+		records[i].next = buckets[b];
+		buckets[b] = i;
+	}
+}
+
+static record *find(const char *name)
+{
+	if (!nbuckets)
+		return NULL;
+	for (int i = buckets[hash(name) & (nbuckets - 1)]; i != -1; i = records[i].next) {
+		if (records[i].live && !strcmp(records[i].name, name))
+			return &records[i];
+	}
+	return NULL;
+}
+
+static void add_record(const char *name, const char *path, time_t deleted, off_t size, off_t offset, int live)
+{
+	if (length == capacity) {
+		capacity = capacity ? capacity * 2 : 256;
+		records = rememalloc(records, capacity * sizeof(record));
+	}
+	record *r = &records[length];
+	r->name = estrdup((char *) name);
+	r->path = estrdup((char *) path);
+	r->deleted = deleted;
+	r->size = size;
+	r->offset = offset;
+	r->live = live;
+	dead += !live;
+	length++;
+	if (length * 2 > nbuckets) {
+		rehash();
+	} else {
+		unsigned long b = hash(name) & (nbuckets - 1);
+		r->next = buckets[b];
+		buckets[b] = length - 1;
+	}
+}
+
+static void clear_records(void)
+{
+	for (int i = 0; i < length; i++) {
+		free(records[i].name);
+		free(records[i].path);
+	}
+	length = dead = 0;
+	rehash();
+}
+
+/*
+ * Percent-encode path for a .trashinfo, keeping slashes
+ */
+static void encode_path(const char *path, char *out, size_t len)
+{
+	size_t n = 0;
+	for (const unsigned char *c = (const unsigned char *) path; *c && n + 4 < len; c++) {
+		if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9')
+				|| strchr("/-_.~", *c))
+			out[n++] = *c;
+		else
+			n += sprintf(out + n, "%%%02X", *c);
+	}
+	out[n] = '\0';
+}
+
+static void decode_path(char *s)
+{
+	char *out = s;
+	for (; *s; s++) {
+		unsigned int c;
+		if (*s == '%' && sscanf(s + 1, "%2x", &c) == 1) {
+			*out++ = c;
+			s += 2;
+		} else {
+			*out++ = *s;
+		}
+	}
+	*out = '\0';
+}
+
+/*
+ * Remember the mtime of info/ now that we changed it ourselves, and
+ * count a change to the index. Called with the index locked
+ */
+static void stamp_index(void)
+{
+	struct stat st;
+	index_header h;
+	if (fstat(info_fd, &st) == -1 || pread(index_fd, &h, sizeof(h), 0) != sizeof(h))
+		return;
+	/* changes of others since we loaded are picked up next time */
+	if (h.generation != generation)
+		stale = 1;
+	memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+	h.info_sec = st.st_mtim.tv_sec;
+	h.info_nsec = st.st_mtim.tv_nsec;
+	h.generation++;
+	if (pwrite(index_fd, &h, sizeof(h), 0) == sizeof(h))
+		generation = h.generation;
+}
+
+static void append_record(const char *name, const char *path, time_t deleted, off_t size)
+{
+	size_t nlen = strlen(name), plen = strlen(path);
+	index_record rec = { 0 };
+	rec.length = sizeof(rec) + nlen + plen;
+	rec.live = 1;
+	rec.deleted = deleted;
+	rec.size = size;
+	rec.name_length = nlen;
+	rec.path_length = plen;
+	char buf[rec.length];
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), name, nlen);
+	memcpy(buf + sizeof(rec) + nlen, path, plen);
+
+	flock(index_fd, LOCK_EX);
+	off_t offset = lseek(index_fd, 0, SEEK_END);
+	if (offset != -1 && write(index_fd, buf, rec.length) == (ssize_t) rec.length)
+		add_record(name, path, deleted, size, offset, 1);
+	stamp_index();
+	flock(index_fd, LOCK_UN);
+}
+
+/*
+ * Write the index from scratch with only the live records
+ */
+static void write_index(void)
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, PATH_MAX, "%s.tmp", index_path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	FILE *f = fd == -1 ? NULL : fdopen(fd, "w");
+	if (!f) {
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	index_header h = { INDEX_MAGIC, 0, 0, 0 };
+	fwrite(&h, sizeof(h), 1, f);
+	off_t offset = sizeof(h);
+	int live = 0;
+	for (int i = 0; i < length; i++) {
+		record *r = &records[i];
+		if (!r->live)
+			continue;
+		size_t nlen = strlen(r->name), plen = strlen(r->path);
+		index_record rec = { 0 };
+		rec.length = sizeof(rec) + nlen + plen;
+		rec.live = 1;
+		rec.deleted = r->deleted;
+		rec.size = r->size;
+		rec.name_length = nlen;
+		rec.path_length = plen;
+		fwrite(&rec, sizeof(rec), 1, f);
+		fwrite(r->name, 1, nlen, f);
+		fwrite(r->path, 1, plen, f);
+		r->offset = offset;
+		offset += rec.length;
+		records[live++] = *r;
+	}
+	length = live;
+	dead = 0;
+	rehash();
+	if (fclose(f) == 0 && rename(tmp, index_path) == 0) {
+		close(index_fd);
+		index_fd = open(index_path, O_RDWR | O_CLOEXEC);
+		generation = 0;
+		stale = 0;
+		stamp_index();
+	}
+}
+
+/*
+ * Bytes of the regular files under path, as trashing counts them
+ */
+static off_t tree_size(const char *path)
+{
+	struct stat st;
+	if (lstat(path, &st) == -1)
+		return 0;
+	if (!S_ISDIR(st.st_mode))
+		return S_ISREG(st.st_mode) ? st.st_size : 0;
+	DIR *dp = opendir(path);
+	if (!dp)
+		return 0;
+	off_t size = 0;
+	struct dirent *ep;
+	while ((ep = readdir(dp))) {
+		const char *name = ep->d_name;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+			continue;
+		char child[PATH_MAX];
+		if (snprintf(child, PATH_MAX, "%s/%s", path, name) < PATH_MAX)
+			size += tree_size(child);
+	}
+	closedir(dp);
+	return size;
+}
+
+/*
+ * Rebuild the index from the .trashinfo files, the one full scan, and
+ * the one time what is in the trash gets measured
+ */
+static void rebuild_index(void)
+{
+	for (int i = 0; i < length; i++) {
+		free(records[i].name);
+		free(records[i].path);
+	}
+	length = dead = 0;
+
+	int fd = dup(info_fd);
+	DIR *dp = fd == -1 ? NULL : fdopendir(fd);
+	if (dp) {
+		rewinddir(dp);
+		struct dirent *ep;
+		while ((ep = readdir(dp))) {
+			size_t len = strlen(ep->d_name);
+			size_t suffix = sizeof(TRASHINFO) - 1;
+			if (len <= suffix || strcmp(ep->d_name + len - suffix, TRASHINFO))
+				continue;
+			int ifd = openat(info_fd, ep->d_name, O_RDONLY | O_CLOEXEC);
+			FILE *f = ifd == -1 ? NULL : fdopen(ifd, "r");
+			if (!f) {
+				if (ifd != -1)
+					close(ifd);
+				continue;
+			}
+			char line[PATH_MAX * 3 + 16], path[sizeof(line)] = "";
+			struct tm tm = { 0 };
+			time_t deleted = 0;
+			while (fgets(line, sizeof(line), f)) {
+				line[strcspn(line, "\n")] = '\0';
+				if (!strncmp(line, "Path=", 5)) {
+					snprintf(path, sizeof(path), "%s", line + 5);
+					decode_path(path);
+				} else if (!strncmp(line, "DeletionDate=", 13)
+						&& sscanf(line + 13, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+							&tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6) {
+					tm.tm_year -= 1900;
+					tm.tm_mon--;
+					tm.tm_isdst = -1;
+					deleted = mktime(&tm);
+				}
+			}
+			fclose(f);
+
+			char name[NAME_MAX + 1];
+			snprintf(name, sizeof(name), "%.*s", (int) (len - suffix), ep->d_name);
+			char file[PATH_MAX];
+			struct stat st;
+			snprintf(file, PATH_MAX, "%s/%s", files_dir, name);
+			if (lstat(file, &st) == -1)
+				continue; /* info of something long gone */
+			add_record(name, path, deleted, tree_size(file), 0, 1);
+		}
+		closedir(dp);
+	}
+	write_index();
+}
+
+/*
+ * Load the index, or rebuild it if it can't be trusted
+ */
+static void load_index(void)
+{
+	clear_records();
+	struct stat st, info_st;
+	if (fstat(index_fd, &st) == -1 || fstat(info_fd, &info_st) == -1) {
+		rebuild_index();
+		return;
+	}
+	char *buf = memalloc(st.st_size + 1);
+	ssize_t n = pread(index_fd, buf, st.st_size, 0);
+	index_header h;
+	if (n != st.st_size || n < (ssize_t) sizeof(h)) {
+		free(buf);
+		rebuild_index();
+		return;
+	}
+	memcpy(&h, buf, sizeof(h));
+	if (memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic)) || h.info_sec != info_st.st_mtim.tv_sec
+			|| h.info_nsec != info_st.st_mtim.tv_nsec) {
+		free(buf);
+		rebuild_index();
+		return;
+	}
+
+	off_t offset = sizeof(h);
+	while (offset + (off_t) sizeof(index_record) <= n) {
+		index_record rec;
+		memcpy(&rec, buf + offset, sizeof(rec));
+		if (rec.length != sizeof(rec) + rec.name_length + rec.path_length
+				|| offset + rec.length > n || !rec.name_length) {
+			free(buf);
+			rebuild_index();
+			return;
+		}
+		char *name = buf + offset + sizeof(rec);
+		char name_s[rec.name_length + 1], path_s[rec.path_length + 1];
+		memcpy(name_s, name, rec.name_length);
+		name_s[rec.name_length] = '\0';
+		memcpy(path_s, name + rec.name_length, rec.path_length);
+		path_s[rec.path_length] = '\0';
+		add_record(name_s, path_s, rec.deleted, rec.size, offset, rec.live);
+		offset += rec.length;
+	}
+	free(buf);
+	generation = h.generation;
+	stale = 0;
+}
+
+/*
+ * Reload the index if another ccc changed it since
+ */
+static void refresh(void)
+{
+	struct stat st;
+	if (stat(index_path, &st) == -1) {
+		rebuild_index();
+		return;
+	}
+	struct stat cur;
+	index_header h;
+	if (fstat(index_fd, &cur) == -1 || cur.st_ino != st.st_ino) {
+		close(index_fd);
+		index_fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	} else if (!stale && pread(index_fd, &h, sizeof(h), 0) == sizeof(h)
+			&& h.generation == generation) {
+		return;
+	}
+	flock(index_fd, LOCK_SH);
+	load_index();
+	flock(index_fd, LOCK_UN);
+}
+
+/*
+ * Open the trash in dir, creating it if needed. Things older than
+ * max_age days, or the oldest beyond max_size bytes, are selected for
+ * purging, 0 for no limit.
+ * Returns nonzero if it can't be used
+ */
+int trash_init(const char *dir, int max_age, off_t max_size)
+{
+	pthread_mutex_lock(&lock);
+	size_t len = strlen(dir) + 16;
+	root = estrdup((char *) dir);
+	files_dir = memalloc(len);
+	info_dir = memalloc(len);
+	index_path = memalloc(len);
+	/* the trash dir may end with a slash */
+	const char *sep = len > 16 && dir[len - 17] == '/' ? "" : "/";
+	snprintf(files_dir, len, "%s%sfiles", dir, sep);
+	snprintf(info_dir, len, "%s%sinfo", dir, sep);
+	snprintf(index_path, len, "%s%sindex", dir, sep);
+	max_age_days = max_age;
+	max_bytes = max_size;
+
+	mkdir(dir, 0700);
+	mkdir(files_dir, 0700);
+	mkdir(info_dir, 0700);
+	info_fd = open(info_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	index_fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (info_fd == -1 || index_fd == -1) {
+		pthread_mutex_unlock(&lock);
+		trash_cleanup();
+		return 1;
+	}
+	rehash();
+	flock(index_fd, LOCK_EX);
+	load_index();
+	flock(index_fd, LOCK_UN);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+void trash_cleanup(void)
+{
+	if (!root)
+		return;
+	/* leave a tidy index behind if it is mostly dead records */
+	if (index_fd != -1 && dead > 1024 && dead > length / 2) {
+		flock(index_fd, LOCK_EX);
+		write_index();
+		flock(index_fd, LOCK_UN);
+	}
+	clear_records();
+	free(records);
+	free(buckets);
+	records = NULL;
+	buckets = NULL;
+	nbuckets = capacity = 0;
+	if (info_fd != -1)
+		close(info_fd);
+	if (index_fd != -1)
+		close(index_fd);
+	info_fd = index_fd = -1;
+	free(root);
+	free(files_dir);
+	free(info_dir);
+	free(index_path);
+	root = NULL;
+}
+
+/*
+ * Directory trashed things are kept in, NULL if there is no trash
+ */
+const char *trash_files(void)
+{
+	return root ? files_dir : NULL;
+}
+
+/*
+ * Pick a free name in the trash for path by creating its .trashinfo
+ * Returns nonzero with errno set on failure, name holds NAME_MAX + 1 bytes
+ */
+int trash_reserve(const char *path, char *name)
+{
+	const char *base = strrchr(path, '/');
+	base = base && base[1] ? base + 1 : path;
+	char info[NAME_MAX + 1];
+	int fd = -1;
+
+	pthread_mutex_lock(&lock);
+	for (long i = 1; fd == -1; i++) {
+		/* names too long for their info are cut */
+		if (i == 1)
+			snprintf(name, NAME_MAX + 1, "%.*s", TRASH_NAME_MAX, base);
+		else
+			snprintf(name, NAME_MAX + 1, "%.*s.%ld", TRASH_NAME_MAX - 21, base, i);
+		/* numbers already in the index are taken, no need to try them */
+		if (find(name))
+			continue;
+		snprintf(info, sizeof(info), "%s" TRASHINFO, name);
+		fd = openat(info_fd, info, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (fd == -1 && errno != EEXIST)
+			break;
+		char file[PATH_MAX];
+		struct stat st;
+		snprintf(file, PATH_MAX, "%s/%s", files_dir, name);
+		if (fd != -1 && lstat(file, &st) == 0) {
+			/* something without info is in the way */
+			close(fd);
+			unlinkat(info_fd, info, 0);
+			fd = -1;
+		}
+	}
+	if (fd == -1) {
+		pthread_mutex_unlock(&lock);
+		return 1;
+	}
+
+	char encoded[PATH_MAX * 3], date[32];
+	time_t now = time(NULL);
+	encode_path(path, encoded, sizeof(encoded));
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	dprintf(fd, "[Trash Info]\nPath=%s\nDeletionDate=%s\n", encoded, date);
+	close(fd);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+/*
+ * Record that path is now in the trash as name, taking size bytes
+ */
+void trash_commit(const char *name, const char *path, off_t size)
+{
+	pthread_mutex_lock(&lock);
+	append_record(name, path, time(NULL), size);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Give back a name from trash_reserve() that wasn't used
+ */
+void trash_abort(const char *name)
+{
+	char info[NAME_MAX + sizeof(TRASHINFO)];
+	snprintf(info, sizeof(info), "%s" TRASHINFO, name);
+	pthread_mutex_lock(&lock);
+	unlinkat(info_fd, info, 0);
+	flock(index_fd, LOCK_EX);
+	stamp_index();
+	flock(index_fd, LOCK_UN);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Where name in the trash came from, path holds PATH_MAX bytes
+ * Returns nonzero if it isn't in the trash
+ */
+int trash_origin(const char *name, char *path)
+{
+	pthread_mutex_lock(&lock);
+	refresh();
+	record *r = find(name);
+	if (r)
+		snprintf(path, PATH_MAX, "%s", r->path);
+	pthread_mutex_unlock(&lock);
+	return !r;
+}
+
+/*
+ * Forget name once it left the trash, restored or purged
+ */
+void trash_forget(const char *name)
+{
+	char info[NAME_MAX + sizeof(TRASHINFO)];
+	snprintf(info, sizeof(info), "%s" TRASHINFO, name);
+	pthread_mutex_lock(&lock);
+	unlinkat(info_fd, info, 0);
+	flock(index_fd, LOCK_EX);
+	record *r = find(name);
+	if (r) {
+		uint8_t live = 0;
+		pwrite(index_fd, &live, 1, r->offset + offsetof(index_record, live));
+		r->live = 0;
+		dead++;
+	}
+	stamp_index();
+	flock(index_fd, LOCK_UN);
+	pthread_mutex_unlock(&lock);
+}
+
+static int newest_first(const void *a, const void *b)
+{
+	const trash_entry *x = a, *y = b;
+	return (y->deleted > x->deleted) - (y->deleted < x->deleted);
+}
+
+/*
+ * Everything in the trash, newest first
+ * Returns the number of entries, free them with trash_list_free()
+ */
+int trash_list(trash_entry **entries)
+{
+	pthread_mutex_lock(&lock);
+	if (!root) {
+		pthread_mutex_unlock(&lock);
+		*entries = NULL;
+		return 0;
+	}
+	refresh();
+	trash_entry *list = memalloc((length - dead + 1) * sizeof(trash_entry));
+	int n = 0;
+	for (int i = 0; i < length; i++) {
+		if (!records[i].live)
+			continue;
+		list[n].name = estrdup(records[i].name);
+		list[n].path = estrdup(records[i].path);
+		list[n].deleted = records[i].deleted;
+		list[n].size = records[i].size;
+		n++;
+	}
+	pthread_mutex_unlock(&lock);
+	qsort(list, n, sizeof(trash_entry), newest_first);
+	*entries = list;
+	return n;
+}
+
+void trash_list_free(trash_entry *entries, int n)
+{
+	for (int i = 0; i < n; i++) {
+		free(entries[i].name);
+		free(entries[i].path);
+	}
+	free(entries);
+}
+
+/*
+ * Names of everything, or of what is past the age and size limits
+ * Returns how many, free them and *names
+ */
+int trash_select(int all, char ***names)
+{
+	trash_entry *list;
+	int n = trash_list(&list);
+	char **out = memalloc((n + 1) * sizeof(char *));
+	int count = 0;
+	time_t cutoff = max_age_days ? time(NULL) - (time_t) max_age_days * 86400 : 0;
+	off_t total = 0;
+	/* newest first, so what overflows the cap is the oldest */
+	for (int i = 0; i < n; i++) {
+		total += list[i].size;
+		if (all || list[i].deleted < cutoff || (max_bytes && total > max_bytes))
+			out[count++] = estrdup(list[i].name);
+	}
+	trash_list_free(list, n);
+	*names = out;
+	return count;
+}
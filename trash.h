@@ -0,0 +1,27 @@
+#ifndef TRASH_H_
+#define TRASH_H_
+
+#include <time.h>
+#include <sys/types.h>
+
+/* Something in the trash */
+typedef struct {
+	char *name; /* in the files directory */
+	char *path; /* where it was */
+	time_t deleted;
+	off_t size;
+} trash_entry;
+
+int trash_init(const char *dir, int max_age, off_t max_size);
+void trash_cleanup(void);
+const char *trash_files(void);
+int trash_reserve(const char *path, char *name);
+void trash_commit(const char *name, const char *path, off_t size);
+void trash_abort(const char *name);
+int trash_origin(const char *name, char *path);
+void trash_forget(const char *name);
+int trash_list(trash_entry **entries);
+void trash_list_free(trash_entry *entries, int n);
+int trash_select(int all, char ***names);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 
+#define LEN(x) (sizeof(x) / sizeof(*(x)))
+
 void die(char *reason);
 void *memalloc(size_t size);
 void *estrdup(void *ptr);